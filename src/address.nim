@@ -144,6 +144,50 @@ proc getAddressHash160*(script: Script | Chunks): tuple[hash160: Hash160, addres
       elif chunks[1].data.len == 32:
         return (ripemd160hash(chunks[1].data), AddressType.P2WPKH)
 
+proc scriptEnd(data: ptr UncheckedArray[byte], pos, size: int): bool =
+  # true if getScriptChunks stops adding chunks at pos
+  if pos >= size:
+    return true
+  let bval = data[pos]
+  let op = OpcodeMap[bval]
+  let left = size - pos - 1
+  if bval < OP_PUSHDATA1.ord and bval > 0:
+    result = left < bval.int
+  elif op == OP_PUSHDATA1:
+    result = left < 1
+  elif op == OP_PUSHDATA2:
+    result = left < 2
+  elif op == OP_PUSHDATA4:
+    result = left < 4
+  else:
+    result = op == NA
+
+proc getAddressHash160*(script: ScriptView): tuple[hash160: Hash160, addressType: AddressType] =
+  ## Same result as the Chunks version, matched on the raw script bytes.
+  let d = script.data
+  let size = script.len
+  if size >= 25 and d[0] == OP_DUP.ord and d[1] == OP_HASH160.ord and d[2] == 20 and
+    d[23] == OP_EQUALVERIFY.ord and d[24] == OP_CHECKSIG.ord and scriptEnd(d, 25, size):
+
+    return (Hash160(cast[ptr UncheckedArray[byte]](addr d[3]).toBytes(20)), AddressType.P2PKH)
+
+  elif size >= 23 and d[0] == OP_HASH160.ord and d[1] == 20 and d[22] == OP_EQUAL.ord and
+    scriptEnd(d, 23, size):
+
+    return (Hash160(cast[ptr UncheckedArray[byte]](addr d[2]).toBytes(20)), AddressType.P2SH)
+
+  elif size >= 35 and d[0] == 33 and d[34] == OP_CHECKSIG.ord and scriptEnd(d, 35, size):
+
+    return (ripemd160hash(cast[ptr UncheckedArray[byte]](addr d[1]).toBytes(33)), AddressType.P2PKH)
+
+  elif size >= 22 and d[0] == OP_0.ord and d[1] == 20 and scriptEnd(d, 22, size):
+
+    return (Hash160(cast[ptr UncheckedArray[byte]](addr d[2]).toBytes(20)), AddressType.P2WPKH)
+
+  elif size >= 34 and d[0] == OP_0.ord and d[1] == 32 and scriptEnd(d, 34, size):
+
+    return (ripemd160hash(cast[ptr UncheckedArray[byte]](addr d[2]).toBytes(32)), AddressType.P2WPKH)
+
 proc getAddress*(network: Network, script: Script | Chunks): string =
   var addrHash = getAddressHash160(script)
   case addrHash.addressType
@@ -0,0 +1,77 @@
+# Copyright (c) 2022 zenywallet
+
+# Rewrites the addrlog rows of an existing database to the extended format,
+# so the addrlog history is read with a single range scan. Run it while
+# blockstor is stopped, and build blockstor with -d:ADDRLOG_EXT afterwards to
+# keep writing the extended rows. An interrupted migration resumes from the
+# last committed key.
+#
+#   nim c -r src/addrlog_migrate.nim BitZeny_mainnet [BitZeny_testnet ...]
+
+import os
+import bytes, db
+
+const DATA_DIR = "data"
+const ADDRLOG_MIGRATE_BATCH {.intdefine.} = 100_000
+
+type
+  AddrlogMigrateError* = object of CatchableError
+
+proc migrateAddrlogs*(dbInst: DbInst): int {.discardable.} =
+  ## Returns the number of converted rows.
+  dbInst.recoverBatch()
+  let endkey = BytesBE(Prefix.addrlogs)
+  var startkey = endkey
+  let retParam = dbInst.getParam(ParamId.AddrlogMigrate)
+  if retParam.err == DbStatus.Success and retParam.res.len == 30:
+    startkey = retParam.res
+    echo "resume"
+  var cache = initAddrlogExtCache()
+  while true:
+    var rows: seq[DbBatchRow]
+    var lastKey: seq[byte]
+    var scanned = 0
+    for d in dbInst.gets(startkey, endkey):
+      if d.key == startkey:
+        continue
+      if d.key.len != 30:
+        break
+      lastKey = d.key
+      if d.val.len != ADDRLOG_EXT_VAL_LEN:
+        rows.add((d.key, d.val))
+      inc(scanned)
+      if scanned >= ADDRLOG_MIGRATE_BATCH:
+        break
+    if scanned == 0:
+      break
+
+    let dbBatch = dbInst.newBatch()
+    for row in rows:
+      var key = row.key
+      let id = key[^9].toUint64BE
+      let retExt = dbBatch.getAddrlogExt(id, cache)
+      if retExt.err == DbStatus.NotFound:
+        raise newException(AddrlogMigrateError, "addrlog ext not found " & $id)
+      let ext = retExt.res
+      dbBatch.put(row.key, row.val[0..8] & BytesBE(ext.height.uint32, ext.time, ext.mined, ext.txid))
+    dbBatch.setParam(ParamId.AddrlogMigrate, lastKey)
+    dbBatch.commit()
+    result = result + rows.len
+    startkey = lastKey
+    echo "addrlogs ", result
+
+  dbInst.delParam(ParamId.AddrlogMigrate)
+
+
+when isMainModule:
+  if paramCount() < 1:
+    echo "usage: addrlog_migrate <network> [<network> ...]"
+    quit(QuitFailure)
+
+  for i in 1..paramCount():
+    let name = paramStr(i)
+    echo "db open ", name
+    var dbInst = db.open(DATA_DIR, name)
+    let count = dbInst.migrateAddrlogs()
+    echo "migrated ", name, " addrlogs=", count
+    dbInst.close()
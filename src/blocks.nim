@@ -2,6 +2,7 @@
 
 import sequtils, json
 import tx, bytes, reader, address, script, utils
+import sha256d_native
 
 type
   BlockHash* = distinct seq[byte]
@@ -38,6 +39,23 @@ type
     bits*: uint32
     nonce*: uint32
 
+  AddrHashObj* = object
+    hash160*: array[20, byte]
+    addressType*: AddressType
+
+  # offsets into a raw block buffer, valid while the buffer is alive
+  BlockView* = ref object
+    data*: ptr UncheckedArray[byte]
+    size*: int
+    header*: ptr BlockHeaderObj
+    txn*: VarInt
+    txs*: seq[TxView]
+    ins: seq[TxInView]
+    outs: seq[TxOutView]
+    # optional, precomputed by the tcp parse workers
+    txidsPre*: ptr UncheckedArray[array[32, byte]]
+    addrHashesPre*: ptr UncheckedArray[AddrHashObj]
+
 proc toBytes*(o: BlockHash | MerkleHash): seq[byte] {.inline.} = cast[seq[byte]](o)
 proc toBytesBE*(o: BlockHash | MerkleHash): seq[byte] {.inline.} = cast[seq[byte]](o)
 proc toBytes*(o: BlockHashObj | MerkleHashObj): seq[byte] {.inline.} = cast[array[32, byte]](o).toBytes
@@ -91,6 +109,81 @@ proc toBlock*(data: ptr UncheckedArray[byte], size: int): Block {.inline.} =
   var reader = newReader(data, size)
   reader.toBlock()
 
+proc toBlockView*(data: ptr UncheckedArray[byte], size: int): BlockView =
+  ## Parses only the offsets of the block, no per-tx allocation.
+  var reader = newReader(data, size)
+  var b = new BlockView
+  b.data = data
+  b.size = size
+  b.header = cast[ptr BlockHeaderObj](data)
+  reader.skip(sizeof(BlockHeaderObj))
+  b.txn = VarInt(reader.getVarInt)
+  b.txs = newSeqOfCap[TxView](b.txn.int)
+  for i in 0..<b.txn.int:
+    b.txs.add(reader.toTxView(b.ins, b.outs))
+  for i in 0..<b.txs.len:
+    let insEnd = if i + 1 < b.txs.len: b.txs[i + 1].ins.len else: b.ins.len
+    let outsEnd = if i + 1 < b.txs.len: b.txs[i + 1].outs.len else: b.outs.len
+    b.txs[i].setViews(b.ins, b.outs, insEnd, outsEnd)
+  result = b
+
+proc toBlockView*(data: var seq[byte]): BlockView {.inline.} =
+  toBlockView(cast[ptr UncheckedArray[byte]](addr data[0]), data.len)
+
+proc outsLen*(blk: BlockView): int {.inline.} = blk.outs.len
+
+proc txidBins*(blk: BlockView): seq[array[32, byte]] =
+  ## All txids of the block in one batch hash. Witness txs are stripped
+  ## into a single buffer sized before any pointer into it is taken.
+  if not blk.txidsPre.isNil:
+    result = newSeq[array[32, byte]](blk.txs.len)
+    copyMem(addr result[0], blk.txidsPre, sizeof(array[32, byte]) * blk.txs.len)
+    return
+  var stripSize = 0
+  for tx in blk.txs:
+    if tx.flags.uint8 != 0'u8:
+      stripSize.inc(4 + (tx.outsEnd - tx.insPos) + 4)
+  var strip = newSeqUninitialized[byte](stripSize)
+  var stripPos = 0
+  var datas = newSeqOfCap[ptr UncheckedArray[byte]](blk.txs.len)
+  var sizes = newSeqOfCap[int](blk.txs.len)
+  for tx in blk.txs:
+    if tx.flags.uint8 == 0'u8:
+      datas.add(cast[ptr UncheckedArray[byte]](addr tx.data[tx.pos]))
+      sizes.add(tx.size)
+    else:
+      let insSize = tx.outsEnd - tx.insPos
+      let p = cast[ptr UncheckedArray[byte]](addr strip[stripPos])
+      copyMem(addr p[0], addr tx.data[tx.pos], 4)
+      copyMem(addr p[4], addr tx.data[tx.insPos], insSize)
+      copyMem(addr p[4 + insSize], addr tx.data[tx.pos + tx.size - 4], 4)
+      datas.add(p)
+      sizes.add(4 + insSize + 4)
+      stripPos.inc(4 + insSize + 4)
+  result = newSeq[array[32, byte]](blk.txs.len)
+  sha256dBatch(datas, sizes, result)
+
+proc toAddrHashObj*(addrHash: tuple[hash160: Hash160, addressType: AddressType]): AddrHashObj =
+  let h = addrHash.hash160.toBytes
+  if h.len == 20:
+    copyMem(addr result.hash160[0], unsafeAddr h[0], 20)
+  result.addressType = addrHash.addressType
+
+proc addrHash*(blk: BlockView, tx: TxView, n: int): tuple[hash160: Hash160, addressType: AddressType] =
+  if blk.addrHashesPre.isNil:
+    result = getAddressHash160(tx.outs[n].script)
+  else:
+    let a = addr blk.addrHashesPre[tx.outsIdx + n]
+    if a.addressType == AddressType.Unknown:
+      result = (Hash160(@[]), AddressType.Unknown)
+    else:
+      result = (Hash160(@(a.hash160)), a.addressType)
+
+proc addrHashes*(blk: BlockView, output: ptr UncheckedArray[AddrHashObj]) =
+  ## Address hashes of all outputs in block order, outsLen entries.
+  for i, o in blk.outs:
+    output[i] = getAddressHash160(o.script).toAddrHashObj
+
 proc `%`*(o: BlockHash | MerkleHash): JsonNode = newJString($toReverse(cast[seq[byte]](o)))
 
 proc `%`*(o: BlockHashObj | MerkleHashObj): JsonNode = newJString($toReverse(o.toBytes))
@@ -108,19 +201,30 @@ proc toJson*(blk: Block, network: Network): JsonNode =
       p["addrs"] = %network.getAddresses(chunks)
   json
 
-proc merkle*(txids: seq[seq[byte]]): MerkleHash =
-  var list = txids
-  while list.len > 1:
-    var tmplist: seq[seq[byte]]
-    for i in countup(0, list.len - 2, 2):
-      tmplist.add(sha256d(concat(list[i], list[i + 1])).toSeq)
-    if list.len mod 2 == 1:
-      tmplist.add(sha256d(concat(list[^1], list[^1])).toSeq)
-    list = tmplist
-  result = MerkleHash(list[0])
+proc merkle*(txids: seq[array[32, byte]] | seq[seq[byte]]): MerkleHash =
+  # each level is hashed as one batch of 64-byte pairs
+  var n = txids.len
+  var buf = newSeqUninitialized[byte]((n + 1) * 32)
+  var next = newSeqUninitialized[byte]((n + 1) div 2 * 32 + 32)
+  for i, txid in txids:
+    copyMem(addr buf[i * 32], unsafeAddr txid[0], 32)
+  while n > 1:
+    if n mod 2 == 1:
+      copyMem(addr buf[n * 32], addr buf[(n - 1) * 32], 32)
+      inc(n)
+    n = n div 2
+    sha256d64(cast[ptr UncheckedArray[byte]](addr next[0]), cast[ptr UncheckedArray[byte]](addr buf[0]), n)
+    swap(buf, next)
+  result = MerkleHash(buf[0..<32])
 
 proc `==`*(x, y: BlockHash | MerkleHash): bool = x.toBytes == y.toBytes
 
+proc `==`*(x: BlockHash, y: BlockHashObj): bool =
+  let b = x.toBytes
+  b.len == 32 and equalMem(unsafeAddr b[0], unsafeAddr y, 32)
+
+proc `==`*(x: BlockHashObj, y: BlockHash): bool {.inline.} = y == x
+
 
 when isMainModule:
   # bitcoin-cli getblockhash 100000
@@ -153,3 +257,14 @@ when isMainModule:
   b.txs.add(tx2.Hex.toBytes.toTx)
 
   assert b.toBytes.toHex == blockRawString
+
+  var blkData = blockRawString.Hex.toBytes
+  var blkView = blkData.toBlockView
+  assert blkView.txs.len == blk.txs.len
+  for i, tx in blkView.txs:
+    assert tx.txidBin == blk.txs[i].txidBin
+    for n, o in tx.outs:
+      let addrHash = o.script.getAddressHash160
+      let addrHashBlk = blk.txs[i].outs[n].script.getAddressHash160
+      assert addrHash.hash160.toBytes == addrHashBlk.hash160.toBytes
+      assert addrHash.addressType == addrHashBlk.addressType
@@ -4,8 +4,11 @@ import os, times, tables, terminal
 import bytes, tcp, rpc, db
 import address, blocks, tx
 import mempool
+import utxocache
+import bulkindex
 import posix
 import server
+import streambin
 import monitor
 import utils
 import sequtils
@@ -31,6 +34,19 @@ for node in nodes:
 
 const DATA_DIR = "data"
 
+when not declared(DB_BATCH_BLOCKS):
+  const DB_BATCH_BLOCKS = 100
+when not declared(DB_BATCH_MAX_OPS):
+  const DB_BATCH_MAX_OPS = 1_000_000
+when not declared(ADDRVAL_DELTAS_MAX):
+  const ADDRVAL_DELTAS_MAX = 2_000_000 # addresses aggregated in memory per batch
+when not declared(UNDO_BLOCKS):
+  const UNDO_BLOCKS = 1000 # recent blocks that can be rolled back without rpc
+when not declared(UTXO_CACHE_SIZE):
+  const UTXO_CACHE_SIZE = 256 * 1024 * 1024 # bytes per network
+when not declared(MEMPOOL_SNAPSHOT_INTERVAL):
+  const MEMPOOL_SNAPSHOT_INTERVAL = 300 # seconds
+
 if not dirExists(DATA_DIR):
   createDir(DATA_DIR)
 
@@ -67,6 +83,14 @@ proc aggregate(addrvals: seq[AddrVal]): seq[AddrVal] =
   for v in t.values:
     result.add(v[])
 
+template setAddrlogRow(dbBatch: DbBatch, hash160: Hash160, sid: uint64, trans: uint8, value: uint64,
+                      addressType: uint8, height: int, time: untyped, idx: int, txid: untyped) =
+  ## Writes the extended addrlog row when built with -d:ADDRLOG_EXT.
+  when ADDRLOG_EXT:
+    dbBatch.setAddrlog(hash160, sid, trans, value, addressType, height, time.uint32, uint8(idx == 0), txid)
+  else:
+    dbBatch.setAddrlog(hash160, sid, trans, value, addressType)
+
 proc aggregate(addrvals: seq[AddrValRollback]): seq[AddrValRollback] =
   var t = initTable[seq[byte], ref AddrValRollback]()
   for a in addrvals:
@@ -82,19 +106,31 @@ proc aggregate(addrvals: seq[AddrValRollback]): seq[AddrValRollback] =
   for v in t.values:
     result.add(v[])
 
-proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id: uint64) =
-  dbInst.setBlockHash(height, hash, blk.header.time, seq_id)
+proc writeBlock(dbBatch: DbBatch, utxoCache: var UtxoCache, addrvalDeltas: var AddrValDeltas, height: int, hash: BlockHash, blk: Block | BlockView, seq_id: uint64) =
+  dbBatch.setBlockHash(height, hash, blk.header.time, seq_id)
 
   var addrouts = newSeq[seq[AddrVal]](blk.txs.len)
   var addrins = newSeq[seq[AddrVal]](blk.txs.len)
+  var txidList: seq[Hash] # txids of the extended addrlog rows, only filled with ADDRLOG_EXT
+  when ADDRLOG_EXT:
+    txidList.setLen(blk.txs.len)
+  var spents: seq[UndoSpent]
 
   if blk.txs.len != blk.txn.int:
     raise newException(BlockParserError, "txn conflict")
 
+  when blk is BlockView:
+    let txids = blk.txidBins()
+
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
-    var txid = Hash(tx.txidBin)
-    dbInst.setId(sid, txid)
+    when blk is BlockView:
+      var txid = Hash(@(txids[idx]))
+    else:
+      var txid = Hash(tx.txidBin)
+    dbBatch.setId(sid, txid)
+    when ADDRLOG_EXT:
+      txidList[idx] = txid
     var addrvals: seq[AddrVal]
     var dustCount = 0
     for n, o in tx.outs:
@@ -103,13 +139,16 @@ proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id
           break
         inc(dustCount)
     if dustCount >= 2:
-      dbInst.setTx(txid, height, sid, 1.uint8)
+      dbBatch.setTx(txid, height, sid, 1.uint8)
     else:
-      dbInst.setTx(txid, height, sid)
+      dbBatch.setTx(txid, height, sid)
       for n, o in tx.outs:
-        var addrHash = getAddressHash160(o.script)
-        dbInst.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
-        dbInst.setUnspent(addrHash.hash160, sid, n.uint32, o.value)
+        when blk is BlockView:
+          var addrHash = blk.addrHash(tx, n)
+        else:
+          var addrHash = getAddressHash160(o.script)
+        dbBatch.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
+        utxoCache.add(txid, n.uint32, sid, o.value, addrHash.hash160, uint8(addrHash.addressType))
         addrvals.add((addrHash.hash160, uint8(addrHash.addressType), o.value, 1'u32))
 
     addrouts[idx] = addrvals.aggregate
@@ -117,13 +156,20 @@ proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id
   for idx, tx in blk.txs:
     var addrvals: seq[AddrVal]
     for i in tx.ins:
-      var in_txid = i.tx
+      var in_txid = i.prevHash
       var n = i.n
 
       if n == 0xffffffff'u32:
-        dbInst.setMinedId(seq_id + idx.uint64, height)
+        dbBatch.setMinedId(seq_id + idx.uint64, height)
       else:
-        var ret_tx = dbInst.getTx(in_txid)
+        var ret_utxo = utxoCache.spend(dbBatch, in_txid, n)
+        if ret_utxo.err == DbStatus.Success:
+          addrvals.add((ret_utxo.res.address_hash, ret_utxo.res.address_type, ret_utxo.res.value, 1'u32))
+          spents.add((idx.uint32, ret_utxo.res.id, n, ret_utxo.res.value,
+                      ret_utxo.res.address_hash, ret_utxo.res.address_type))
+          continue
+
+        var ret_tx = dbBatch.getTx(in_txid)
         if ret_tx.err == DbStatus.NotFound:
           raise newException(BlockParserError, "id not found " & $in_txid)
         if ret_tx.res.skip == 1:
@@ -131,12 +177,14 @@ proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id
           continue
 
         var id = ret_tx.res.id
-        var ret_txout = dbInst.getTxout(id, n)
+        var ret_txout = dbBatch.getTxout(id, n)
         if ret_txout.err == DbStatus.NotFound:
           raise newException(BlockParserError, "txout not found " & $id)
 
-        dbInst.delUnspent(ret_txout.res.address_hash, id, n)
+        dbBatch.delUnspent(ret_txout.res.address_hash, id, n)
         addrvals.add((ret_txout.res.address_hash, ret_txout.res.address_type, ret_txout.res.value, 1'u32))
+        spents.add((idx.uint32, id, n, ret_txout.res.value,
+                    ret_txout.res.address_hash, ret_txout.res.address_type))
 
     addrins[idx] = addrvals.aggregate
 
@@ -146,15 +194,9 @@ proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id
     var addrvals = addrouts[idx]
     for addrval in addrvals:
       var hash160 = addrval.hash160
-      var addressType = uint8(addrval.addressType)
-      var value = addrval.value
-      var utxo_count = addrval.utxo_count
-      var ret_addrval = dbInst.getAddrval(hash160)
-      if ret_addrval.err == DbStatus.NotFound:
-        dbInst.setAddrval(hash160, value, utxo_count)
-      else:
-        dbInst.setAddrval(hash160, ret_addrval.res.value + value, ret_addrval.res.utxo_count + utxo_count)
-      dbInst.setAddrlog(hash160, sid, 1, value, addressType)
+      addrvalDeltas.add(hash160, addrval.value, addrval.utxo_count, height)
+      dbBatch.setAddrlogRow(hash160, sid, 1, addrval.value, uint8(addrval.addressType),
+                            height, blk.header.time, idx, txidList[idx])
 
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
@@ -162,21 +204,23 @@ proc writeBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id
     var addrvals = addrins[idx]
     for addrval in addrvals:
       var hash160 = addrval.hash160
-      var addressType = uint8(addrval.addressType)
-      var value = addrval.value
-      var utxo_count = addrval.utxo_count
-      var ret_addrval = dbInst.getAddrval(hash160)
-      if ret_addrval.err == DbStatus.NotFound:
-        raise newException(BlockParserError, "address not found " & $hash160)
-      else:
-        dbInst.setAddrval(hash160, ret_addrval.res.value - value, ret_addrval.res.utxo_count - utxo_count)
-      dbInst.setAddrlog(hash160, sid, 0, value, addressType)
+      addrvalDeltas.sub(hash160, addrval.value, addrval.utxo_count)
+      dbBatch.setAddrlogRow(hash160, sid, 0, addrval.value, uint8(addrval.addressType),
+                            height, blk.header.time, idx, txidList[idx])
 
-proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id: uint64) =
-  dbInst.setBlockHash(height, hash, blk.header.time, seq_id)
+  # new addrvals of the block are known when the deltas are merged
+  dbBatch.setUndoSpents(height, blk.txs.len, spents)
+  if height >= UNDO_BLOCKS:
+    dbBatch.delUndo(height - UNDO_BLOCKS)
+
+proc rewriteBlock(dbBatch: DbBatch, height: int, hash: BlockHash, blk: Block, seq_id: uint64) =
+  dbBatch.setBlockHash(height, hash, blk.header.time, seq_id)
 
   var addrouts = newSeq[seq[AddrVal]](blk.txs.len)
   var addrins = newSeq[seq[AddrVal]](blk.txs.len)
+  var txidList: seq[Hash] # txids of the extended addrlog rows, only filled with ADDRLOG_EXT
+  when ADDRLOG_EXT:
+    txidList.setLen(blk.txs.len)
 
   if blk.txs.len != blk.txn.int:
     raise newException(BlockParserError, "txn conflict")
@@ -184,7 +228,9 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
     var txid = Hash(tx.txidBin)
-    dbInst.setId(sid, txid)
+    dbBatch.setId(sid, txid)
+    when ADDRLOG_EXT:
+      txidList[idx] = txid
     var addrvals: seq[AddrVal]
     var dustCount = 0
     for n, o in tx.outs:
@@ -193,13 +239,13 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
           break
         inc(dustCount)
     if dustCount >= 2:
-      dbInst.setTx(txid, height, sid, 1.uint8)
+      dbBatch.setTx(txid, height, sid, 1.uint8)
     else:
-      dbInst.setTx(txid, height, sid)
+      dbBatch.setTx(txid, height, sid)
       for n, o in tx.outs:
         var addrHash = getAddressHash160(o.script)
-        dbInst.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
-        dbInst.setUnspent(addrHash.hash160, sid, n.uint32, o.value)
+        dbBatch.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
+        dbBatch.setUnspent(addrHash.hash160, sid, n.uint32, o.value)
         addrvals.add((addrHash.hash160, uint8(addrHash.addressType), o.value, 1'u32))
 
     addrouts[idx] = addrvals.aggregate
@@ -211,9 +257,9 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
       var n = i.n
 
       if n == 0xffffffff'u32:
-        dbInst.setMinedId(seq_id + idx.uint64, height)
+        dbBatch.setMinedId(seq_id + idx.uint64, height)
       else:
-        var ret_tx = dbInst.getTx(in_txid)
+        var ret_tx = dbBatch.getTx(in_txid)
         if ret_tx.err == DbStatus.NotFound:
           raise newException(BlockParserError, "id not found " & $in_txid)
         if ret_tx.res.skip == 1:
@@ -221,11 +267,11 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
           continue
 
         var id = ret_tx.res.id
-        var ret_txout = dbInst.getTxout(id, n)
+        var ret_txout = dbBatch.getTxout(id, n)
         if ret_txout.err == DbStatus.NotFound:
           raise newException(BlockParserError, "txout not found " & $id)
 
-        dbInst.delUnspent(ret_txout.res.address_hash, id, n)
+        dbBatch.delUnspent(ret_txout.res.address_hash, id, n)
         addrvals.add((ret_txout.res.address_hash, ret_txout.res.address_type, ret_txout.res.value, 1'u32))
 
     addrins[idx] = addrvals.aggregate
@@ -242,7 +288,7 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
       var value = addrval.value
       var utxo_count = addrval.utxo_count
       addrHashes.add(hash160)
-      dbInst.setAddrlog(hash160, sid, 1, value, addressType)
+      dbBatch.setAddrlogRow(hash160, sid, 1, value, addressType, height, blk.header.time, idx, txidList[idx])
 
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
@@ -254,30 +300,43 @@ proc rewriteBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_
       var value = addrval.value
       var utxo_count = addrval.utxo_count
       addrHashes.add(hash160)
-      dbInst.setAddrlog(hash160, sid, 0, value, addressType)
+      dbBatch.setAddrlogRow(hash160, sid, 0, value, addressType, height, blk.header.time, idx, txidList[idx])
 
   for hash160 in addrHashes.deduplicate:
     var value: uint64
     var utxo_count: uint32
-    for unspent in dbInst.getUnspents(hash160):
+    for unspent in dbBatch.getUnspents(hash160):
       value = value + unspent.value
       inc(utxo_count)
-    dbInst.setAddrval(hash160, value, utxo_count)
+    dbBatch.setAddrval(hash160, value, utxo_count)
 
-proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id: uint64, network: Network, nid: uint16) =
-  dbInst.setBlockHash(height, hash, blk.header.time, seq_id)
+proc writeBlockStream(dbBatch: DbBatch, height: int, hash: BlockHash, blk: Block | BlockView, seq_id: uint64, network: Network, nid: uint16) =
+  dbBatch.setBlockHash(height, hash, blk.header.time, seq_id)
 
   var addrouts = newSeq[seq[AddrVal]](blk.txs.len)
   var addrins = newSeq[seq[AddrVal]](blk.txs.len)
+  var txidList: seq[Hash] # txids of the extended addrlog rows, only filled with ADDRLOG_EXT
+  when ADDRLOG_EXT:
+    txidList.setLen(blk.txs.len)
+  var spents: seq[UndoSpent]
+  var newAddrs: seq[Hash160]
   var streamAddrs = newTable[seq[byte], tuple[value: uint64, utxo_count: uint32, seq_id: uint64]]()
 
   if blk.txs.len != blk.txn.int:
     raise newException(BlockParserError, "txn conflict")
 
+  when blk is BlockView:
+    let txids = blk.txidBins()
+
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
-    var txid = Hash(tx.txidBin)
-    dbInst.setId(sid, txid)
+    when blk is BlockView:
+      var txid = Hash(@(txids[idx]))
+    else:
+      var txid = Hash(tx.txidBin)
+    dbBatch.setId(sid, txid)
+    when ADDRLOG_EXT:
+      txidList[idx] = txid
     var addrvals: seq[AddrVal]
     var dustCount = 0
     for n, o in tx.outs:
@@ -286,13 +345,16 @@ proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block,
           break
         inc(dustCount)
     if dustCount >= 2:
-      dbInst.setTx(txid, height, sid, 1.uint8)
+      dbBatch.setTx(txid, height, sid, 1.uint8)
     else:
-      dbInst.setTx(txid, height, sid)
+      dbBatch.setTx(txid, height, sid)
       for n, o in tx.outs:
-        var addrHash = getAddressHash160(o.script)
-        dbInst.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
-        dbInst.setUnspent(addrHash.hash160, sid, n.uint32, o.value)
+        when blk is BlockView:
+          var addrHash = blk.addrHash(tx, n)
+        else:
+          var addrHash = getAddressHash160(o.script)
+        dbBatch.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
+        dbBatch.setUnspent(addrHash.hash160, sid, n.uint32, o.value)
         addrvals.add((addrHash.hash160, uint8(addrHash.addressType), o.value, 1'u32))
 
     addrouts[idx] = addrvals.aggregate
@@ -300,13 +362,13 @@ proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block,
   for idx, tx in blk.txs:
     var addrvals: seq[AddrVal]
     for i in tx.ins:
-      var in_txid = i.tx
+      var in_txid = i.prevHash
       var n = i.n
 
       if n == 0xffffffff'u32:
-        dbInst.setMinedId(seq_id + idx.uint64, height)
+        dbBatch.setMinedId(seq_id + idx.uint64, height)
       else:
-        var ret_tx = dbInst.getTx(in_txid)
+        var ret_tx = dbBatch.getTx(in_txid)
         if ret_tx.err == DbStatus.NotFound:
           raise newException(BlockParserError, "id not found " & $in_txid)
         if ret_tx.res.skip == 1:
@@ -314,12 +376,14 @@ proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block,
           continue
 
         var id = ret_tx.res.id
-        var ret_txout = dbInst.getTxout(id, n)
+        var ret_txout = dbBatch.getTxout(id, n)
         if ret_txout.err == DbStatus.NotFound:
           raise newException(BlockParserError, "txout not found " & $id)
 
-        dbInst.delUnspent(ret_txout.res.address_hash, id, n)
+        dbBatch.delUnspent(ret_txout.res.address_hash, id, n)
         addrvals.add((ret_txout.res.address_hash, ret_txout.res.address_type, ret_txout.res.value, 1'u32))
+        spents.add((idx.uint32, id, n, ret_txout.res.value,
+                    ret_txout.res.address_hash, ret_txout.res.address_type))
 
     addrins[idx] = addrvals.aggregate
 
@@ -332,18 +396,19 @@ proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block,
       var addressType = uint8(addrval.addressType)
       var value = addrval.value
       var utxo_count = addrval.utxo_count
-      var ret_addrval = dbInst.getAddrval(hash160)
+      var ret_addrval = dbBatch.getAddrval(hash160)
       if ret_addrval.err == DbStatus.NotFound:
-        dbInst.setAddrval(hash160, value, utxo_count)
+        dbBatch.setAddrval(hash160, value, utxo_count)
+        newAddrs.add(hash160)
         if addressType != AddressType.Unknown.uint8:
           streamAddrs[(hash160, addressType, nid).toBytes] = (value, utxo_count, sid)
       else:
         let val = ret_addrval.res.value + value
         let cnt = ret_addrval.res.utxo_count + utxo_count
-        dbInst.setAddrval(hash160, val, cnt)
+        dbBatch.setAddrval(hash160, val, cnt)
         if addressType != AddressType.Unknown.uint8:
           streamAddrs[(hash160, addressType, nid).toBytes] = (val, cnt, sid)
-      dbInst.setAddrlog(hash160, sid, 1, value, addressType)
+      dbBatch.setAddrlogRow(hash160, sid, 1, value, addressType, height, blk.header.time, idx, txidList[idx])
 
   for idx, tx in blk.txs:
     var sid = seq_id + idx.uint64
@@ -354,31 +419,42 @@ proc writeBlockStream(dbInst: DbInst, height: int, hash: BlockHash, blk: Block,
       var addressType = uint8(addrval.addressType)
       var value = addrval.value
       var utxo_count = addrval.utxo_count
-      var ret_addrval = dbInst.getAddrval(hash160)
+      var ret_addrval = dbBatch.getAddrval(hash160)
       if ret_addrval.err == DbStatus.NotFound:
         raise newException(BlockParserError, "address not found " & $hash160)
       else:
         let val = ret_addrval.res.value - value
         let cnt = ret_addrval.res.utxo_count - utxo_count
-        dbInst.setAddrval(hash160, val, cnt)
+        dbBatch.setAddrval(hash160, val, cnt)
         if addressType != AddressType.Unknown.uint8:
           streamAddrs[(hash160, addressType, nid).toBytes] = (val, cnt, sid)
-      dbInst.setAddrlog(hash160, sid, 0, value, addressType)
+      dbBatch.setAddrlogRow(hash160, sid, 0, value, addressType, height, blk.header.time, idx, txidList[idx])
+
+  dbBatch.setUndoSpents(height, blk.txs.len, spents)
+  if newAddrs.len > 0:
+    dbBatch.setUndoAddrs(height, newAddrs)
+  if height >= UNDO_BLOCKS:
+    dbBatch.delUndo(height - UNDO_BLOCKS)
+
+  dbBatch.commit()
 
   if streamActive:
     streamSend(("height", nid.uint16).toBytes,
-              %*{"type": "height", "data": {"height": height, "sid": seq_id, "nid": nid}})
+              %*{"type": "height", "data": {"height": height, "sid": seq_id, "nid": nid}},
+              binHeight(nid.int, height, seq_id))
 
     for k, v in streamAddrs.pairs:
       let hash160 = k[0..19].Hash160
       let addressType = k[20].AddressType
+      let address = network.getAddress(hash160, addressType)
       let jsonData =  %*{"type": "addr", "data": {"nid": nid,
-                        "addr": network.getAddress(hash160, addressType),
+                        "addr": address,
                         "val": v.value.toJson, "utxo_count": v.utxo_count, "sid": v.seq_id, "height": height}}
-      streamSend(k, jsonData)
+      streamSend(k, jsonData, binAddr(nid.int, address, true, v.value, v.utxo_count,
+                                      height = height, sid = v.seq_id))
       echo "streamSend tag=", k, " ", jsonData
 
-proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq_id: uint64): tuple[height: int, seq_id: uint64] =
+proc rollbackBlock(dbBatch: DbBatch, height: int, hash: BlockHash, blk: Block, seq_id: uint64): tuple[height: int, seq_id: uint64] =
   var addrins = newSeq[seq[AddrValRollback]](blk.txs.len)
   var addrouts = newSeq[seq[AddrValRollback]](blk.txs.len)
 
@@ -390,9 +466,9 @@ proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq
       var n = i.n
 
       if n == 0xffffffff'u32:
-        dbInst.delMinedId(prev_seq_id + idx.uint64)
+        dbBatch.delMinedId(prev_seq_id + idx.uint64)
       else:
-        var ret_tx = dbInst.getTx(in_txid)
+        var ret_tx = dbBatch.getTx(in_txid)
         if ret_tx.err == DbStatus.NotFound:
           raise newException(BlockParserError, "id not found " & $in_txid)
         if ret_tx.res.skip == 1:
@@ -400,11 +476,11 @@ proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq
           continue
 
         var id = ret_tx.res.id
-        var ret_txout = dbInst.getTxout(id, n)
+        var ret_txout = dbBatch.getTxout(id, n)
         if ret_txout.err == DbStatus.NotFound:
           raise newException(BlockParserError, "txout not found " & $id)
 
-        dbInst.setUnspent(ret_txout.res.address_hash, id, n, ret_txout.res.value)
+        dbBatch.setUnspent(ret_txout.res.address_hash, id, n, ret_txout.res.value)
         addrvals.add((ret_txout.res.address_hash, ret_txout.res.value, 1'u32))
 
     addrins[idx] = addrvals.aggregate
@@ -418,14 +494,14 @@ proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq
       if o.value == 0:
         continue
       var addrHash = getAddressHash160(o.script)
-      dbInst.delUnspent(addrHash.hash160, sid, n.uint32)
-      dbInst.delTxout(sid, n.uint32)
+      dbBatch.delUnspent(addrHash.hash160, sid, n.uint32)
+      dbBatch.delTxout(sid, n.uint32)
       addrvals.add((addrHash.hash160, o.value, 1'u32))
 
     addrouts[idx] = addrvals.aggregate
 
-    dbInst.delTx(txid)
-    dbInst.delId(sid)
+    dbBatch.delTx(txid)
+    dbBatch.delId(sid)
 
   for idx, tx in blk.txs:
     var sid = prev_seq_id + idx.uint64
@@ -435,12 +511,12 @@ proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq
       var hash160 = addrval.hash160
       var value = addrval.value
       var utxo_count = addrval.utxo_count
-      var ret_addrval = dbInst.getAddrval(hash160)
+      var ret_addrval = dbBatch.getAddrval(hash160)
       if ret_addrval.err == DbStatus.NotFound:
         raise newException(BlockParserError, "address not found " & $hash160)
 
-      dbInst.delAddrlog(hash160, sid, 0)
-      dbInst.setAddrval(hash160, ret_addrval.res.value + value, ret_addrval.res.utxo_count + utxo_count)
+      dbBatch.delAddrlog(hash160, sid, 0)
+      dbBatch.setAddrval(hash160, ret_addrval.res.value + value, ret_addrval.res.utxo_count + utxo_count)
 
   for idx, tx in blk.txs:
     var sid = prev_seq_id + idx.uint64
@@ -450,23 +526,89 @@ proc rollbackBlock(dbInst: DbInst, height: int, hash: BlockHash, blk: Block, seq
       var hash160 = addrval.hash160
       var value = addrval.value
       var utxo_count = addrval.utxo_count
-      dbInst.delAddrlog(hash160, sid, 1)
+      dbBatch.delAddrlog(hash160, sid, 1)
 
       var addrLogExist = false
-      for addrlog in dbInst.getAddrlogs(hash160):
+      for addrlog in dbBatch.getAddrlogs(hash160):
         addrLogExist = true
         break
 
       if addrLogExist:
-        var ret_addrval = dbInst.getAddrval(hash160)
+        var ret_addrval = dbBatch.getAddrval(hash160)
         if ret_addrval.err == DbStatus.NotFound:
           raise newException(BlockParserError, "address not found " & $hash160)
 
-        dbInst.setAddrval(hash160, ret_addrval.res.value - value, ret_addrval.res.utxo_count - utxo_count)
+        dbBatch.setAddrval(hash160, ret_addrval.res.value - value, ret_addrval.res.utxo_count - utxo_count)
       else:
-        dbInst.delAddrval(hash160)
+        dbBatch.delAddrval(hash160)
 
-  dbInst.delBlockHash(height)
+  dbBatch.delBlockHash(height)
+  result = (height - 1, prev_seq_id)
+
+proc rollbackBlock(dbBatch: DbBatch, height: int, undo: UndoResult, seq_id: uint64): tuple[height: int, seq_id: uint64] =
+  ## Rollback from the undo record, without the block and the lookups of the spent txouts.
+  var addrins = newSeq[seq[AddrValRollback]](undo.txn)
+  var addrouts = newSeq[seq[AddrValRollback]](undo.txn)
+  var newAddrs = initTable[seq[byte], bool]()
+  for a in undo.addrs:
+    newAddrs[a.toBytes] = true
+
+  var prev_seq_id = seq_id - undo.txn.uint64
+  for s in undo.spents:
+    if s.idx.int >= undo.txn:
+      raise newException(BlockParserError, "undo conflict height=" & $height)
+    dbBatch.setUnspent(s.address_hash, s.id, s.n, s.value)
+    addrins[s.idx.int].add((s.address_hash, s.value, 1'u32))
+
+  for idx in 0..<undo.txn:
+    var sid = prev_seq_id + idx.uint64
+    var ret_id = dbBatch.getId(sid)
+    if ret_id.err == DbStatus.NotFound:
+      raise newException(BlockParserError, "id not found " & $sid)
+
+    var addrvals: seq[AddrValRollback]
+    for o in dbBatch.getTxouts(sid):
+      dbBatch.delUnspent(o.address_hash, sid, o.n)
+      dbBatch.delTxout(sid, o.n)
+      addrvals.add((o.address_hash, o.value, 1'u32))
+
+    addrins[idx] = addrins[idx].aggregate
+    addrouts[idx] = addrvals.aggregate
+
+    dbBatch.delMinedId(sid)
+    dbBatch.delTx(ret_id.res)
+    dbBatch.delId(sid)
+
+  for idx in 0..<undo.txn:
+    var sid = prev_seq_id + idx.uint64
+
+    for addrval in addrins[idx]:
+      var hash160 = addrval.hash160
+      var ret_addrval = dbBatch.getAddrval(hash160)
+      if ret_addrval.err == DbStatus.NotFound:
+        raise newException(BlockParserError, "address not found " & $hash160)
+
+      dbBatch.delAddrlog(hash160, sid, 0)
+      dbBatch.setAddrval(hash160, ret_addrval.res.value + addrval.value, ret_addrval.res.utxo_count + addrval.utxo_count)
+
+  for idx in 0..<undo.txn:
+    var sid = prev_seq_id + idx.uint64
+
+    for addrval in addrouts[idx]:
+      var hash160 = addrval.hash160
+      dbBatch.delAddrlog(hash160, sid, 1)
+
+      if newAddrs.hasKey(hash160.toBytes):
+        dbBatch.delAddrval(hash160)
+      else:
+        var ret_addrval = dbBatch.getAddrval(hash160)
+        if ret_addrval.err == DbStatus.NotFound:
+          raise newException(BlockParserError, "address not found " & $hash160)
+
+        dbBatch.setAddrval(hash160, ret_addrval.res.value - addrval.value, ret_addrval.res.utxo_count - addrval.utxo_count)
+
+  dbBatch.delUndo(height)
+  dbBatch.delBlockHash(height)
   result = (height - 1, prev_seq_id)
 
 type
@@ -545,7 +687,8 @@ proc monitorMain(workers: seq[WorkerParams]) {.thread.} =
                           "height": m.height, "hash": $m.hash,
                           "blkTime": m.blkTime,
                           "lastHeight": m.lastHeight}}
-          streamSend("status", jsonData)
+          streamSend("status", jsonData, binStatus(i, $params.nodeParams.networkId, m.height,
+                                                    m.hash, m.blkTime, m.lastHeight))
           prev[i] = m[]
       sleep(400)
 
@@ -570,6 +713,29 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
 
   rpc.setRpcConfig(RpcConfig(rpcUrl: params.nodeParams.rpcUrl, rpcUserPass: params.nodeParams.rpcUserPass))
 
+  if dbInst.recoverBatch():
+    echo "recover batch"
+  if dbInst.bulkIndexing():
+    raise newException(BlockstorError, "bulk index is not finished, run: blockstor bulk")
+  var dbBatch = dbInst.newBatch()
+  var blkBuf: seq[byte] # reused for the raw blocks from rpc
+  var utxoCache = openUtxoCache(DATA_DIR / "utxocache_" & $params.nodeParams.networkId, UTXO_CACHE_SIZE)
+
+  var addrvalDeltas = newAddrValDeltas()
+
+  template commitBatch() =
+    block:
+      var newAddrs = initTable[int, seq[Hash160]]()
+      for a in addrvalDeltas.flush(dbBatch):
+        newAddrs.mgetOrPut(a.height, @[]).add(a.hash160)
+      for h, addrs in newAddrs:
+        dbBatch.setUndoAddrs(h, addrs)
+    utxoCache.flush(dbBatch)
+    dbBatch.commit()
+    if utxoCache.full:
+      echo utxoCache.stats
+      utxoCache.clear()
+
   var retLastBlock = dbInst.getLastBlockHash()
   if retLastBlock.err == DbStatus.NotFound:
     # genesis block
@@ -577,26 +743,29 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
     if retGenesisHash["result"].kind != JString:
       raise newException(BlockstorError, "genesis block hash not found")
     let genesisHash = retGenesisHash["result"].getStr.Hex.toBlockHash
-    var retGenesisBlock = rpc.getBlock.send($genesisHash, 0)
-    if retGenesisBlock["result"].kind != JString:
+    if not rpc.getBlock.sendRaw(blkBuf, $genesisHash, 0):
       raise newException(BlockstorError, "genesis block not found")
-    let genesisBlk = retGenesisBlock["result"].getStr.Hex.toBytes.toBlock
-    dbInst.writeBlock(0, genesisHash, genesisBlk, 0)
+    let genesisBlk = blkBuf.toBlock
+    dbBatch.writeBlock(utxoCache, addrvalDeltas, 0, genesisHash, genesisBlk, 0)
+    dbBatch.setParam(ParamId.AtomicBlocks, @[1'u8])
+    commitBatch()
     nextSeqId = genesisBlk.txs.len.uint64
     blkHash = genesisHash
     setMonitorInfo(params.id, height, blkHash, genesisBlk.header.time.int64, height)
   else:
-    # rewrite block
-    var retBlock = rpc.getBlock.send($retLastBlock.res.hash, 0)
-    if retBlock["result"].kind != JString:
+    if not rpc.getBlock.sendRaw(blkBuf, $retLastBlock.res.hash, 0):
       raise newException(BlockstorError, "last block not found")
 
-    let blk = retBlock["result"].getStr.Hex.toBytes.toBlock
+    let blk = blkBuf.toBlock
     height = retLastBlock.res.height
     curSeqId = retLastBlock.res.start_id
     blkHash = retLastBlock.res.hash
 
-    dbInst.rewriteBlock(height, blkHash, blk, curSeqId)
+    # rewrite block, only needed for databases written before atomic batches
+    if dbInst.getParam(ParamId.AtomicBlocks).err == DbStatus.NotFound:
+      dbBatch.rewriteBlock(height, blkHash, blk, curSeqId)
+      dbBatch.setParam(ParamId.AtomicBlocks, @[1'u8])
+      dbBatch.commit()
     nextSeqId = curSeqId + blk.txs.len.uint64
     setMonitorInfo(params.id, height, blkHash, blk.header.time.int64, height)
 
@@ -616,12 +785,18 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
         break
 
       # rollback
-      var retBlock = rpc.getBlock.send($blkDbHash, 0)
-      if retBlock["result"].kind != JString:
-        raise newException(BlockstorError, "rollback block not found hash=" & $blkDbHash)
+      var retRollback: tuple[height: int, seq_id: uint64]
+      let retUndo = dbBatch.getUndo(height)
+      if retUndo.err == DbStatus.Success:
+        retRollback = dbBatch.rollbackBlock(height, retUndo.res, nextSeqId)
+      else:
+        # blocks without undo records, older or written by bulk index
+        if not rpc.getBlock.sendRaw(blkBuf, $blkDbHash, 0):
+          raise newException(BlockstorError, "rollback block not found hash=" & $blkDbHash)
 
-      let blk = retBlock["result"].getStr.Hex.toBytes.toBlock
-      let retRollback = dbInst.rollbackBlock(height, blkDbHash, blk, nextSeqId)
+        let blk = blkBuf.toBlock
+        retRollback = dbBatch.rollbackBlock(height, blkDbHash, blk, nextSeqId)
+      dbBatch.commit()
       height = retRollback.height
       nextSeqId = retRollback.seq_id
       echo "rollback ", height
@@ -633,8 +808,35 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
     var lastBlockCheckerThread: Thread[WrapperParams]
     createThread(lastBlockCheckerThread, threadWrapper, (lastBlockChecker, params))
 
-    proc cb(tcpHeight: int, hash: BlockHash, blk: Block): bool {.gcsafe.} =
-      dbInst.writeBlock(tcpHeight, hash, blk, nextSeqId)
+    var batchBlocks = 0
+    # last committed block, the sync resumes from here if a block fails
+    var commitHeight = height
+    var commitHash = blkHash
+    var commitSeqId = nextSeqId
+    proc cb(tcpHeight: int, hash: BlockHash, blk: BlockView): bool {.gcsafe.} =
+      try:
+        dbBatch.writeBlock(utxoCache, addrvalDeltas, tcpHeight, hash, blk, nextSeqId)
+      except:
+        # a partly written block can not be separated from the window, drop the
+        # uncommitted blocks with their deltas and cache entries
+        dbBatch.rollback()
+        addrvalDeltas.clear()
+        utxoCache.clear()
+        batchBlocks = 0
+        height = commitHeight
+        blkHash = commitHash
+        nextSeqId = commitSeqId
+        echo "drop uncommitted blocks, resume from ", height
+        raise
+      inc(batchBlocks)
+      # a full cache is flushed and cleared by the commit before its probe runs grow
+      if batchBlocks >= DB_BATCH_BLOCKS or dbBatch.len >= DB_BATCH_MAX_OPS or
+          addrvalDeltas.len >= ADDRVAL_DELTAS_MAX or utxoCache.full:
+        commitBatch()
+        batchBlocks = 0
+        commitHeight = tcpHeight
+        commitHash = hash
+        commitSeqId = nextSeqId + blk.txs.len.uint64
       height = tcpHeight
       blkHash = hash
       nextSeqId = nextSeqId + blk.txs.len.uint64
@@ -660,6 +862,10 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
         node.close()
 
     node.close()
+    commitBatch()
+    echo utxoCache.stats
+    # the cache is only used while syncing, rollback and rpc mode write to the db
+    utxoCache.close()
 
     lastBlockChekcerParam[params.id].abort = true
     lastBlockCheckerThread.joinThread()
@@ -676,18 +882,48 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
     let nid = params.nodeParams.networkId.uint16
 
     block_check()
+
+    let mempoolFile = DATA_DIR / "mempool_" & $params.nodeParams.networkId
+    try:
+      let loaded = mempool.load(mempoolFile)
+      echo "mempool snapshot txs=", loaded
+    except:
+      echo "mempool snapshot ", getCurrentExceptionMsg()
+    var snapshotTime = epochTime()
+    defer:
+      mempool.save(mempoolFile)
+      echo "mempool snapshot saved"
+      mempool.free()
+
+    template notifyMempool() =
+      let conflicts = mempool.takeConflicts()
+      let pushed = mempool.takePushed()
+      if streamActive:
+        for c in conflicts:
+          for a in c.addrs:
+            let jsonData = %*{"type": "conflicted", "data": {"nid": nid,
+                              "addr": network.getAddress(a.hash160, a.addressType),
+                              "txid": $c.txid, "by": $c.by}}
+            streamSend((a.hash160, a.addressType.uint8, nid).toBytes, jsonData)
+        for p in pushed:
+          for a in p.addrs:
+            let pend = mempool.pending(params.id, a.hash160, a.addressType)
+            let jsonData = %*{"type": "unconf", "data": {"nid": nid,
+                              "addr": network.getAddress(a.hash160, a.addressType),
+                              "txid": $p.txid, "out": pend.value_out.toJson, "in": pend.value_in.toJson}}
+            streamSend((a.hash160, a.addressType.uint8, nid).toBytes, jsonData)
+
     var blockNew = false
     while not abort:
       var retHash = rpc.getBlockHash.send(height + 1)
       if retHash["result"].kind == JString:
         var blkRpcHash = retHash["result"].getStr.Hex.toBlockHash
-        var retBlock = rpc.getBlock.send($blkRpcHash, 0)
-        if retBlock["result"].kind != JString:
+        if not rpc.getBlock.sendRaw(blkBuf, $blkRpcHash, 0):
           raise newException(BlockstorError, "rpc block not found hash=" & $blkRpcHash)
-        let blk = retBlock["result"].getStr.Hex.toBytes.toBlock
+        let blk = blkBuf.toBlockView
         if blk.header.prev == blkHash:
           inc(height)
-          dbInst.writeBlockStream(height, blkRpcHash, blk, nextSeqId, network, nid)
+          dbBatch.writeBlockStream(height, blkRpcHash, blk, nextSeqId, network, nid)
           curSeqId = nextSeqId
           nextSeqId = nextSeqId + blk.txs.len.uint64
           blkHash = blkRpcHash
@@ -700,13 +936,23 @@ proc nodeWorker(params: WorkerParams) {.thread.} =
           block_check()
         blockNew = true
       else:
-        mempool.update(blockNew)
+        let backlog = mempool.update(blockNew)
+        if blockNew and streamActive:
+          # next to the per-block mempool status of update
+          echo "INFO: ", streamQueueStats()
         blockNew = false
+        notifyMempool()
         if streamActive:
           var onceTag = ("heightonce", nid.uint16).toBytes
           if streamTagExists(onceTag):
-            streamSendOnce(onceTag, %*{"type": "height", "data": {"height": height, "sid": curSeqId, "nid": nid}})
-        sleep(1000)
+            streamSendOnce(onceTag, %*{"type": "height", "data": {"height": height, "sid": curSeqId, "nid": nid}},
+                          binHeight(nid.int, height, curSeqId))
+        if not backlog:
+          if epochTime() - snapshotTime >= MEMPOOL_SNAPSHOT_INTERVAL:
+            mempool.save(mempoolFile)
+            snapshotTime = epochTime()
+          if mempool.wait(1000):
+            notifyMempool()
         block_check()
 
 var monitorThread: Thread[WrapperMultiParams]
@@ -744,6 +990,21 @@ proc startServer() {.thread.} =
   finally:
     doAbort()
 
+if paramCount() >= 1 and paramStr(1) == "bulk":
+  # offline bulk index, run once on empty databases before the normal start
+  onSignal(SIGINT, SIGTERM):
+    echo "bye from signal ", sig
+    stopBulkIndex()
+
+  for params in workers:
+    if params.nodeParams.workerEnable:
+      echo "bulk index: ", params.nodeParams.networkId
+      params.dbInst.bulkIndex(RpcConfig(rpcUrl: params.nodeParams.rpcUrl, rpcUserPass: params.nodeParams.rpcUserPass),
+                              DATA_DIR / "utxocache_" & $params.nodeParams.networkId, UTXO_CACHE_SIZE)
+  dbInsts.close()
+  echo "db closed"
+  quit(QuitSuccess)
+
 server.setStreamParams(dbInsts, networks, nodes)
 createThread(startServerThread, startServer)
 
@@ -0,0 +1,308 @@
+# Copyright (c) 2021 zenywallet
+
+import tables, json, cpuinfo
+import bytes, db, rpc, address, blocks, tx
+import utxocache
+
+const BULK_INDEX_WORKERS {.intdefine.} = 0 # 0 - number of processors
+const BULK_INDEX_CHUNK_BLOCKS {.intdefine.} = 1000
+const BULK_INDEX_MARGIN {.intdefine.} = 100 # blocks left to the node sync from the tip
+const BULK_INDEX_COMMIT_TXS {.intdefine.} = 100_000
+const BULK_INDEX_DELTAS_MAX {.intdefine.} = 2_000_000
+
+type
+  BulkIndexError* = object of CatchableError
+
+  BulkPhase {.pure.} = enum
+    None
+    Blocks  # phase 1, txs, ids, txouts and minedids in parallel
+    Spends  # phase 2, unspents, addrvals and addrlogs in sequence
+
+  BulkState = tuple[phase: BulkPhase, height: int, next_id: uint64, end_id: uint64]
+
+  BulkWorkerResult = tuple[id: int, err: string, counts: seq[int]]
+
+  BulkWorkerParams = tuple[id: int, dbInst: DbInst, rpcConfig: RpcConfig,
+                          startHeight: int, endHeight: int,
+                          baseId: ptr Channel[uint64], results: ptr Channel[BulkWorkerResult]]
+
+const BULK_WORKER_STOP = uint64.high
+
+var bulkAbort = false
+
+proc stopBulkIndex*() = bulkAbort = true
+
+proc setBulkState(db: DbHandle, state: BulkState) =
+  db.setParam(ParamId.BulkIndex, BytesBE(state.phase.uint8, state.height.uint32,
+                                          state.next_id, state.end_id))
+
+proc getBulkState(db: DbHandle): BulkState =
+  let ret = db.getParam(ParamId.BulkIndex)
+  if ret.err == DbStatus.NotFound or ret.res.len != 21:
+    return (BulkPhase.None, 0, 0'u64, 0'u64)
+  var d = ret.res
+  (BulkPhase(d[0]), d[1].toUint32BE.int, d[5].toUint64BE, d[13].toUint64BE)
+
+proc bulkIndexing*(db: DbInst): bool = db.getBulkState().phase != BulkPhase.None
+
+proc writeBulkBlock(db: DbInst, height: int, hash: BlockHash, blk: BlockView, seq_id: uint64) =
+  ## Writes the block data without cross-block dependency, the same records
+  ## as writeBlock except the spends, which are kept for the second phase.
+  db.setBlockHash(height, hash, blk.header.time, seq_id)
+  let txids = blk.txidBins()
+  for idx, tx in blk.txs:
+    let sid = seq_id + idx.uint64
+    let txid = Hash(@(txids[idx]))
+    db.setId(sid, txid)
+    var dustCount = 0
+    for n, o in tx.outs:
+      if o.value <= 546: # dust is less than 546, 546 is not
+        if dustCount >= 2:
+          break
+        inc(dustCount)
+    if dustCount >= 2:
+      db.setTx(txid, height, sid, 1.uint8)
+    else:
+      db.setTx(txid, height, sid)
+      for n, o in tx.outs:
+        let addrHash = blk.addrHash(tx, n)
+        db.setTxout(sid, n.uint32, o.value, addrHash.hash160, uint8(addrHash.addressType))
+
+    var spends: seq[byte]
+    for i in tx.ins:
+      if i.n == 0xffffffff'u32:
+        db.setMinedId(sid, height)
+      else:
+        spends.add(BytesBE(i.prevHash, i.n))
+    if spends.len > 0:
+      db.setBulkSpends(sid, spends)
+
+proc bulkWorker(params: BulkWorkerParams) {.thread.} =
+  setRpcConfig(params.rpcConfig)
+  var datas: seq[seq[byte]]
+  var hashes: seq[BlockHash]
+  var counts: seq[int]
+  try:
+    for height in params.startHeight..<params.endHeight:
+      let retHash = rpc.getBlockHash.send(height)
+      if retHash["result"].kind != JString:
+        raise newException(BulkIndexError, "block hash not found height=" & $height)
+      let hash = retHash["result"].getStr.Hex.toBlockHash
+      var data: seq[byte]
+      if not rpc.getBlock.sendRaw(data, $hash, 0):
+        raise newException(BulkIndexError, "block not found hash=" & $hash)
+      counts.add(data.toBlockView.txn.int)
+      datas.add(data)
+      hashes.add(hash)
+  except:
+    params.results[].send((params.id, getCurrentExceptionMsg(), counts))
+    return
+  params.results[].send((params.id, "", counts))
+
+  var sid = params.baseId[].recv()
+  if sid == BULK_WORKER_STOP:
+    return
+  try:
+    for i in 0..<datas.len:
+      let blk = datas[i].toBlockView
+      params.dbInst.writeBulkBlock(params.startHeight + i, hashes[i], blk, sid)
+      sid = sid + blk.txs.len.uint64
+      datas[i] = @[]
+  except:
+    params.results[].send((params.id, getCurrentExceptionMsg(), @[]))
+    return
+  params.results[].send((params.id, "", @[]))
+
+proc indexBlocks(dbInst: DbInst, rpcConfig: RpcConfig, state: var BulkState,
+                endHeight: int, workerNum: int) =
+  ## Phase 1, each chunk of blocks is fetched and parsed in parallel, the tx
+  ## counts give the start ids, then each worker writes its own blocks.
+  var results = cast[ptr Channel[BulkWorkerResult]](allocShared0(sizeof(Channel[BulkWorkerResult])))
+  results[].open()
+  var baseIds = cast[ptr UncheckedArray[Channel[uint64]]](allocShared0(sizeof(Channel[uint64]) * workerNum))
+  for i in 0..<workerNum:
+    baseIds[i].open()
+  defer:
+    for i in 0..<workerNum:
+      baseIds[i].close()
+    deallocShared(baseIds)
+    results[].close()
+    deallocShared(results)
+
+  while state.height < endHeight and not bulkAbort:
+    let chunkEnd = min(state.height + BULK_INDEX_CHUNK_BLOCKS, endHeight)
+    let per = (chunkEnd - state.height + workerNum - 1) div workerNum
+    var ranges: seq[tuple[startHeight, endHeight: int]]
+    var h = state.height
+    while h < chunkEnd:
+      ranges.add((h, min(h + per, chunkEnd)))
+      h = h + per
+
+    var threads = newSeq[Thread[BulkWorkerParams]](ranges.len)
+    for i, r in ranges:
+      createThread(threads[i], bulkWorker, (i, dbInst, rpcConfig, r.startHeight, r.endHeight,
+                                            addr baseIds[i], results))
+
+    var err = ""
+    var counts = newSeq[seq[int]](ranges.len)
+    for _ in 0..<ranges.len:
+      let ret = results[].recv()
+      if ret.err.len > 0:
+        err = ret.err
+      counts[ret.id] = ret.counts
+
+    if err.len > 0 or bulkAbort:
+      for i in 0..<ranges.len:
+        baseIds[i].send(BULK_WORKER_STOP)
+    else:
+      var sid = state.next_id
+      for i in 0..<ranges.len:
+        baseIds[i].send(sid)
+        for c in counts[i]:
+          sid = sid + c.uint64
+      for _ in 0..<ranges.len:
+        let ret = results[].recv()
+        if ret.err.len > 0:
+          err = ret.err
+      state.next_id = sid
+    threads.joinThreads()
+    if err.len > 0:
+      raise newException(BulkIndexError, err)
+    if bulkAbort:
+      break
+
+    state.height = chunkEnd
+    dbInst.setBulkState(state)
+    echo "bulk index blocks ", state.height, "/", endHeight, " txs ", state.next_id
+
+proc indexSpends(dbInst: DbInst, state: var BulkState, utxoCacheFile: string, utxoCacheSize: int) =
+  ## Phase 2, walks the ids in order and resolves the spends recorded by phase 1.
+  ## The ids, txs, txouts and blocks are complete after phase 1 and never in the
+  ## batch, so they are read from the db without merging the pending ops.
+  var dbBatch = dbInst.newBatch()
+  var utxoCache = openUtxoCache(utxoCacheFile, utxoCacheSize)
+  var addrvalDeltas = newAddrValDeltas()
+  defer:
+    utxoCache.close()
+
+  template commitBatch() =
+    addrvalDeltas.flush(dbBatch)
+    utxoCache.flush(dbBatch)
+    dbBatch.setBulkState(state)
+    dbBatch.commit()
+    if utxoCache.full:
+      utxoCache.clear()
+
+  var batchTxs = 0
+  when ADDRLOG_EXT:
+    var extCache = initAddrlogExtCache()
+  while state.next_id < state.end_id:
+    let sid = state.next_id
+    let retId = dbInst.getId(sid)
+    if retId.err == DbStatus.NotFound:
+      raise newException(BulkIndexError, "id not found " & $sid)
+    let txid = retId.res
+    when ADDRLOG_EXT:
+      let retExt = dbInst.getAddrlogExt(sid, extCache)
+      if retExt.err == DbStatus.NotFound:
+        raise newException(BulkIndexError, "addrlog ext not found " & $sid)
+      let ext = retExt.res
+
+    template setAddrlogRow(a: untyped, trans: uint8) =
+      when ADDRLOG_EXT:
+        dbBatch.setAddrlog(a.hash160, sid, trans, a.value, a.address_type,
+                          ext.height, ext.time, ext.mined, ext.txid)
+      else:
+        dbBatch.setAddrlog(a.hash160, sid, trans, a.value, a.address_type)
+
+    var outs = initTable[seq[byte], tuple[hash160: Hash160, address_type: uint8, value: uint64, utxo_count: uint32]]()
+    for o in dbInst.getTxouts(sid):
+      utxoCache.add(txid, o.n, sid, o.value, o.address_hash, o.address_type)
+      let key = (o.address_hash, o.address_type).toBytes
+      var a = outs.mgetOrPut(key, (o.address_hash, o.address_type, 0'u64, 0'u32))
+      a.value = a.value + o.value
+      inc(a.utxo_count)
+      outs[key] = a
+    for a in outs.values:
+      addrvalDeltas.add(a.hash160, a.value, a.utxo_count)
+      setAddrlogRow(a, 1)
+
+    let retSpends = dbBatch.getBulkSpends(sid)
+    if retSpends.err == DbStatus.Success:
+      var ins = initTable[seq[byte], tuple[hash160: Hash160, address_type: uint8, value: uint64, utxo_count: uint32]]()
+      for s in retSpends.res:
+        var spent: TxoutResult
+        let retUtxo = utxoCache.spend(dbBatch, s.txid, s.n)
+        if retUtxo.err == DbStatus.Success:
+          spent = (retUtxo.res.value, retUtxo.res.address_hash, retUtxo.res.address_type)
+        else:
+          let retTx = dbInst.getTx(s.txid)
+          if retTx.err == DbStatus.NotFound:
+            raise newException(BulkIndexError, "id not found " & $s.txid)
+          if retTx.res.skip == 1:
+            continue
+          let retTxout = dbInst.getTxout(retTx.res.id, s.n)
+          if retTxout.err == DbStatus.NotFound:
+            raise newException(BulkIndexError, "txout not found " & $retTx.res.id)
+          dbBatch.delUnspent(retTxout.res.address_hash, retTx.res.id, s.n)
+          spent = retTxout.res
+        let key = (spent.address_hash, spent.address_type).toBytes
+        var a = ins.mgetOrPut(key, (spent.address_hash, spent.address_type, 0'u64, 0'u32))
+        a.value = a.value + spent.value
+        inc(a.utxo_count)
+        ins[key] = a
+      for a in ins.values:
+        addrvalDeltas.sub(a.hash160, a.value, a.utxo_count)
+        setAddrlogRow(a, 0)
+      dbBatch.delBulkSpends(sid)
+
+    state.next_id = sid + 1
+    inc(batchTxs)
+    if batchTxs >= BULK_INDEX_COMMIT_TXS or addrvalDeltas.len >= BULK_INDEX_DELTAS_MAX or
+        utxoCache.full:
+      commitBatch()
+      batchTxs = 0
+      echo "bulk index spends ", state.next_id, "/", state.end_id, " ", utxoCache.stats
+      if bulkAbort:
+        return
+
+  state.phase = BulkPhase.None
+  addrvalDeltas.flush(dbBatch)
+  utxoCache.flush(dbBatch)
+  dbBatch.setParam(ParamId.AtomicBlocks, @[1'u8])
+  dbBatch.delParam(ParamId.BulkIndex)
+  dbBatch.commit()
+
+proc bulkIndex*(dbInst: DbInst, rpcConfig: RpcConfig, utxoCacheFile: string, utxoCacheSize: int) =
+  ## Offline initial indexing of an empty database up to BULK_INDEX_MARGIN blocks
+  ## below the tip. It can be interrupted and resumed, the node worker refuses to
+  ## start until both phases are completed.
+  if bulkAbort:
+    return
+  dbInst.recoverBatch()
+  var state = dbInst.getBulkState()
+  if state.phase == BulkPhase.None:
+    if dbInst.getLastBlockHash().err == DbStatus.Success:
+      raise newException(BulkIndexError, "bulk index needs an empty database")
+    state = (BulkPhase.Blocks, 0, 0'u64, 0'u64)
+    dbInst.setBulkState(state)
+
+  if state.phase == BulkPhase.Blocks:
+    setRpcConfig(rpcConfig)
+    let retBlockCount = rpc.getBlockCount.send()
+    if retBlockCount["result"].kind != JInt:
+      raise newException(BulkIndexError, "get block count")
+    let endHeight = retBlockCount["result"].getInt - BULK_INDEX_MARGIN + 1
+    if endHeight <= 0:
+      raise newException(BulkIndexError, "not enough blocks for bulk index")
+    let workerNum = if BULK_INDEX_WORKERS > 0: BULK_INDEX_WORKERS else: countProcessors()
+    dbInst.indexBlocks(rpcConfig, state, endHeight, max(workerNum, 1))
+    if bulkAbort:
+      return
+    state = (BulkPhase.Spends, state.height, 0'u64, state.next_id)
+    dbInst.setBulkState(state)
+
+  if state.phase == BulkPhase.Spends:
+    dbInst.indexSpends(state, utxoCacheFile, utxoCacheSize)
+    if state.phase == BulkPhase.None:
+      echo "bulk index done height=", state.height - 1
@@ -1,12 +1,14 @@
 # Copyright (c) 2020 zenywallet
 
-import bytes, json
-import blocks
+import bytes, json, tables, algorithm
+import blocks, reader
 import zenycore/db_types
 export db_types
 
 const DB_SOPHIA = defined(DB_SOPHIA) or (not defined(DB_SOPHIA) and not defined(DB_ROCKSDB))
 const DB_ROCKSDB = defined(DB_ROCKSDB) and not defined(DB_SOPHIA)
+const ADDRLOG_EXT* {.booldefine.} = false # write the extended addrlog rows while indexing
+const DB_BATCH_JOURNAL* {.booldefine.} = true # journal the batch ops, a crash while applying them is repaired
 
 when DB_SOPHIA:
   import zenycore/sophia
@@ -23,8 +25,16 @@ type Prefix* {.pure.} = enum
   txouts      # id, n = value, address_hash, address_type
   unspents    # address_hash, id, n = value, (address_type)
   addrvals    # address_hash, (address_type) = value, utxo_count
-  addrlogs    # address_hash, id, trans (0 - out | 1 - in) = value, address_type
+  addrlogs    # address_hash, id, trans (0 - out | 1 - in) = value, address_type, (height, time, mined, txid)
   minedids    # id = height
+  bulkspends  # id = (txid, n)..., only while bulk indexing
+  undos       # height, kind (0 - spents | 1 - new addrvals) = undo data of recent blocks
+
+type ParamId* {.pure.} = enum
+  BatchJournal = 0  # pending batch ops, removed after they are applied
+  AtomicBlocks      # set when all blocks are written by batches
+  BulkIndex         # phase, height, next_id, end_id of an unfinished bulk index
+  AddrlogMigrate    # last addrlog key converted by an unfinished addrlog migration
 
 when DB_SOPHIA:
   type
@@ -102,7 +112,225 @@ elif DB_ROCKSDB:
   template backupRun*(dbInsts: DbInsts) =
     discard
 
-proc setBlockHash*(db: DbInst, height: int, hash: BlockHash, time: uint32, start_id: uint64) =
+type
+  DbBatchOp = tuple[del: bool, val: seq[byte]]
+
+  DbBatch* = ref object
+    db*: DbInst
+    ops: Table[seq[byte], DbBatchOp]
+    keys: seq[seq[byte]] # keys of ops, sorted up to sortedLen
+    sortedLen: int
+
+  DbHandle* = DbInst | DbBatch
+
+  DbBatchRow* = tuple[key: seq[byte], val: seq[byte]]
+
+proc newBatch*(db: DbInst): DbBatch =
+  DbBatch(db: db, ops: initTable[seq[byte], DbBatchOp]())
+
+proc len*(batch: DbBatch): int = batch.ops.len
+
+proc setOp(batch: DbBatch, key: seq[byte], op: DbBatchOp) {.inline.} =
+  if not batch.ops.hasKey(key):
+    batch.keys.add(key)
+  batch.ops[key] = op
+
+proc put*(batch: DbBatch, key: seq[byte], val: seq[byte]) =
+  batch.setOp(key, (false, val))
+
+proc del*(batch: DbBatch, key: seq[byte]) =
+  batch.setOp(key, (true, @[]))
+
+proc get*(batch: DbBatch, key: seq[byte]): seq[byte] =
+  if batch.ops.hasKey(key):
+    let op = batch.ops[key]
+    if not op.del:
+      result = op.val
+  else:
+    result = batch.db.get(key)
+
+proc cmpKey(a, b: seq[byte]): int =
+  for i in 0..<min(a.len, b.len):
+    if a[i] != b[i]:
+      return a[i].int - b[i].int
+  result = a.len - b.len
+
+proc cmpPrefix(key, limit: seq[byte]): int =
+  if key.len > limit.len:
+    cmpKey(key[0..<limit.len], limit)
+  else:
+    cmpKey(key, limit)
+
+proc sortKeys(batch: DbBatch) =
+  ## Sorts the keys added since the last range scan and merges them into the
+  ## sorted keys, so a scan only costs the new keys and the ops in its range.
+  if batch.sortedLen == batch.keys.len:
+    return
+  var added = batch.keys[batch.sortedLen..^1]
+  added.sort(cmpKey)
+  var merged = newSeqOfCap[seq[byte]](batch.keys.len)
+  var i = 0
+  var j = 0
+  while i < batch.sortedLen and j < added.len:
+    if cmpKey(batch.keys[i], added[j]) <= 0:
+      merged.add(move batch.keys[i])
+      inc(i)
+    else:
+      merged.add(move added[j])
+      inc(j)
+  while i < batch.sortedLen:
+    merged.add(move batch.keys[i])
+    inc(i)
+  while j < added.len:
+    merged.add(move added[j])
+    inc(j)
+  batch.keys = move merged
+  batch.sortedLen = batch.keys.len
+
+proc lowerBound(batch: DbBatch, limit: seq[byte], prefix: bool): int =
+  ## First sorted key not below the limit, compared as a prefix if prefix is set.
+  var lo = 0
+  var hi = batch.keys.len
+  while lo < hi:
+    let mid = (lo + hi) div 2
+    let c = if prefix: cmpPrefix(batch.keys[mid], limit) else: cmpKey(batch.keys[mid], limit)
+    if c < 0 or (prefix and c == 0):
+      lo = mid + 1
+    else:
+      hi = mid
+  result = lo
+
+template mergeRows(dbIter: untyped, loPos, hiPos: int, order: SortOrder) {.dirty.} =
+  ## Walks the db rows together with the sorted ops of keys[loPos..<hiPos], the
+  ## op wins on the same key and deleted keys are skipped.
+  let lo = loPos
+  let hi = hiPos
+  let step = if order == SortOrder.Ascending: 1 else: -1
+  var pos = if order == SortOrder.Ascending: lo else: hi - 1
+  for d in dbIter:
+    var c = 1
+    while pos >= lo and pos < hi:
+      c = cmpKey(batch.keys[pos], d.key) * step
+      if c > 0:
+        break
+      let op = batch.ops[batch.keys[pos]]
+      if not op.del:
+        yield (batch.keys[pos], op.val)
+      pos = pos + step
+      if c == 0:
+        break
+    if c != 0:
+      yield (d.key, d.val)
+  while pos >= lo and pos < hi:
+    let op = batch.ops[batch.keys[pos]]
+    if not op.del:
+      yield (batch.keys[pos], op.val)
+    pos = pos + step
+
+iterator gets*(batch: DbBatch, prefix: seq[byte]): DbBatchRow =
+  if batch.ops.len == 0:
+    for d in batch.db.gets(prefix):
+      yield (d.key, d.val)
+  else:
+    batch.sortKeys()
+    mergeRows(batch.db.gets(prefix), batch.lowerBound(prefix, false),
+              batch.lowerBound(prefix, true), SortOrder.Ascending)
+
+iterator gets*(batch: DbBatch, startkey, endkey: seq[byte]): DbBatchRow =
+  if batch.ops.len == 0:
+    for d in batch.db.gets(startkey, endkey):
+      yield (d.key, d.val)
+  else:
+    batch.sortKeys()
+    mergeRows(batch.db.gets(startkey, endkey), batch.lowerBound(startkey, false),
+              batch.lowerBound(endkey, true), SortOrder.Ascending)
+
+iterator getsRev*(batch: DbBatch, startkey, endkey: seq[byte]): DbBatchRow =
+  if batch.ops.len == 0:
+    for d in batch.db.getsRev(startkey, endkey):
+      yield (d.key, d.val)
+  else:
+    batch.sortKeys()
+    mergeRows(batch.db.getsRev(startkey, endkey), batch.lowerBound(endkey, false),
+              batch.lowerBound(startkey, true), SortOrder.Descending)
+
+proc journalKey(): seq[byte] {.inline.} = BytesBE(Prefix.params, ParamId.BatchJournal)
+
+proc apply(db: DbInst, ops: Table[seq[byte], DbBatchOp]) =
+  for key, op in ops:
+    if op.del:
+      db.del(key)
+    else:
+      db.put(key, op.val)
+
+proc journalData(ops: Table[seq[byte], DbBatchOp]): seq[byte] =
+  for key, op in ops:
+    result.add(varInt(key.len))
+    result.add(key)
+    if op.del:
+      result.add(1'u8)
+    else:
+      result.add(0'u8)
+      result.add(varInt(op.val.len))
+      result.add(op.val)
+
+proc commit*(batch: DbBatch) =
+  ## Writes all pending ops. The ops are first stored as a single journal
+  ## value, so a crash while applying them is repaired by recoverBatch. The
+  ## journal is one sequential value of the batch size, written and deleted
+  ## once per batch, -d:DB_BATCH_JOURNAL=false skips it.
+  if batch.ops.len == 0:
+    return
+  when DB_BATCH_JOURNAL:
+    let jkey = journalKey()
+    batch.db.put(jkey, journalData(batch.ops))
+    batch.db.apply(batch.ops)
+    batch.db.del(jkey)
+  else:
+    batch.db.apply(batch.ops)
+  batch.ops.clear()
+  batch.keys.setLen(0)
+  batch.sortedLen = 0
+
+proc rollback*(batch: DbBatch) =
+  batch.ops.clear()
+  batch.keys.setLen(0)
+  batch.sortedLen = 0
+
+proc recoverBatch*(db: DbInst): bool {.discardable.} =
+  let jkey = journalKey()
+  let journal = db.get(jkey)
+  if journal.len == 0:
+    return false
+  var ops = initTable[seq[byte], DbBatchOp]()
+  var reader = newReader(journal)
+  while reader.readable():
+    let key = reader.getBytes(reader.getVarInt)
+    if reader.getUint8 == 1'u8:
+      ops[key] = (true, @[])
+    else:
+      ops[key] = (false, reader.getBytes(reader.getVarInt))
+  db.apply(ops)
+  db.del(jkey)
+  result = true
+
+proc setParam*(db: DbHandle, paramId: ParamId, val: seq[byte]) =
+  let key = BytesBE(Prefix.params, paramId)
+  db.put(key, val)
+
+proc getParam*(db: DbHandle, paramId: ParamId): DbResult[seq[byte]] =
+  let key = BytesBE(Prefix.params, paramId)
+  let d = db.get(key)
+  if d.len > 0:
+    result = DbResult[seq[byte]](err: DbStatus.Success, res: d)
+  else:
+    result = DbResult[seq[byte]](err: DbStatus.NotFound)
+
+proc delParam*(db: DbHandle, paramId: ParamId) =
+  let key = BytesBE(Prefix.params, paramId)
+  db.del(key)
+
+proc setBlockHash*(db: DbHandle, height: int, hash: BlockHash, time: uint32, start_id: uint64) =
   let key = BytesBE(Prefix.blocks, height.uint32)
   let val = BytesBE(hash, time, start_id)
   db.put(key, val)
@@ -111,7 +339,7 @@ type
   BlockHashResult* = tuple[hash: BlockHash, time: uint32, start_id: uint64]
   DbBlockHashResult* = DbResult[BlockHashResult]
 
-proc getBlockHash*(db: DbInst, height: int): DbBlockHashResult =
+proc getBlockHash*(db: DbHandle, height: int): DbBlockHashResult =
   let key = BytesBE(Prefix.blocks, height.uint32)
   let d = db.get(key)
   if d.len == 44:
@@ -158,11 +386,11 @@ proc getLastBlockHash*(db: DbInst): DbLastBlockHashResult =
     break
   return DbLastBlockHashResult(err: DbStatus.NotFound)
 
-proc delBlockHash*(db: DbInst, height: int) =
+proc delBlockHash*(db: DbHandle, height: int) =
   let key = BytesBE(Prefix.blocks, height.uint32)
   db.del(key)
 
-proc setTx*(db: DbInst, txid: Hash, height: int, id: uint64, skip: uint8 = 0) =
+proc setTx*(db: DbHandle, txid: Hash, height: int, id: uint64, skip: uint8 = 0) =
   let key = BytesBE(Prefix.txs, txid)
   let val = BytesBE(height.uint32, id, skip.uint8)
   db.put(key, val)
@@ -171,7 +399,7 @@ type
   TxResult* = tuple[height: int, id: uint64, skip: uint8]
   DbTxResult* = DbResult[TxResult]
 
-proc getTx*(db: DbInst, txid: Hash): DbTxResult =
+proc getTx*(db: DbHandle, txid: Hash): DbTxResult =
   let key = BytesBE(Prefix.txs, txid)
   let d = db.get(key)
   if d.len == 13:
@@ -183,11 +411,11 @@ proc getTx*(db: DbInst, txid: Hash): DbTxResult =
   else:
     result = DbTxResult(err: DbStatus.NotFound)
 
-proc delTx*(db: DbInst, txid: Hash) =
+proc delTx*(db: DbHandle, txid: Hash) =
   let key = BytesBE(Prefix.txs, txid)
   db.del(key)
 
-proc setId*(db: DbInst, id: uint64, txid: Hash) =
+proc setId*(db: DbHandle, id: uint64, txid: Hash) =
   let key = BytesBE(Prefix.ids, id)
   let val = BytesBE(txid)
   db.put(key, val)
@@ -196,7 +424,7 @@ type
   IdResult* = Hash
   DbIdResult* = DbResult[IdResult]
 
-proc getId*(db: DbInst, id: uint64): DbIdResult =
+proc getId*(db: DbHandle, id: uint64): DbIdResult =
   let key = BytesBE(Prefix.ids, id)
   let d = db.get(key)
   if d.len >= 32:
@@ -206,11 +434,11 @@ proc getId*(db: DbInst, id: uint64): DbIdResult =
   else:
     result = DbIdResult(err: DbStatus.NotFound)
 
-proc delId*(db: DbInst, id: uint64) =
+proc delId*(db: DbHandle, id: uint64) =
   let key = BytesBE(Prefix.ids, id)
   db.del(key)
 
-proc setTxout*(db: DbInst, id: uint64, n: uint32,
+proc setTxout*(db: DbHandle, id: uint64, n: uint32,
               value: uint64, address_hash: Hash160, address_type: uint8) =
   let key = BytesBE(Prefix.txouts, id, n)
   let val = BytesBE(value, address_hash, address_type)
@@ -220,7 +448,7 @@ type
   TxoutResult* = tuple[value: uint64, address_hash: Hash160, address_type: uint8]
   DbTxoutResult* = DbResult[TxoutResult]
 
-proc getTxout*(db: DbInst, id: uint64, n: uint32): DbTxoutResult =
+proc getTxout*(db: DbHandle, id: uint64, n: uint32): DbTxoutResult =
   let key = BytesBE(Prefix.txouts, id, n)
   let d = db.get(key)
   if d.len == 29:
@@ -240,7 +468,7 @@ proc getTxout*(db: DbInst, id: uint64, n: uint32): DbTxoutResult =
 type
   TxoutsResult* = tuple[n: uint32, value: uint64, address_hash: Hash160, address_type: uint8]
 
-iterator getTxouts*(db: DbInst, id: uint64): TxoutsResult =
+iterator getTxouts*(db: DbHandle, id: uint64): TxoutsResult =
   let key = BytesBE(Prefix.txouts, id)
   for d in db.gets(key):
     if d.key.len != 13:
@@ -260,11 +488,11 @@ iterator getTxouts*(db: DbInst, id: uint64): TxoutsResult =
       let address_type = d.val[^1]
       yield (n, value, address_hash, address_type)
 
-proc delTxout*(db: DbInst, id: uint64, n: uint32) =
+proc delTxout*(db: DbHandle, id: uint64, n: uint32) =
   let key = BytesBE(Prefix.txouts, id, n)
   db.del(key)
 
-proc setUnspent*(db: DbInst, address_hash: Hash160, id: uint64,
+proc setUnspent*(db: DbHandle, address_hash: Hash160, id: uint64,
                 n: uint32, value: uint64) =
   let key = BytesBE(Prefix.unspents, address_hash, id, n)
   let val = BytesBE(value)
@@ -274,7 +502,7 @@ type
   UnspentResult* = uint64
   DbUnspentResult* = DbResult[UnspentResult]
 
-proc getUnspent*(db: DbInst, address_hash: Hash160, id: uint64,
+proc getUnspent*(db: DbHandle, address_hash: Hash160, id: uint64,
                 n: uint32): DbUnspentResult =
   let key = BytesBE(Prefix.unspents, address_hash, id, n)
   let d = db.get(key)
@@ -288,7 +516,7 @@ proc getUnspent*(db: DbInst, address_hash: Hash160, id: uint64,
 type
   UnspentsResult* = tuple[id: uint64, n: uint32, value: uint64]
 
-iterator getUnspents*(db: DbInst, address_hash: Hash160,
+iterator getUnspents*(db: DbHandle, address_hash: Hash160,
                     options: tuple = ()): UnspentsResult =
   var low_id: uint64 = uint64.low
   var high_id: uint64 = uint64.high
@@ -335,12 +563,12 @@ iterator getUnspents*(db: DbInst, address_hash: Hash160,
       let value = d.val[0].toUint64BE
       yield (id, n, value)
 
-proc delUnspent*(db: DbInst, address_hash: Hash160, id: uint64,
+proc delUnspent*(db: DbHandle, address_hash: Hash160, id: uint64,
                 n: uint32) =
   let key = BytesBE(Prefix.unspents, address_hash, id, n)
   db.del(key)
 
-proc setAddrval*(db: DbInst, address_hash: Hash160, value: uint64, utxo_count: uint32) =
+proc setAddrval*(db: DbHandle, address_hash: Hash160, value: uint64, utxo_count: uint32) =
   let key = BytesBE(Prefix.addrvals, address_hash)
   let val = BytesBE(value, utxo_count)
   db.put(key, val)
@@ -349,7 +577,7 @@ type
   AddrvalResult* = tuple[value: uint64, utxo_count: uint32]
   DbAddrvalResult* = DbResult[AddrvalResult]
 
-proc getAddrval*(db: DbInst, address_hash: Hash160): DbAddrvalResult =
+proc getAddrval*(db: DbHandle, address_hash: Hash160): DbAddrvalResult =
   let key = BytesBE(Prefix.addrvals, address_hash)
   let d = db.get(key)
   if d.len >= 12:
@@ -360,25 +588,36 @@ proc getAddrval*(db: DbInst, address_hash: Hash160): DbAddrvalResult =
   else:
     result = DbAddrvalResult(err: DbStatus.NotFound)
 
-proc delAddrval*(db: DbInst, address_hash: Hash160) =
+proc delAddrval*(db: DbHandle, address_hash: Hash160) =
   let key = BytesBE(Prefix.addrvals, address_hash)
   db.del(key)
 
-proc setAddrlog*(db: DbInst, address_hash: Hash160, id: uint64,
+const ADDRLOG_VAL_LEN = 9
+const ADDRLOG_EXT_VAL_LEN* = 50
+
+proc setAddrlog*(db: DbHandle, address_hash: Hash160, id: uint64,
                 trans: uint8, value: uint64, address_type: uint8) =
   let key = BytesBE(Prefix.addrlogs, address_hash, id, trans)
   let val = BytesBE(value, address_type)
   db.put(key, val)
 
+proc setAddrlog*(db: DbHandle, address_hash: Hash160, id: uint64,
+                trans: uint8, value: uint64, address_type: uint8,
+                height: int, time: uint32, mined: uint8, txid: Hash) =
+  ## Extended row, the history can be read without the ids, txs, blocks and minedids lookups.
+  let key = BytesBE(Prefix.addrlogs, address_hash, id, trans)
+  let val = BytesBE(value, address_type, height.uint32, time, mined, txid)
+  db.put(key, val)
+
 type
   AddrlogResult* = tuple[value: uint64, address_type: uint8]
   DbAddrlogResult* = DbResult[AddrlogResult]
 
-proc getAddrlog*(db: DbInst, address_hash: Hash160, id: uint64,
+proc getAddrlog*(db: DbHandle, address_hash: Hash160, id: uint64,
                 trans: uint8): DbAddrlogResult =
   let key = BytesBE(Prefix.addrlogs, address_hash, id, trans)
   let d = db.get(key)
-  if d.len == 9:
+  if d.len == ADDRLOG_VAL_LEN or d.len == ADDRLOG_EXT_VAL_LEN:
     var d = d
     let value = d[0].toUint64BE
     let address_type = d[8]
@@ -389,61 +628,80 @@ proc getAddrlog*(db: DbInst, address_hash: Hash160, id: uint64,
 type
   AddrlogsResult* = tuple[id: uint64, trans: uint8, value: uint64, address_type: uint8]
 
-iterator getAddrlogs*(db: DbInst, address_hash: Hash160,
-                    options: tuple = ()): AddrlogsResult =
-  var low_id: uint64 = uint64.low
-  var high_id: uint64 = uint64.high
-  var rev_flag = false
+  AddrlogsExResult* = tuple[id: uint64, trans: uint8, value: uint64, address_type: uint8,
+                            ext: bool, height: int, time: uint32, mined: uint8, txid: Hash]
 
+proc addrlogRange(options: tuple): tuple[low_id, high_id: uint64, rev: bool] =
+  result = (uint64.low, uint64.high, false)
   for key, val in options.fieldPairs:
     case key
     of "gte":
-      low_id = val.uint64
+      result.low_id = val.uint64
     of "gt":
       if val.uint64 == uint64.high:
         raise newException(DbError, "gt")
-      low_id = val.uint64 + 1'u64
+      result.low_id = val.uint64 + 1'u64
     of "lte":
-      high_id = val.uint64
+      result.high_id = val.uint64
     of "lt":
       if val.uint64 == uint64.low:
         raise newException(DbError, "lt")
-      high_id = val.uint64 - 1'u64
+      result.high_id = val.uint64 - 1'u64
     of "rev":
       if val.uint64 > uint64.low:
-        rev_flag = true
+        result.rev = true
 
+template addrlogRows(db: DbHandle, address_hash: Hash160, options: tuple, body: untyped) {.dirty.} =
+  let (low_id, high_id, rev_flag) = addrlogRange(options)
   if rev_flag:
     var startkey = BytesBE(Prefix.addrlogs, address_hash, high_id)
     var endkey = BytesBE(Prefix.addrlogs, address_hash, low_id)
     for d in db.getsRev(startkey, endkey):
-      if d.key.len != 30 or d.val.len != 9:
+      if d.key.len != 30 or (d.val.len != ADDRLOG_VAL_LEN and d.val.len != ADDRLOG_EXT_VAL_LEN):
         break
       var d = d
-      let id = d.key[^9].toUint64BE
-      let trans = d.key[^1]
-      let value = d.val[0].toUint64BE
-      let address_type = d.val[8]
-      yield (id, trans, value, address_type)
+      body
   else:
     var startkey = BytesBE(Prefix.addrlogs, address_hash, low_id)
     var endkey = BytesBE(Prefix.addrlogs, address_hash, high_id)
     for d in db.gets(startkey, endkey):
-      if d.key.len != 30 or d.val.len != 9:
+      if d.key.len != 30 or (d.val.len != ADDRLOG_VAL_LEN and d.val.len != ADDRLOG_EXT_VAL_LEN):
         break
       var d = d
-      let id = d.key[^9].toUint64BE
-      let trans = d.key[^1]
-      let value = d.val[0].toUint64BE
-      let address_type = d.val[8]
-      yield (id, trans, value, address_type)
+      body
 
-proc delAddrlog*(db: DbInst, address_hash: Hash160, id: uint64,
+iterator getAddrlogs*(db: DbHandle, address_hash: Hash160,
+                    options: tuple = ()): AddrlogsResult =
+  addrlogRows(db, address_hash, options):
+    let id = d.key[^9].toUint64BE
+    let trans = d.key[^1]
+    let value = d.val[0].toUint64BE
+    let address_type = d.val[8]
+    yield (id, trans, value, address_type)
+
+iterator getAddrlogsEx*(db: DbHandle, address_hash: Hash160,
+                      options: tuple = ()): AddrlogsExResult =
+  ## Rows written before the extended format have ext = false and only the basic fields.
+  addrlogRows(db, address_hash, options):
+    let id = d.key[^9].toUint64BE
+    let trans = d.key[^1]
+    let value = d.val[0].toUint64BE
+    let address_type = d.val[8]
+    if d.val.len == ADDRLOG_EXT_VAL_LEN:
+      let height = d.val[9].toUint32BE.int
+      let time = d.val[13].toUint32BE
+      let mined = d.val[17]
+      let txid = Hash(d.val[18..^1])
+      yield (id, trans, value, address_type, true, height, time, mined, txid)
+    else:
+      yield (id, trans, value, address_type, false, 0, 0'u32, 0'u8, Hash(@[]))
+
+proc delAddrlog*(db: DbHandle, address_hash: Hash160, id: uint64,
                 trans: uint8) =
   let key = BytesBE(Prefix.addrlogs, address_hash, id, trans)
   db.del(key)
 
-proc setMinedId*(db: DbInst, id: uint64, height: int) =
+proc setMinedId*(db: DbHandle, id: uint64, height: int) =
   let key = BytesBE(Prefix.minedids, id)
   let val = BytesBE(height.uint32)
   db.put(key, val)
@@ -452,7 +710,7 @@ type
   MinedIdResult* = int
   DbMinedIdResult* = DbResult[MinedIdResult]
 
-proc getMinedId*(db: DbInst, id: uint64): DbMinedIdResult =
+proc getMinedId*(db: DbHandle, id: uint64): DbMinedIdResult =
   let key = BytesBE(Prefix.minedids, id)
   let d = db.get(key)
   if d.len == 4:
@@ -462,10 +720,116 @@ proc getMinedId*(db: DbInst, id: uint64): DbMinedIdResult =
   else:
     result = DbMinedIdResult(err: DbStatus.NotFound)
 
-proc delMinedId*(db: DbInst, id: uint64) =
+proc delMinedId*(db: DbHandle, id: uint64) =
   let key = BytesBE(Prefix.minedids, id)
   db.del(key)
 
+type
+  AddrlogExt* = tuple[height: int, time: uint32, mined: uint8, txid: Hash]
+  DbAddrlogExtResult* = DbResult[AddrlogExt]
+  AddrlogExtCache* = tuple[height: int, time: uint32, start_id: uint64] # last block looked up
+
+proc initAddrlogExtCache*(): AddrlogExtCache = (-1, 0'u32, 0'u64)
+
+proc getAddrlogExt*(db: DbHandle, id: uint64, cache: var AddrlogExtCache): DbAddrlogExtResult =
+  ## Looks up the fields of the extended addrlog row for a tx id. The first tx
+  ## of the block is the mined one, same as the minedids.
+  let retId = db.getId(id)
+  if retId.err == DbStatus.NotFound:
+    return DbAddrlogExtResult(err: DbStatus.NotFound)
+  let retTx = db.getTx(retId.res)
+  if retTx.err == DbStatus.NotFound:
+    return DbAddrlogExtResult(err: DbStatus.NotFound)
+  let height = retTx.res.height
+  if cache.height != height:
+    let retBlock = db.getBlockHash(height)
+    if retBlock.err == DbStatus.NotFound:
+      return DbAddrlogExtResult(err: DbStatus.NotFound)
+    cache = (height, retBlock.res.time, retBlock.res.start_id)
+  let mined = if id == cache.start_id: 1'u8 else: 0'u8
+  result = DbAddrlogExtResult(err: DbStatus.Success, res: (height, cache.time, mined, retId.res))
+
+
+proc setBulkSpends*(db: DbHandle, id: uint64, spends: seq[byte]) =
+  let key = BytesBE(Prefix.bulkspends, id)
+  db.put(key, spends)
+
+type
+  BulkSpendsResult* = seq[tuple[txid: Hash, n: uint32]]
+  DbBulkSpendsResult* = DbResult[BulkSpendsResult]
+
+proc getBulkSpends*(db: DbHandle, id: uint64): DbBulkSpendsResult =
+  let key = BytesBE(Prefix.bulkspends, id)
+  let d = db.get(key)
+  if d.len > 0 and d.len mod 36 == 0:
+    var d = d
+    var spends: BulkSpendsResult
+    var pos = 0
+    while pos < d.len:
+      spends.add((d[pos..pos+31].toHash, d[pos+32].toUint32BE))
+      pos = pos + 36
+    result = DbBulkSpendsResult(err: DbStatus.Success, res: spends)
+  else:
+    result = DbBulkSpendsResult(err: DbStatus.NotFound)
+
+proc delBulkSpends*(db: DbHandle, id: uint64) =
+  let key = BytesBE(Prefix.bulkspends, id)
+  db.del(key)
+
+type
+  UndoSpent* = tuple[idx: uint32, id: uint64, n: uint32, value: uint64,
+                    address_hash: Hash160, address_type: uint8]
+  UndoResult* = tuple[txn: int, spents: seq[UndoSpent], addrs: seq[Hash160]]
+  DbUndoResult* = DbResult[UndoResult]
+
+proc setUndoSpents*(db: DbHandle, height: int, txn: int, spents: seq[UndoSpent]) =
+  let key = BytesBE(Prefix.undos, height.uint32, 0'u8)
+  var val = BytesBE(txn.uint32)
+  for s in spents:
+    let hash = cast[seq[byte]](s.address_hash)
+    val.add(BytesBE(s.idx, s.id, s.n, s.value, s.address_type, hash.len.uint8, hash))
+  db.put(key, val)
+
+proc setUndoAddrs*(db: DbHandle, height: int, addrs: seq[Hash160]) =
+  let key = BytesBE(Prefix.undos, height.uint32, 1'u8)
+  var val: seq[byte]
+  for a in addrs:
+    let hash = cast[seq[byte]](a)
+    val.add(BytesBE(hash.len.uint8, hash))
+  db.put(key, val)
+
+proc getUndo*(db: DbHandle, height: int): DbUndoResult =
+  let key = BytesBE(Prefix.undos, height.uint32)
+  var found = false
+  var undo: UndoResult
+  for d in db.gets(key):
+    if d.key.len != 6 or d.val.len == 0:
+      continue
+    var d = d
+    if d.key[5] == 0:
+      found = true
+      undo.txn = d.val[0].toUint32BE.int
+      var pos = 4
+      while pos + 26 <= d.val.len:
+        let hashLen = d.val[pos + 25].int
+        let hash = if hashLen > 0: Hash160(d.val[pos + 26 ..< pos + 26 + hashLen]) else: Hash160(@[])
+        undo.spents.add((d.val[pos].toUint32BE, d.val[pos + 4].toUint64BE, d.val[pos + 12].toUint32BE,
+                        d.val[pos + 16].toUint64BE, hash, d.val[pos + 24].uint8))
+        pos = pos + 26 + hashLen
+    elif d.key[5] == 1:
+      var pos = 0
+      while pos < d.val.len:
+        let hashLen = d.val[pos].int
+        undo.addrs.add(Hash160(d.val[pos + 1 .. pos + hashLen]))
+        pos = pos + 1 + hashLen
+  if found:
+    result = DbUndoResult(err: DbStatus.Success, res: undo)
+  else:
+    result = DbUndoResult(err: DbStatus.NotFound)
+
+proc delUndo*(db: DbHandle, height: int) =
+  db.del(BytesBE(Prefix.undos, height.uint32, 0'u8))
+  db.del(BytesBE(Prefix.undos, height.uint32, 1'u8))
 
 when isMainModule:
   import sequtils
@@ -507,3 +871,74 @@ when isMainModule:
   echo "-----"
   for d in db.gets(BytesBE(Prefix.unspents, address_hash)):
     echo d
+
+  # batch overlay, test keys under an unused bulkspends id
+  let testPrefix = BytesBE(Prefix.bulkspends, 0xffffffff'u32)
+  proc testKey(i: int): seq[byte] = testPrefix & BytesBE(i.uint8)
+
+  proc testKeys(db: DbHandle, rev = false): seq[int] =
+    if rev:
+      for d in db.getsRev(testPrefix, testPrefix):
+        result.add(d.key[^1].int)
+    else:
+      for d in db.gets(testPrefix):
+        result.add(d.key[^1].int)
+
+  proc clearTestKeys() =
+    var keys: seq[seq[byte]]
+    for d in db.gets(testPrefix):
+      keys.add(d.key)
+    for key in keys:
+      db.del(key)
+    db.del(journalKey())
+
+  clearTestKeys()
+  for i in [1, 3, 5]:
+    db.put(testKey(i), @[i.byte])
+
+  var batch = db.newBatch()
+  batch.put(testKey(2), @[2'u8])
+  batch.put(testKey(4), @[4'u8])
+  batch.del(testKey(3))
+  batch.put(testKey(5), @[50'u8])
+  batch.put(testKey(6), @[6'u8])
+  doAssert batch.testKeys() == @[1, 2, 4, 5, 6]
+  doAssert batch.testKeys(rev = true) == @[6, 5, 4, 2, 1]
+  doAssert batch.get(testKey(3)).len == 0
+  doAssert batch.get(testKey(5)) == @[50'u8]
+  for d in batch.gets(testPrefix):
+    if d.key == testKey(5):
+      doAssert d.val == @[50'u8]
+  var rangeKeys: seq[int]
+  for d in batch.gets(testKey(2), testKey(4)):
+    rangeKeys.add(d.key[^1].int)
+  doAssert rangeKeys == @[2, 4]
+  # keys added after a scan are merged into the sorted index
+  batch.put(testKey(0), @[0'u8])
+  doAssert batch.testKeys() == @[0, 1, 2, 4, 5, 6]
+  doAssert db.testKeys() == @[1, 3, 5]
+
+  batch.rollback()
+  doAssert batch.len == 0
+  doAssert batch.testKeys() == @[1, 3, 5]
+  doAssert batch.get(testKey(3)) == @[3'u8]
+
+  # a commit interrupted after the journal is written
+  batch.put(testKey(7), @[7'u8])
+  batch.del(testKey(1))
+  db.put(journalKey(), journalData(batch.ops))
+  batch.rollback()
+  doAssert db.get(testKey(7)).len == 0
+  doAssert db.recoverBatch()
+  doAssert db.testKeys() == @[3, 5, 7]
+  doAssert db.get(journalKey()).len == 0
+  doAssert not db.recoverBatch()
+
+  batch.put(testKey(8), @[8'u8])
+  batch.commit()
+  doAssert batch.len == 0
+  doAssert db.testKeys() == @[3, 5, 7, 8]
+  doAssert db.get(journalKey()).len == 0
+
+  clearTestKeys()
+  echo "batch ok"
@@ -22,6 +22,7 @@ type
     dataSize*: int
     dataLen*: int
     dataCount*: int
+    usedCount*: int # slots with the bitmap set, including deleted data
 
   HashTableMem*[Key, Val] = object of HashTableBase[Key, Val]
 
@@ -113,6 +114,7 @@ template loadHashTableModules*() {.dirty.} =
       result.bitmap = result.tableBuf
       result.table = cast[ptr UncheckedArray[HashTableDataObj[Key, Val]]](addr result.tableBuf[result.bitmapSize])
       result.dataCount = result.countData()
+      result.usedCount = result.countBitmap()
     except:
       result.mmap = memfiles.open(mmapFile, mode = fmReadWrite, newFileSize = result.tableBufSize)
       result.tableBuf = cast[ptr UncheckedArray[byte]](result.mmap.mem)
@@ -136,6 +138,7 @@ template loadHashTableModules*() {.dirty.} =
 
   proc clear*(hashTable: var HashTable) =
     zeroMem(hashTable.tableBuf, hashTable.tableBufSize)
+    hashTable.usedCount = 0
 
   proc set*(pair: HashTableData, key: HashTableData.Key, val: HashTableData.Val) {.inline.} = pair.key = key; pair.val = val
   proc set*(pair: HashTableData, src: HashTableData) {.inline.} = pair[] = src[]
@@ -152,6 +155,7 @@ template loadHashTableModules*() {.dirty.} =
         hashTable.setBitmap(hash)
         hashData.set(key, val)
         inc(hashTable.dataCount)
+        inc(hashTable.usedCount)
       else:
         when not DISABLE_HASHTABLEDATA_DELETE and declared(empty):
           if hashData.empty:
@@ -179,6 +183,7 @@ template loadHashTableModules*() {.dirty.} =
         hashTable.setBitmap(hash)
         hashData.set(key, val)
         inc(hashTable.dataCount)
+        inc(hashTable.usedCount)
       else:
         when not DISABLE_HASHTABLEDATA_DELETE and declared(empty):
           if hashData.empty:
@@ -0,0 +1,193 @@
+# Copyright (c) 2022 zenywallet
+
+# Appends JSON text straight into a reusable byte buffer, without building
+# JsonNode trees. Keep one writer per thread and reset it for each message.
+
+import json
+import bytes
+
+const JSON_MAX_SAFE_INTEGER = 9007199254740991'u64
+const JSON_WRITER_MAX_DEPTH = 63
+
+type
+  JsonWriter* = object
+    buf*: seq[byte]
+    depth: int
+    commas: uint64
+    afterKey: bool
+
+  JsonWriterError* = object of CatchableError
+
+const hexChars = "0123456789abcdef"
+const digitPairs = block:
+  var s = newString(200)
+  for i in 0..99:
+    s[i * 2] = char(ord('0') + i div 10)
+    s[i * 2 + 1] = char(ord('0') + i mod 10)
+  s
+
+proc reset*(w: var JsonWriter) =
+  w.buf.setLen(0) # keeps the capacity
+  w.depth = 0
+  w.commas = 0
+  w.afterKey = false
+
+proc len*(w: JsonWriter): int {.inline.} = w.buf.len
+
+proc toString*(w: JsonWriter): string = cast[string](w.buf)
+
+template addChar(w: var JsonWriter, c: char) = w.buf.add(c.byte)
+
+proc addRaw(w: var JsonWriter, s: openArray[char]) {.inline.} =
+  if s.len > 0:
+    let pos = w.buf.len
+    w.buf.setLen(pos + s.len)
+    copyMem(addr w.buf[pos], unsafeAddr s[0], s.len)
+
+proc prefix(w: var JsonWriter) {.inline.} =
+  if w.afterKey:
+    w.afterKey = false
+    return
+  let bit = 1'u64 shl w.depth
+  if (w.commas and bit) != 0:
+    w.addChar(',')
+  else:
+    w.commas = w.commas or bit
+
+proc enter(w: var JsonWriter, c: char) {.inline.} =
+  w.prefix()
+  if w.depth >= JSON_WRITER_MAX_DEPTH:
+    raise newException(JsonWriterError, "too deep")
+  w.addChar(c)
+  inc(w.depth)
+  w.commas = w.commas and not (1'u64 shl w.depth)
+
+proc leave(w: var JsonWriter, c: char) {.inline.} =
+  if w.depth <= 0:
+    raise newException(JsonWriterError, "unbalanced")
+  dec(w.depth)
+  w.addChar(c)
+
+proc beginObject*(w: var JsonWriter) = w.enter('{')
+proc endObject*(w: var JsonWriter) = w.leave('}')
+proc beginArray*(w: var JsonWriter) = w.enter('[')
+proc endArray*(w: var JsonWriter) = w.leave(']')
+
+proc addEscaped(w: var JsonWriter, s: string) =
+  w.addChar('"')
+  var start = 0
+  for i, c in s:
+    if c == '"' or c == '\\' or c < ' ':
+      w.addRaw(s.toOpenArray(start, i - 1))
+      case c
+      of '"': w.addRaw("\\\"")
+      of '\\': w.addRaw("\\\\")
+      of '\n': w.addRaw("\\n")
+      of '\r': w.addRaw("\\r")
+      of '\t': w.addRaw("\\t")
+      else:
+        w.addRaw("\\u00")
+        w.addChar(hexChars[c.uint8 shr 4])
+        w.addChar(hexChars[c.uint8 and 0x0f])
+      start = i + 1
+  w.addRaw(s.toOpenArray(start, s.high))
+  w.addChar('"')
+
+proc addUint(w: var JsonWriter, x: uint64) =
+  var tmp: array[20, char]
+  var pos = tmp.len
+  var x = x
+  while x >= 100:
+    let d = (x mod 100).int * 2
+    x = x div 100
+    dec(pos, 2)
+    tmp[pos] = digitPairs[d]
+    tmp[pos + 1] = digitPairs[d + 1]
+  if x >= 10:
+    let d = x.int * 2
+    dec(pos, 2)
+    tmp[pos] = digitPairs[d]
+    tmp[pos + 1] = digitPairs[d + 1]
+  else:
+    dec(pos)
+    tmp[pos] = char(ord('0') + x.int)
+  w.addRaw(tmp.toOpenArray(pos, tmp.high))
+
+proc key*(w: var JsonWriter, k: string) =
+  w.prefix()
+  w.addEscaped(k)
+  w.addChar(':')
+  w.afterKey = true
+
+proc value*(w: var JsonWriter, x: SomeSignedInt) =
+  w.prefix()
+  if x < 0:
+    w.addChar('-')
+    w.addUint(not x.int64.uint64 + 1)
+  else:
+    w.addUint(x.uint64)
+
+proc value*(w: var JsonWriter, x: SomeUnsignedInt) =
+  ## Same as toJson of uint64, a string above the safe integer range of JavaScript.
+  w.prefix()
+  if x.uint64 > JSON_MAX_SAFE_INTEGER:
+    w.addChar('"')
+    w.addUint(x.uint64)
+    w.addChar('"')
+  else:
+    w.addUint(x.uint64)
+
+proc value*(w: var JsonWriter, s: string) =
+  w.prefix()
+  w.addEscaped(s)
+
+proc value*(w: var JsonWriter, hash: Hash) =
+  ## Hex in the display order, same as $hash.
+  w.prefix()
+  let b = cast[seq[byte]](hash)
+  let pos = w.buf.len
+  w.buf.setLen(pos + b.len * 2 + 2)
+  w.buf[pos] = '"'.byte
+  var p = pos + 1
+  for i in countdown(b.high, 0):
+    w.buf[p] = hexChars[b[i] shr 4].byte
+    w.buf[p + 1] = hexChars[b[i] and 0x0f].byte
+    inc(p, 2)
+  w.buf[p] = '"'.byte
+
+proc value*(w: var JsonWriter, node: JsonNode) =
+  w.prefix()
+  var s: string
+  toUgly(s, node)
+  w.addRaw(s)
+
+template field*(w: var JsonWriter, k: string, v: untyped) =
+  w.key(k)
+  w.value(v)
+
+
+when isMainModule:
+  var w: JsonWriter
+  w.beginObject()
+  w.field("type", "utxo")
+  w.key("data")
+  w.beginObject()
+  w.field("nid", 0)
+  w.field("val", 9007199254740992'u64)
+  w.key("rows")
+  w.beginArray()
+  for i in 0..2:
+    w.beginObject()
+    w.field("id", i.uint64)
+    w.field("s", "a\"b\n")
+    w.endObject()
+  w.endArray()
+  w.field("neg", -1234567)
+  w.endObject()
+  w.field("ref", %*{"r": [1, 2]})
+  w.endObject()
+  assert parseJson(w.toString) == parseJson("""{"type":"utxo","data":{"nid":0,"val":"9007199254740992",""" &
+    """"rows":[{"id":0,"s":"a\"b\n"},{"id":1,"s":"a\"b\n"},{"id":2,"s":"a\"b\n"}],"neg":-1234567},"ref":{"r":[1,2]}}""")
+  w.reset()
+  w.value(Hash(@[byte 1, 2, 0xab]))
+  assert w.toString == "\"ab0201\""
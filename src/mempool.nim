@@ -1,6 +1,6 @@
 # Copyright (c) 2021 zenywallet
 
-import os, times, tables
+import os, times, monotimes, tables
 import bytes, rpc, tcp, db, utils
 import address, script, blocks, tx
 import algorithm
@@ -80,6 +80,171 @@ template debug(x: varargs[string, `$`]) {.used.} = echo join(x)
 template info(x: varargs[string, `$`]) {.used.} = echo join(x)
 template error(x: varargs[string, `$`]) {.used.} = echo join(x)
 
+const SLAB_CHUNK_SIZE = 64 * 1024
+const SLAB_ALIGN = 8
+const SLAB_CLASSES = 33 # size classes up to 256 bytes, larger objects use allocShared0
+
+type
+  SlabFreeObj = object
+    next: ptr SlabFreeObj
+
+  SlabChunkObj = object
+    prev, next: ptr SlabChunkObj # chunks of the size class
+    availPrev, availNext: ptr SlabChunkObj # chunks with free objects
+    free: ptr SlabFreeObj
+    used: int
+
+  SlabChunk = ptr SlabChunkObj
+
+  Slab = object
+    chunks: SlabChunk
+    avail: SlabChunk
+    used: int
+    capacity: int
+
+  MempoolSlabs* = object
+    slabs: array[SLAB_CLASSES, Slab]
+    largeCount: int
+    largeBytes: int
+
+var slabs {.threadvar.}: ptr MempoolSlabs
+
+proc posix_memalign(memptr: ptr pointer, alignment: csize_t, size: csize_t): cint {.importc, header: "<stdlib.h>".}
+proc c_free(p: pointer) {.importc: "free", header: "<stdlib.h>".}
+
+proc chunkOf(p: pointer): SlabChunk {.inline.} =
+  ## Chunks are aligned to their size, the chunk of an object is its address
+  ## with the low bits cleared.
+  cast[SlabChunk](cast[uint](p) and not (SLAB_CHUNK_SIZE - 1).uint)
+
+proc chunkCount(objSize: int): int {.inline.} = (SLAB_CHUNK_SIZE - sizeof(SlabChunkObj)) div objSize
+
+proc linkAvail(slab: var Slab, chunk: SlabChunk) =
+  chunk.availPrev = nil
+  chunk.availNext = slab.avail
+  if not slab.avail.isNil:
+    slab.avail.availPrev = chunk
+  slab.avail = chunk
+
+proc unlinkAvail(slab: var Slab, chunk: SlabChunk) =
+  if chunk.availPrev.isNil:
+    slab.avail = chunk.availNext
+  else:
+    chunk.availPrev.availNext = chunk.availNext
+  if not chunk.availNext.isNil:
+    chunk.availNext.availPrev = chunk.availPrev
+  chunk.availPrev = nil
+  chunk.availNext = nil
+
+proc newChunk(slab: var Slab, objSize: int) =
+  var mem: pointer
+  if posix_memalign(addr mem, SLAB_CHUNK_SIZE.csize_t, SLAB_CHUNK_SIZE.csize_t) != 0:
+    raise newException(MempoolError, "slab chunk alloc failed")
+  let chunk = cast[SlabChunk](mem)
+  zeroMem(chunk, sizeof(SlabChunkObj))
+  chunk.next = slab.chunks
+  if not slab.chunks.isNil:
+    slab.chunks.prev = chunk
+  slab.chunks = chunk
+  let count = chunkCount(objSize)
+  var p = cast[uint](chunk) + sizeof(SlabChunkObj).uint
+  for i in 0..<count:
+    let f = cast[ptr SlabFreeObj](p)
+    f.next = chunk.free
+    chunk.free = f
+    p = p + objSize.uint
+  slab.capacity = slab.capacity + count
+  slab.linkAvail(chunk)
+
+proc freeChunk(slab: var Slab, chunk: SlabChunk, objSize: int) =
+  slab.unlinkAvail(chunk)
+  if chunk.prev.isNil:
+    slab.chunks = chunk.next
+  else:
+    chunk.prev.next = chunk.next
+  if not chunk.next.isNil:
+    chunk.next.prev = chunk.prev
+  slab.capacity = slab.capacity - chunkCount(objSize)
+  c_free(chunk)
+
+proc release(slab: var Slab) =
+  var chunk = slab.chunks
+  while not chunk.isNil:
+    let next = chunk.next
+    c_free(chunk)
+    chunk = next
+  slab.chunks = nil
+  slab.avail = nil
+  slab.capacity = 0
+
+proc slabAlloc(slabs: ptr MempoolSlabs, size: int): pointer =
+  ## Fixed size objects of a network are carved from 64KB chunks of its size
+  ## class. Only the mempool thread of the network allocates and frees them.
+  let cls = (size + SLAB_ALIGN - 1) div SLAB_ALIGN
+  if cls >= SLAB_CLASSES:
+    inc(slabs.largeCount)
+    slabs.largeBytes = slabs.largeBytes + size
+    return allocShared0(size)
+  let slab = addr slabs.slabs[cls]
+  let objSize = cls * SLAB_ALIGN
+  if slab.avail.isNil:
+    slab[].newChunk(objSize)
+  let chunk = slab.avail
+  result = chunk.free
+  chunk.free = chunk.free.next
+  if chunk.free.isNil:
+    slab[].unlinkAvail(chunk)
+  zeroMem(result, objSize)
+  inc(chunk.used)
+  inc(slab.used)
+
+proc slabFree(slabs: ptr MempoolSlabs, p: pointer, size: int) =
+  ## A chunk goes back to the OS as soon as its last object is freed, so the
+  ## eviction after a block returns memory of busy size classes as well. One
+  ## empty chunk is kept while it is the only chunk of the class.
+  let cls = (size + SLAB_ALIGN - 1) div SLAB_ALIGN
+  if cls >= SLAB_CLASSES:
+    dec(slabs.largeCount)
+    slabs.largeBytes = slabs.largeBytes - size
+    p.deallocShared()
+    return
+  let slab = addr slabs.slabs[cls]
+  let chunk = chunkOf(p)
+  let f = cast[ptr SlabFreeObj](p)
+  if chunk.free.isNil:
+    slab[].linkAvail(chunk)
+  f.next = chunk.free
+  chunk.free = f
+  dec(chunk.used)
+  dec(slab.used)
+  if chunk.used == 0 and (chunk != slab.chunks or not chunk.next.isNil):
+    slab[].freeChunk(chunk, cls * SLAB_ALIGN)
+
+proc release(slabs: ptr MempoolSlabs) =
+  for i in 0..<SLAB_CLASSES:
+    slabs.slabs[i].release()
+    slabs.slabs[i].used = 0
+
+proc slabNew[T](): ptr T = cast[ptr T](slabs.slabAlloc(sizeof(T)))
+
+proc slabDispose[T](p: ptr T) = slabs.slabFree(p, sizeof(T))
+
+proc allocPair(size: int): pointer = slabs.slabAlloc(size)
+
+proc freePair(p: pointer, size: int) = slabs.slabFree(p, size)
+
+proc memStats*(slabs: ptr MempoolSlabs): string =
+  var used, reserved: int
+  var classes: seq[string]
+  for i in 0..<SLAB_CLASSES:
+    let slab = slabs.slabs[i]
+    if slab.capacity > 0:
+      used = used + slab.used * i * SLAB_ALIGN
+      reserved = reserved + (slab.capacity * i * SLAB_ALIGN)
+      classes.add($(i * SLAB_ALIGN) & ":" & $slab.used & "/" & $slab.capacity)
+  "mem used=" & $(used + slabs.largeBytes) & " reserved=" & $(reserved + slabs.largeBytes) &
+    " large=" & $slabs.largeCount & " slabs=" & classes.join(",")
+
 proc toFixedHash160(h: Hash160): Hash160 =
   var s = h.toBytes
   if s.len == 20:
@@ -92,7 +257,7 @@ proc toFixedHash160(h: Hash160): Hash160 =
 
 proc newMempoolAddrSpent(address_type: AddressType, txid: Hash, n: uint32,
                         value: uint64, txid_out: Hash): MempoolAddrSpent =
-  let p = cast[MempoolAddrSpent](allocShared0(sizeof(MempoolAddrSpentObj)))
+  let p = slabNew[MempoolAddrSpentObj]()
   p.address_type = address_type
   let txidSeq = cast[seq[byte]](txid)
   if txidSeq.len != 32:
@@ -108,7 +273,7 @@ proc newMempoolAddrSpent(address_type: AddressType, txid: Hash, n: uint32,
 
 proc newMempoolAddrTxout(address_type: AddressType, txid: Hash, n: uint32,
                         value: uint64): MempoolAddrTxout =
-  let p = cast[MempoolAddrTxout](allocShared0(sizeof(MempoolAddrTxoutObj)))
+  let p = slabNew[MempoolAddrTxoutObj]()
   p.address_type = address_type
   let txidSeq = cast[seq[byte]](txid)
   if txidSeq.len != 32:
@@ -120,7 +285,7 @@ proc newMempoolAddrTxout(address_type: AddressType, txid: Hash, n: uint32,
 
 proc newMempoolTxAddr(address_hash: Hash160, address_type: AddressType,
                       trans: uint8, value: uint64): MempoolTxAddr =
-  let p = cast[MempoolTxAddr](allocShared0(sizeof(MempoolTxAddrObj)))
+  let p = slabNew[MempoolTxAddrObj]()
   let ahash = cast[seq[byte]](address_hash)
   if ahash.len != 20:
     raise newException(MempoolError, "invalid address_hash txaddr")
@@ -132,7 +297,7 @@ proc newMempoolTxAddr(address_hash: Hash160, address_type: AddressType,
 
 proc newMempoolTxTxout(n: uint32, value: uint64, address_hash: Hash160,
                       address_type: AddressType): MempoolTxTxout =
-  let p = cast[MempoolTxTxout](allocShared0(sizeof(MempoolTxTxoutObj)))
+  let p = slabNew[MempoolTxTxoutObj]()
   p.n = n
   p.value = value
   let ahash = cast[seq[byte]](address_hash)
@@ -144,7 +309,7 @@ proc newMempoolTxTxout(n: uint32, value: uint64, address_hash: Hash160,
 
 proc newMempoolTxSpent(txid: Hash, n: uint32, value: uint64, address_hash: Hash160,
                       address_type: AddressType): MempoolTxSpent =
-  let p = cast[MempoolTxSpent](allocShared0(sizeof(MempoolTxSpentObj)))
+  let p = slabNew[MempoolTxSpentObj]()
   let txidSeq = cast[seq[byte]](txid)
   if txidSeq.len != 32:
     raise newException(MempoolError, "invalid txid")
@@ -159,7 +324,7 @@ proc newMempoolTxSpent(txid: Hash, n: uint32, value: uint64, address_hash: Hash1
   result = p
 
 proc newMempoolUnconf(value_out: uint64, value_in: uint64): MempoolUnconf =
-  let p = cast[MempoolUnconf](allocShared0(sizeof(MempoolUnconfObj)))
+  let p = slabNew[MempoolUnconfObj]()
   p.value_out = value_out
   p.value_in = value_in
   result = p
@@ -171,7 +336,7 @@ proc freeVal[T](val: T) =
             MempoolTxTxout |
             MempoolTxSpent |
             MempoolUnconf:
-    val.deallocShared()
+    val.slabDispose()
   else:
     discard
 
@@ -182,7 +347,96 @@ proc `$`*(data: HashObj | Hash160Obj): string =
 
 loadUthashModules()
 
-var txsTable {.threadvar.}: Table[string, Tx]
+type
+  TxStore = object
+    arena: seq[byte]
+    index: Table[HashObj, tuple[pos: int, size: int]]
+    dead: int
+
+const TX_STORE_COMPACT_MIN = 1024 * 1024
+
+var txStore {.threadvar.}: TxStore
+
+proc toHashObj(txid: Hash): HashObj =
+  let b = cast[seq[byte]](txid)
+  if b.len != 32:
+    raise newException(MempoolError, "invalid txid")
+  copyMem(addr result[0], unsafeAddr b[0], sizeof(HashObj))
+
+proc len(store: var TxStore): int = store.index.len
+
+proc contains(store: var TxStore, txid: HashObj): bool = store.index.hasKey(txid)
+
+proc add(store: var TxStore, txid: HashObj, data: openArray[byte]) =
+  ## Raw txs are appended to one arena, the parsed form is not kept.
+  if store.index.hasKey(txid) or data.len == 0:
+    return
+  let pos = store.arena.len
+  store.arena.setLen(pos + data.len)
+  copyMem(addr store.arena[pos], unsafeAddr data[0], data.len)
+  store.index[txid] = (pos, data.len)
+
+proc compact(store: var TxStore) =
+  var arena = newSeqOfCap[byte](store.arena.len - store.dead)
+  for txid, loc in store.index.mpairs:
+    let pos = arena.len
+    arena.setLen(pos + loc.size)
+    copyMem(addr arena[pos], addr store.arena[loc.pos], loc.size)
+    loc.pos = pos
+  store.arena = move(arena)
+  store.dead = 0
+
+proc del(store: var TxStore, txid: HashObj) =
+  ## Evicted txs leave holes, the arena is rebuilt once half of it is dead.
+  var loc: tuple[pos: int, size: int]
+  if store.index.pop(txid, loc):
+    store.dead = store.dead + loc.size
+    if store.dead >= TX_STORE_COMPACT_MIN and store.dead * 2 >= store.arena.len:
+      store.compact()
+
+proc clear(store: var TxStore) =
+  store.arena = @[]
+  store.index.clear()
+  store.dead = 0
+
+proc stats(store: var TxStore): string =
+  let indexBytes = store.len * (sizeof(HashObj) + sizeof(int) * 3)
+  let perTx = if store.len > 0: (store.arena.len + indexBytes) div store.len else: 0
+  "txs=" & $store.len & " arena=" & $store.arena.len & " dead=" & $store.dead &
+    " index~" & $indexBytes & " bytes/tx~" & $perTx
+
+type
+  OutpointKey = tuple[txid: HashObj, n: uint32]
+
+  MempoolConflict* = tuple[txid: Hash, by: Hash,
+                          addrs: seq[tuple[hash160: Hash160, addressType: AddressType]]]
+
+var outpoints {.threadvar.}: Table[OutpointKey, HashObj] # spent outpoint - spending txid
+var conflicts {.threadvar.}: seq[MempoolConflict]
+var pendingIns {.threadvar.}: Table[HashObj, seq[tuple[txid: HashObj, n: uint32]]] # parent txid - spending txid, n
+
+proc addOutpoints(txid: HashObj, tx: Tx) =
+  for txin in tx.ins:
+    outpoints[(txin.tx.toHashObj, txin.n)] = txid
+
+proc delOutpoints(txid: HashObj, tx: Tx) =
+  for txin in tx.ins:
+    let key = (txin.tx.toHashObj, txin.n)
+    if outpoints.getOrDefault(key) == txid:
+      outpoints.del(key)
+
+proc rawTx*(txid: Hash): seq[byte] =
+  ## Raw tx of the mempool of this thread.
+  let txidObj = txid.toHashObj
+  if txStore.index.hasKey(txidObj):
+    let loc = txStore.index[txidObj]
+    result = txStore.arena[loc.pos..<loc.pos + loc.size]
+
+proc parsedTx*(txid: Hash): Tx =
+  ## Parses the raw tx on request, nil if it is not in the mempool of this thread.
+  let data = rawTx(txid)
+  if data.len > 0:
+    result = data.toTx
 
 type
   MempoolParams* = tuple[nodeParams: NodeParams, dbInst: DbInst, id: int]
@@ -199,6 +453,20 @@ var kvTxSpents {.threadvar.}: ptr KVHandle[MempoolTxSpent]
 var kvUnconfs {.threadvar.}: ptr KVHandle[MempoolUnconf]
 
 const MAX_TXS_GET_ONCE = 100
+const MEMPOOL_SNAPSHOT_MAGIC = 0x3150534d'u32 # MSP1
+const MEMPOOL_SNAPSHOT_VERSION = 1'u32
+const MEMPOOL_LOCK_TXS {.intdefine.} = 1000 # txs applied in a write lock
+const MEMPOOL_FETCH_WORKERS {.intdefine.} = 4
+const MEMPOOL_FETCH_TARGET_MS {.intdefine.} = 500 # latency of a batch request
+const MEMPOOL_FETCH_BATCH_MAX {.intdefine.} = 2000
+const MEMPOOL_CATCHUP_TXS {.intdefine.} = 20_000 # txs fetched by an update call
+
+var fetchBatchSize {.threadvar.}: int
+
+const FEE_BUCKETS = [0, 1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20, 25, 30, 40, 50, 60, 80, 100,
+                    120, 150, 200, 250, 300, 400, 500, 700, 1000, 1500, 2000] # sat/vB, lower bounds
+const MEMPOOL_BLOCK_VSIZE {.intdefine.} = 1_000_000
+const FEE_TARGETS = [1, 2, 3, 6, 12, 24] # blocks
 
 type
   KVHandles = object
@@ -208,6 +476,25 @@ type
     kvTxTxoutsHandle: KVHandle[MempoolTxTxout]
     kvTxSpentsHandle: KVHandle[MempoolTxSpent]
     kvUnconfsHandle: KVHandle[MempoolUnconf]
+    lock: RWLock
+    lockStats: MempoolLockStats
+    slabs: MempoolSlabs
+    feeHist: FeeHistogram
+
+  FeeBucket* = object
+    count*: int
+    vsize*: int
+
+  FeeHistogram* = array[FEE_BUCKETS.len, FeeBucket]
+
+  MempoolLockStats* = object
+    readCount*: int
+    readWaitUs*: int
+    readHoldUs*: int
+    writeCount*: int
+    writeWaitUs*: int
+    writeHoldUs*: int
+    writeHoldMaxUs*: int
 
   KVs* = object
     kvAddrSpents*: ptr KVHandle[MempoolAddrSpent]
@@ -216,14 +503,53 @@ type
     kvTxTxouts*: ptr KVHandle[MempoolTxTxout]
     kvTxSpents*: ptr KVHandle[MempoolTxSpent]
     kvUnconfs*: ptr KVHandle[MempoolUnconf]
+    lock: ptr RWLock
+    lockStats*: ptr MempoolLockStats
+    slabs*: ptr MempoolSlabs
+    feeHist: ptr FeeHistogram
+    pushActive: bool # set once the mempool thread of the network drains the pushes
+
+type
+  PushChannelParam = tuple[txid: HashObj, data: seq[byte]]
+
+  MempoolPushed* = tuple[txid: Hash, addrs: seq[tuple[hash160: Hash160, addressType: AddressType]]]
+
+const MEMPOOL_PUSH_POLL_MS = 20
+
+var pushChannels: ptr UncheckedArray[Channel[PushChannelParam]]
+var pushed {.threadvar.}: seq[MempoolPushed]
 
 var kvHandles: ptr UncheckedArray[KVHandles]
 var kvs*: ptr UncheckedArray[KVs]
 var kvsLen*: int
 
-var kvLock: RWLock
+var feeHist {.threadvar.}: ptr FeeHistogram
+var txFees {.threadvar.}: Table[HashObj, tuple[bucket: int, vsize: int]]
+
+proc feeBucket(feeRate: float): int =
+  for i in countdown(FEE_BUCKETS.high, 0):
+    if feeRate >= FEE_BUCKETS[i].float:
+      return i
+
+proc addFee(txid: HashObj, fee: uint64, vsize: int) =
+  ## Histogram of the txs with known fees, call with the write lock.
+  if vsize <= 0 or txFees.hasKey(txid):
+    return
+  let bucket = feeBucket(fee.float / vsize.float)
+  txFees[txid] = (bucket, vsize)
+  inc(feeHist[][bucket].count)
+  feeHist[][bucket].vsize = feeHist[][bucket].vsize + vsize
+
+proc delFee(txid: HashObj) =
+  var f: tuple[bucket: int, vsize: int]
+  if txFees.pop(txid, f):
+    dec(feeHist[][f.bucket].count)
+    feeHist[][f.bucket].vsize = feeHist[][f.bucket].vsize - f.vsize
 
 proc init*(mempoolNumber: int) =
+  pushChannels = cast[ptr UncheckedArray[Channel[PushChannelParam]]](allocShared0(sizeof(Channel[PushChannelParam]) * mempoolNumber))
+  for i in 0..<mempoolNumber:
+    pushChannels[i].open()
   kvHandles = cast[ptr UncheckedArray[KVHandles]](allocShared0(sizeof(KVHandles) * mempoolNumber))
   kvs = cast[ptr UncheckedArray[KVs]](allocShared0(sizeof(KVs) * mempoolNumber))
   zeroMem(kvHandles, sizeof(KVHandles) * mempoolNumber)
@@ -234,16 +560,74 @@ proc init*(mempoolNumber: int) =
     kvs[i].kvTxTxouts = addr kvHandles[i].kvTxTxoutsHandle
     kvs[i].kvTxSpents = addr kvHandles[i].kvTxSpentsHandle
     kvs[i].kvUnconfs = addr kvHandles[i].kvUnconfsHandle
+    kvs[i].lock = addr kvHandles[i].lock
+    kvs[i].lockStats = addr kvHandles[i].lockStats
+    kvs[i].slabs = addr kvHandles[i].slabs
+    kvs[i].feeHist = addr kvHandles[i].feeHist
+    rwlockInit(kvs[i].lock[])
   kvsLen = mempoolNumber
-  rwlockInit(kvLock)
 
 proc deinit*() =
+  for i in 0..<kvsLen:
+    rwlockDestroy(kvs[i].lock[])
+    kvs[i].slabs.release()
+    pushChannels[i].close()
+  pushChannels.deallocShared()
   kvs.deallocShared()
   kvHandles.deallocShared()
-  rwlockDestroy(kvLock)
+
+template withKVReadLock(poolId: int, body: untyped) =
+  ## Per network read lock, the stream readers only wait for the updater of
+  ## the same network.
+  let lockKVs = kvs[poolId]
+  let waitStart = getMonoTime()
+  rdlock(lockKVs.lock[])
+  let holdStart = getMonoTime()
+  try:
+    body
+  finally:
+    let holdEnd = getMonoTime()
+    unlock(lockKVs.lock[])
+    atomicInc(lockKVs.lockStats.readCount)
+    atomicInc(lockKVs.lockStats.readWaitUs, (holdStart - waitStart).inMicroseconds.int)
+    atomicInc(lockKVs.lockStats.readHoldUs, (holdEnd - holdStart).inMicroseconds.int)
+
+template withKVWriteLock(poolId: int, body: untyped) =
+  ## Per network write lock, only the mempool thread of the network writes and
+  ## it takes the lock once for each batch of txs.
+  let lockKVs = kvs[poolId]
+  let waitStart = getMonoTime()
+  wrlock(lockKVs.lock[])
+  let holdStart = getMonoTime()
+  try:
+    body
+  finally:
+    let holdUs = (getMonoTime() - holdStart).inMicroseconds.int
+    unlock(lockKVs.lock[])
+    let stats = lockKVs.lockStats
+    stats.writeCount = stats.writeCount + 1
+    stats.writeWaitUs = stats.writeWaitUs + (holdStart - waitStart).inMicroseconds.int
+    stats.writeHoldUs = stats.writeHoldUs + holdUs
+    stats.writeHoldMaxUs = max(stats.writeHoldMaxUs, holdUs)
+
+proc memStats*(poolId: int): string = kvs[poolId].slabs.memStats()
+
+proc lockStats*(poolId: int): string =
+  let stats = kvs[poolId].lockStats
+  let readAvg = if stats.readCount > 0: stats.readWaitUs div stats.readCount else: 0
+  let writeAvg = if stats.writeCount > 0: stats.writeHoldUs div stats.writeCount else: 0
+  "lock read=" & $stats.readCount & " wait=" & $stats.readWaitUs & "us avg=" & $readAvg &
+    "us hold=" & $stats.readHoldUs & "us write=" & $stats.writeCount &
+    " wait=" & $stats.writeWaitUs & "us hold=" & $stats.writeHoldUs & "us avg=" & $writeAvg &
+    "us max=" & $stats.writeHoldMaxUs & "us"
+
+proc startFetchWorkers()
 
 proc setParams*(mempoolParams: MempoolParams) =
-  txsTable = initTable[string, Tx]()
+  txStore.clear()
+  outpoints = initTable[OutpointKey, HashObj]()
+  conflicts = @[]
+  pushed = @[]
   mparams = mempoolParams
   dbInst = mparams.dbInst
   poolId = mparams.id
@@ -254,6 +638,12 @@ proc setParams*(mempoolParams: MempoolParams) =
   kvTxTxouts = kvs[poolId].kvTxTxouts
   kvTxSpents = kvs[poolId].kvTxSpents
   kvUnconfs = kvs[poolId].kvUnconfs
+  slabs = kvs[poolId].slabs
+  feeHist = kvs[poolId].feeHist
+  txFees = initTable[HashObj, tuple[bucket: int, vsize: int]]()
+  fetchBatchSize = MAX_TXS_GET_ONCE
+  startFetchWorkers()
+  atomicStoreN(addr kvs[poolId].pushActive, true, ATOMIC_RELEASE)
 
 type
   TxAddrVal = tuple[hash160: Hash160, addressType: AddressType, value: uint64, count: uint32]
@@ -279,10 +669,11 @@ proc mempoolTx*(poolId: int, txid: Hash, network: Network): JsonNode =
   var txinvals: seq[TxAddrVal]
   var txoutvals: seq[TxAddrVal]
   let txkey = txid.toBytes
-  for spent in kvTxSpents.items(txkey):
-    txinvals.add((spent.val.address_hash.toBytes.Hash160, spent.val.address_type, spent.val.value, 1'u32))
-  for txout in kvTxTxouts.items(txkey):
-    txoutvals.add((txout.val.address_hash.toBytes.Hash160, txout.val.address_type, txout.val.value, 1'u32))
+  withKVReadLock(poolId):
+    for spent in kvTxSpents.items(txkey):
+      txinvals.add((spent.val.address_hash.toBytes.Hash160, spent.val.address_type, spent.val.value, 1'u32))
+    for txout in kvTxTxouts.items(txkey):
+      txoutvals.add((txout.val.address_hash.toBytes.Hash160, txout.val.address_type, txout.val.value, 1'u32))
   if txinvals.len > 0 or txoutvals.len > 0:
     var addrins = newJArray()
     var addrouts = newJArray()
@@ -299,51 +690,323 @@ proc mempoolTx*(poolId: int, txid: Hash, network: Network): JsonNode =
   else:
     result = newJNull()
 
+type
+  FetchedTx = tuple[txid: string, data: seq[byte], tx: Tx]
+
+  FetchJob = tuple[idx: int, txids: seq[string]]
+
+  FetchResult = tuple[idx: int, err: string, elapsed: float, txs: seq[FetchedTx]]
+
+  FetchWorkerParams = tuple[rpcConfig: RpcConfig, jobs: ptr Channel[FetchJob],
+                            results: ptr Channel[FetchResult]]
+
+proc fetchWorker(params: FetchWorkerParams) {.thread.} =
+  ## Fetches and parses the txs of each job, an empty job stops the worker.
+  setRpcConfig(params.rpcConfig)
+  while true:
+    let (idx, txids) = params.jobs[].recv()
+    if txids.len == 0:
+      break
+    var ret: FetchResult
+    ret.idx = idx
+    let start = epochTime()
+    try:
+      var rpcCmds: RpcCommands
+      for txid in txids:
+        rpcCmds.add(getRawTransaction.setParams(txid))
+      var rpcResults = rpcCmds.send()
+      if txids.len != rpcResults.len:
+        raise newException(MempoolError, "rpc failed")
+      for i, txid in txids:
+        let rpcResult = rpcResults[i]["result"]
+        if rpcResult.kind != JString:
+          ret.txs.add((txid, newSeq[byte](), Tx(nil)))
+        else:
+          let data = rpcResult.getStr.Hex.toBytes
+          ret.txs.add((txid, data, data.toTx))
+    except:
+      ret.err = getCurrentExceptionMsg()
+    ret.elapsed = epochTime() - start
+    params.results[].send(ret)
+
+proc adjustBatchSize(elapsed: float) =
+  ## Doubles the batch while the rpc replies well under the target latency and
+  ## halves it over the target.
+  let elapsedMs = (elapsed * 1000).int
+  if elapsedMs < MEMPOOL_FETCH_TARGET_MS div 2:
+    fetchBatchSize = min(fetchBatchSize * 2, MEMPOOL_FETCH_BATCH_MAX)
+  elif elapsedMs > MEMPOOL_FETCH_TARGET_MS:
+    fetchBatchSize = max(fetchBatchSize div 2, MAX_TXS_GET_ONCE)
+
+var fetchJobs {.threadvar.}: ptr Channel[FetchJob]
+var fetchResults {.threadvar.}: ptr Channel[FetchResult]
+var fetchThreads {.threadvar.}: seq[Thread[FetchWorkerParams]]
+
+proc startFetchWorkers() =
+  ## The fetch workers of the network and their keep-alive rpc connections
+  ## live as long as the mempool thread, until free.
+  if not fetchJobs.isNil:
+    return
+  fetchJobs = cast[ptr Channel[FetchJob]](allocShared0(sizeof(Channel[FetchJob])))
+  fetchResults = cast[ptr Channel[FetchResult]](allocShared0(sizeof(Channel[FetchResult])))
+  fetchJobs[].open()
+  fetchResults[].open()
+  let rpcConfig = RpcConfig(rpcUrl: mparams.nodeParams.rpcUrl, rpcUserPass: mparams.nodeParams.rpcUserPass)
+  fetchThreads = newSeq[Thread[FetchWorkerParams]](max(MEMPOOL_FETCH_WORKERS, 1))
+  for i in 0..<fetchThreads.len:
+    createThread(fetchThreads[i], fetchWorker, (rpcConfig, fetchJobs, fetchResults))
+
+proc free*() =
+  ## Stops the fetch workers of the mempool thread.
+  if fetchJobs.isNil:
+    return
+  for i in 0..<fetchThreads.len:
+    fetchJobs[].send((-1, newSeq[string]()))
+  fetchThreads.joinThreads()
+  fetchThreads = @[]
+  fetchJobs[].close()
+  fetchResults[].close()
+  deallocShared(fetchJobs)
+  deallocShared(fetchResults)
+  fetchJobs = nil
+  fetchResults = nil
+
+proc fetchBacklog(txids: seq[string]): seq[FetchedTx] =
+  ## Several batches are in flight at once, each worker keeps its own rpc connection.
+  ## The batches finish in any order, the result keeps the order of txids.
+  startFetchWorkers()
+  let workerNum = fetchThreads.len
+  let jobs = fetchJobs
+  let results = fetchResults
+
+  var pos = 0
+  var inflight = 0
+  var err = ""
+  var batches: seq[seq[FetchedTx]]
+  while pos < txids.len or inflight > 0:
+    while pos < txids.len and inflight < workerNum * 2 and err.len == 0:
+      let next = min(pos + fetchBatchSize, txids.len)
+      jobs[].send((batches.len, txids[pos..<next]))
+      batches.add(@[])
+      pos = next
+      inc(inflight)
+    if inflight == 0:
+      break
+    var ret = results[].recv()
+    dec(inflight)
+    if ret.err.len > 0:
+      err = ret.err
+      continue
+    adjustBatchSize(ret.elapsed)
+    batches[ret.idx] = move ret.txs
+  if err.len > 0:
+    raise newException(MempoolError, err)
+  for batch in batches.mitems:
+    for t in batch.mitems:
+      if t.tx.isNil:
+        info "INFO: mempool[", poolId, "] getRawTransaction null txid=", t.txid
+      result.add(move t)
+
 proc reset*() =
-  withWriteLock kvLock:
+  withKVWriteLock(poolId):
     kvAddrSpents.clear()
     kvAddrTxouts.clear()
     kvTxAddrs.clear()
     kvTxTxouts.clear()
     kvTxSpents.clear()
     kvUnconfs.clear()
-  txsTable.clear()
-
-proc update*(reset: bool) =
-  if reset:
-    reset()
-
-  var mpool = rpc.getRawMemPool.send()
-  var mResult = mpool["result"]
-  if mResult.len > 0:
-    var txids: seq[string]
-    var rpcCmds: RpcCommands
-    for tx in mResult:
-      let txid = tx.getStr
-      if not txsTable.hasKey(txid):
-        txids.add(txid)
-        rpcCmds.add(getRawTransaction.setParams(txid))
-        if txids.len >= MAX_TXS_GET_ONCE:
-          break
-    if txids.len == 0: return
+    txFees.clear()
+    feeHist[].reset()
+  txStore.clear()
+  outpoints.clear()
+  pendingIns.clear()
+
+proc evictTx(txid: Hash) =
+  ## Removes a tx that left the node mempool, confirmed or conflicted, and
+  ## takes its values back from the unconfirmed balances. Call with the write lock.
+  let txidBytes = txid.toBytes
+  let txidObj = cast[ptr HashObj](unsafeAddr txidBytes[0])[]
+  let tx = parsedTx(txid)
+  if not tx.isNil:
+    txidObj.delOutpoints(tx)
+  txidObj.delFee()
+  block:
+    var txouts: seq[Hash160Obj]
+    for txout in kvTxTxouts.items(txidBytes):
+      txouts.add(txout.val.address_hash)
+    for address_hash in txouts.deduplicate:
+      kvAddrTxouts.del(address_hash, proc (x: MempoolAddrTxout): bool = x.txid == txidObj)
+
+    var spents: seq[Hash160Obj]
+    for spent in kvTxSpents.items(txidBytes):
+      spents.add(spent.val.address_hash)
+    for address_hash in spents.deduplicate:
+      kvAddrSpents.del(address_hash, proc (x: MempoolAddrSpent): bool = x.txid_out == txidObj)
+
+    for txaddr in kvTxAddrs.items(txidBytes):
+      let k = (txaddr.val.address_hash.toBytes.Hash160, txaddr.val.address_type).toBytes
+      let uc = kvUnconfs[k]
+      if uc.isNil:
+        continue
+      if txaddr.val.trans == 0:
+        uc.value_out = uc.value_out - min(uc.value_out, txaddr.val.value)
+      else:
+        uc.value_in = uc.value_in - min(uc.value_in, txaddr.val.value)
+      if uc.value_out == 0 and uc.value_in == 0:
+        kvUnconfs.del(k)
+
+    kvTxAddrs.del(txidBytes)
+    kvTxTxouts.del(txidBytes)
+    kvTxSpents.del(txidBytes)
+
+proc evictConflicted(txid: HashObj, by: HashObj) =
+  ## Evicts a tx replaced by the new tx and all its descendants, which spend
+  ## outputs that no longer exist. Call with the write lock.
+  var queue = @[txid]
+  while queue.len > 0:
+    let t = queue.pop()
+    if not txStore.contains(t):
+      continue
+    let tx = parsedTx(Hash(@t))
+    for n in 0..<tx.outs.len:
+      let child = outpoints.getOrDefault((t, n.uint32))
+      if child != HashObj.default and child notin queue:
+        queue.add(child)
+    var addrs: seq[tuple[hash160: Hash160, addressType: AddressType]]
+    for txaddr in kvTxAddrs.items(t.toBytes):
+      let a = (txaddr.val.address_hash.toBytes.Hash160, txaddr.val.address_type)
+      if a notin addrs:
+        addrs.add(a)
+    info "INFO: mempool[", poolId, "] conflicted ", t, " by ", by
+    conflicts.add((Hash(@t), Hash(@by), addrs))
+    evictTx(Hash(@t))
+    txStore.del(t)
+
+proc takeConflicts*(): seq[MempoolConflict] =
+  ## Txs evicted as conflicted since the last call, for the stream notifications.
+  result = move(conflicts)
+  conflicts = @[]
+
+proc evict(txids: seq[HashObj]) =
+  ## Same slices as addTxs, the readers get the lock between them.
+  for i in countup(0, txids.high, MEMPOOL_LOCK_TXS):
+    withKVWriteLock(poolId):
+      for txid in txids.toOpenArray(i, min(i + MEMPOOL_LOCK_TXS, txids.len) - 1):
+        evictTx(Hash(@txid))
+
+proc addPendingFee(txid: HashObj) =
+  ## Records the fee of a tx once the spends of all its inputs are known, for
+  ## the txs whose last input was resolved after the tx was added.
+  let tx = parsedTx(Hash(@txid))
+  if tx.isNil:
+    return
+  var spentCount = 0
+  var valueIn, valueOut: uint64
+  for spent in kvTxSpents.items(txid.toBytes):
+    inc(spentCount)
+    valueIn = valueIn + spent.val.value
+  if spentCount != tx.ins.len:
+    return
+  for txout in tx.outs:
+    valueOut = valueOut + txout.value
+  if valueIn >= valueOut:
+    let loc = txStore.index.getOrDefault(txid)
+    txid.addFee(valueIn - valueOut, tx.vsize(loc.size))
+
+proc addPendingSpents(parent: HashObj) =
+  ## Adds the spends of the txs that arrived before their parent tx, call with
+  ## the write lock after the txouts of the parent are added.
+  var children: seq[tuple[txid: HashObj, n: uint32]]
+  if not pendingIns.pop(parent, children):
+    return
+  let parentBytes = parent.toBytes
+  let parentHash = Hash(parentBytes)
+  var txouts: seq[tuple[key: seq[byte], val: MempoolTxTxout]]
+  for txout in kvTxTxouts.items(parentBytes):
+    txouts.add(txout)
+  for child in children:
+    if not txStore.contains(child.txid):
+      continue
+    let txid = Hash(@(child.txid))
+    let txidBytes = child.txid.toBytes
+    for txout in txouts:
+      if txout.val.n != child.n:
+        continue
+      let address_hash = txout.val.address_hash.toBytes.Hash160
+      let address_type = txout.val.address_type
+      let value = txout.val.value
+      info "INFO: mempool spent pending " & $parentHash & " " & $child.n
+      kvAddrSpents.add(address_hash.toBytes, newMempoolAddrSpent(address_type, parentHash, child.n, value, txid))
+      kvTxSpents.add(txidBytes, newMempoolTxSpent(parentHash, child.n, value, address_hash, address_type))
+      kvTxAddrs.add(txidBytes, newMempoolTxAddr(address_hash, address_type, 0'u8, value))
+      let k = (address_hash, address_type).toBytes
+      let uc = kvUnconfs[k]
+      if uc.isNil:
+        kvUnconfs[k] = newMempoolUnconf(value, 0)
+      else:
+        uc.value_out = uc.value_out + value
+      addPendingFee(child.txid)
+      break
+
+proc dropPendingSpents() =
+  ## Forgets the pending spends of txs that left the mempool.
+  var parents: seq[HashObj]
+  for parent, children in pendingIns.mpairs:
+    children.keepItIf(txStore.contains(it.txid))
+    if children.len == 0:
+      parents.add(parent)
+  for parent in parents:
+    pendingIns.del(parent)
 
-    var rpcResults = rpcCmds.send()
-    if txids.len != rpcResults.len:
-      raise newException(MempoolError, "rpc failed")
-    var txNews: seq[tuple[txid: Hash, tx: Tx]]
-    for i, txid in txids:
-      let rpcResult = rpcResults[i]["result"]
-      if rpcResult.kind != JString:
-        info "INFO: mempool[", poolId, "] getRawTransaction null txid=", txid, " ", rpcResult
+type
+  TxinPrevKind {.pure.} = enum
+    Mempool
+    Db
+    Skip
+
+  TxinPrev = tuple[kind: TxinPrevKind, value: uint64, address_hash: Hash160, address_type: AddressType]
+
+proc addTxs(txNews: seq[tuple[txid: Hash, tx: Tx]], resolved: Table[OutpointKey, TxinPrev]) =
+  ## Resolves the spent txouts from the db first, then applies the batch to the
+  ## KV tables with a single write lock. Only this thread writes the tables of
+  ## its network, so its own reads need no lock.
+  var prevs = newSeq[seq[TxinPrev]](txNews.len)
+  var replaced: seq[tuple[txid: HashObj, by: HashObj]]
+  for i, txNew in txNews:
+    let (txid, tx) = txNew
+    let txidObj = txid.toHashObj
+    for txin in tx.ins:
+      let spender = outpoints.getOrDefault((txin.tx.toHashObj, txin.n))
+      if spender != HashObj.default and spender != txidObj:
+        replaced.add((spender, txidObj))
+
+      let key = (txin.tx.toHashObj, txin.n)
+      if resolved.hasKey(key):
+        prevs[i].add(resolved[key])
         continue
-      let tx = rpcResult.getStr.Hex.toBytes.toTx
-      txsTable[txid] = tx
-      txNews.add((txid.Hex.toHash, tx))
-      debug "mempool[", poolId, "] txid=", txid
-    if txNews.len == 0: return
+      var prev: TxinPrev
+      let retTx = dbInst.getTx(txin.tx)
+      if retTx.err == DbStatus.Success:
+        if retTx.res.skip == 1:
+          info "INFO: mempool skip tx " & $txin.tx
+          prev.kind = TxinPrevKind.Skip
+        else:
+          let retTxout = dbInst.getTxout(retTx.res.id, txin.n)
+          if retTxout.err == DbStatus.Success:
+            let (value, address_hash, address_type) = retTxout.res
+            prev = (TxinPrevKind.Db, value, address_hash.toFixedHash160, address_type.AddressType)
+      else:
+        info "INFO: tx not found " & $txin.tx & " in " & $txid
+      prevs[i].add(prev)
 
-    var txsAddrSendTable = initTable[seq[byte], TableRef[seq[byte], uint64]]()
-    var txsAddrRecvTable = initTable[seq[byte], TableRef[seq[byte], uint64]]()
+  var txsAddrSendTable = initTable[seq[byte], TableRef[seq[byte], uint64]]()
+  var txsAddrRecvTable = initTable[seq[byte], TableRef[seq[byte], uint64]]()
+
+  withKVWriteLock(poolId):
+    for r in replaced:
+      evictConflicted(r.txid, r.by)
+    for txNew in txNews:
+      txNew.txid.toHashObj.addOutpoints(txNew.tx)
 
     for txNew in txNews:
       var addrsRecvTable = newTable[seq[byte], uint64]()
@@ -360,12 +1023,10 @@ proc update*(reset: bool) =
           addrHashFixed = addrHash.hash160
         let mpTxTxout = newMempoolTxTxout(n.uint32, txout.value, addrHashFixed,
                                           addrHash.addressType)
-        withWriteLock kvLock:
-          kvTxTxouts.add(txid.toBytes, mpTxTxout)
+        kvTxTxouts.add(txid.toBytes, mpTxTxout)
 
         let mpAddrTxout = newMempoolAddrTxout(addrHash.addressType, txid, n.uint32, txout.value)
-        withWriteLock kvLock:
-          kvAddrTxouts.add(addrHashFixed.toBytes, mpAddrTxout)
+        kvAddrTxouts.add(addrHashFixed.toBytes, mpAddrTxout)
 
         let addrkey = (addrHashFixed, addrHash.addressType).toBytes
         if addrsRecvTable.hasKey(addrkey):
@@ -376,62 +1037,47 @@ proc update*(reset: bool) =
       txsAddrRecvTable[txid.toBytes] = addrsRecvTable
 
     for txNew in txNews:
+      addPendingSpents(txNew.txid.toHashObj)
+
+    for i, txNew in txNews:
       var addrsSendTable = newTable[seq[byte], uint64]()
       let (txid, tx) = txNew
       let txidBytes = txid.toBytes
-      for txin in tx.ins:
-        let retTx = dbInst.getTx(txin.tx)
-        if retTx.err == DbStatus.Success:
-          if retTx.res.skip == 1:
-            info "INFO: mempool skip tx " & $txin.tx
-            continue
-          let retTxout = dbInst.getTxout(retTx.res.id, txin.n)
-          if retTxout.err == DbStatus.Success:
-            let (value, address_hash, address_type) = retTxout.res
-            let address_hash_fixed = address_hash.toFixedHash160
-            let mpAddrSpent = newMempoolAddrSpent(address_type.AddressType, txin.tx, txin.n, value, txid)
-            let mpTxSpent = newMempoolTxSpent(txin.tx, txin.n, value, address_hash_fixed,
-                                              address_type.AddressType)
-            withWriteLock kvLock:
-              kvAddrSpents.add(address_hash_fixed.toBytes, mpAddrSpent)
-              kvTxSpents.add(txidBytes, mpTxSpent)
-
-            let addrkey = (address_hash_fixed, address_type).toBytes
-            if addrsSendTable.hasKey(addrkey):
-              addrsSendTable[addrkey] = addrsSendTable[addrkey] + value
-            else:
-              addrsSendTable[addrkey] = value
-            continue
-        else:
-          info "INFO: tx not found " & $txin.tx & " in " & $txid
+      var resolvedIns = 0
+      for j, txin in tx.ins:
+        let prev = prevs[i][j]
+        if prev.kind == TxinPrevKind.Skip:
+          continue
+        if prev.kind == TxinPrevKind.Db:
+          inc(resolvedIns)
+          let mpAddrSpent = newMempoolAddrSpent(prev.address_type, txin.tx, txin.n, prev.value, txid)
+          let mpTxSpent = newMempoolTxSpent(txin.tx, txin.n, prev.value, prev.address_hash,
+                                            prev.address_type)
+          kvAddrSpents.add(prev.address_hash.toBytes, mpAddrSpent)
+          kvTxSpents.add(txidBytes, mpTxSpent)
+
+          let addrkey = (prev.address_hash, prev.address_type).toBytes
+          if addrsSendTable.hasKey(addrkey):
+            addrsSendTable[addrkey] = addrsSendTable[addrkey] + prev.value
+          else:
+            addrsSendTable[addrkey] = prev.value
+          continue
 
         var findTxout = false
         var txouts: seq[tuple[key: seq[byte], val: MempoolTxTxout]]
-        withReadLock kvLock:
-          for txout in kvTxTxouts.items(txin.tx.toBytes):
-            if txout.val.n == txin.n:
-              txouts.add(txout)
+        for txout in kvTxTxouts.items(txin.tx.toBytes):
+          if txout.val.n == txin.n:
+            txouts.add(txout)
 
         for txout in txouts:
           if txout.val.n == txin.n:
-            var doubleSpending = false
-
-            withReadLock kvLock:
-              for s in kvAddrSpents.items(txout.key):
-                if s.val.n == txin.n:
-                  doubleSpending = true
-                  break
-              if doubleSpending:
-                info "INFO: mempool double spending " & $txin.tx & " " & $txin.n
-              else:
-                info "INFO: mempool spent " & $txin.tx & " " & $txin.n
+            info "INFO: mempool spent " & $txin.tx & " " & $txin.n
 
             let mpAddrSpent = newMempoolAddrSpent(txout.val.address_type, txin.tx, txin.n, txout.val.value, txid)
             let mpTxSpent = newMempoolTxSpent(txin.tx, txin.n, txout.val.value,
                                               txout.val.address_hash.toBytes.Hash160, txout.val.address_type)
-            withWriteLock kvLock:
-              kvAddrSpents.add(txout.key, mpAddrSpent)
-              kvTxSpents.add(txidBytes, mpTxSpent)
+            kvAddrSpents.add(txout.key, mpAddrSpent)
+            kvTxSpents.add(txidBytes, mpTxSpent)
 
             let addrkey = (txout.val.address_hash, txout.val.address_type).toBytes
             if addrsSendTable.hasKey(addrkey):
@@ -440,10 +1086,24 @@ proc update*(reset: bool) =
               addrsSendTable[addrkey] = txout.val.value
 
             findTxout = true
+            inc(resolvedIns)
             break
 
         if not findTxout:
-          error "ERROR: mempool txout not found " & $txin.tx & " " & $txin.n
+          # the parent may be fetched later, its spend is added with it
+          info "INFO: mempool txout pending " & $txin.tx & " " & $txin.n
+          pendingIns.mgetOrPut(txin.tx.toHashObj, @[]).add((txid.toHashObj, txin.n))
+
+      if resolvedIns == tx.ins.len:
+        var valueIn, valueOut: uint64
+        for v in addrsSendTable.values:
+          valueIn = valueIn + v
+        for txout in tx.outs:
+          valueOut = valueOut + txout.value
+        if valueIn >= valueOut:
+          let txidObj = txid.toHashObj
+          let loc = txStore.index.getOrDefault(txidObj)
+          txidObj.addFee(valueIn - valueOut, tx.vsize(loc.size))
 
       txsAddrSendTable[txid.toBytes] = addrsSendTable
 
@@ -455,31 +1115,244 @@ proc update*(reset: bool) =
         let address_hash = k[0..19].Hash160
         let address_type = k[20].AddressType
         let mpTxAddr = newMempoolTxAddr(address_hash, address_type, 0'u8, v)
-        withWriteLock kvLock:
-          kvTxAddrs.add(txidBytes, mpTxAddr)
-          if kvUnconfs[k].isNil:
-            kvUnconfs[k] = newMempoolUnconf(v, 0)
-          else:
-            let uc = kvUnconfs[k]
-            kvUnconfs[k] = newMempoolUnconf(uc.value_out + v, uc.value_in)
+        kvTxAddrs.add(txidBytes, mpTxAddr)
+        let uc = kvUnconfs[k]
+        if uc.isNil:
+          kvUnconfs[k] = newMempoolUnconf(v, 0)
+        else:
+          uc.value_out = uc.value_out + v
 
       let addrsRecvTable = txsAddrRecvTable[txidBytes]
       for k, v in addrsRecvTable.pairs:
         let address_hash = k[0..19].Hash160
         let address_type = k[20].AddressType
         let mpTxAddr = newMempoolTxAddr(address_hash, address_type, 1'u8, v)
-        withWriteLock kvLock:
-          kvTxAddrs.add(txidBytes, mpTxAddr)
-          if kvUnconfs[k].isNil:
-            kvUnconfs[k] = newMempoolUnconf(0, v)
-          else:
-            let uc = kvUnconfs[k]
-            kvUnconfs[k] = newMempoolUnconf(uc.value_out, uc.value_in + v)
+        kvTxAddrs.add(txidBytes, mpTxAddr)
+        let uc = kvUnconfs[k]
+        if uc.isNil:
+          kvUnconfs[k] = newMempoolUnconf(0, v)
+        else:
+          uc.value_in = uc.value_in + v
+
+proc addTxs(txNews: seq[tuple[txid: Hash, tx: Tx]]) {.inline.} =
+  addTxs(txNews, initTable[OutpointKey, TxinPrev]())
+
+proc save*(file: string) =
+  ## Snapshot of the raw txs with their resolved spent txouts. The unconf totals
+  ## are not stored, load rebuilds them from the txs still in the node mempool.
+  var data = (MEMPOOL_SNAPSHOT_MAGIC, MEMPOOL_SNAPSHOT_VERSION, txStore.len.uint32).toBytes
+  for txid, loc in txStore.index:
+    data.add(txid.toBytes)
+    data.add(loc.size.uint32.toBytes)
+    data.add(txStore.arena[loc.pos..<loc.pos + loc.size])
+    var spents: seq[MempoolTxSpentObj]
+    for spent in kvTxSpents.items(txid.toBytes):
+      spents.add(spent.val[])
+    data.add(spents.len.uint32.toBytes)
+    for spent in spents:
+      data.add((spent.txid, spent.n, spent.value, spent.address_hash, spent.address_type.uint8).toBytes)
+  let tmpFile = file & ".tmp"
+  writeFile(tmpFile, data)
+  moveFile(tmpFile, file)
+
+proc load*(file: string): int =
+  ## Restores the txs of the snapshot that are still in the node mempool without
+  ## rpc or db lookups, update then fetches only the difference.
+  if not fileExists(file):
+    return 0
+  var data = readFile(file).toBytes
+  const spentSize = sizeof(HashObj) + 4 + 8 + sizeof(Hash160Obj) + 1
+  var pos = 0
+  template check(size: int) =
+    if pos + size > data.len:
+      raise newException(MempoolError, "invalid snapshot " & file)
+  check(12)
+  if data[0].toUint32 != MEMPOOL_SNAPSHOT_MAGIC or data[4].toUint32 != MEMPOOL_SNAPSHOT_VERSION:
+    raise newException(MempoolError, "unknown snapshot " & file)
+  let count = data[8].toUint32.int
+  pos = 12
+
+  var mpoolTxids = initTable[HashObj, bool]()
+  for tx in rpc.getRawMemPool.send()["result"]:
+    mpoolTxids[tx.getStr.Hex.toHash.toHashObj] = true
+
+  var txNews: seq[tuple[txid: Hash, tx: Tx]]
+  var raws: seq[seq[byte]]
+  var resolved = initTable[OutpointKey, TxinPrev]()
+  for _ in 0..<count:
+    check(sizeof(HashObj) + 4)
+    let txid = data[pos].to(HashObj)
+    let size = data[pos + sizeof(HashObj)].toUint32.int
+    pos = pos + sizeof(HashObj) + 4
+    check(size + 4)
+    let raw = data[pos..<pos + size]
+    pos = pos + size
+    let spentCount = data[pos].toUint32.int
+    pos = pos + 4
+    check(spentCount * spentSize)
+    let keep = mpoolTxids.hasKey(txid)
+    for i in 0..<spentCount:
+      if keep:
+        let spentTxid = data[pos].to(HashObj)
+        let n = data[pos + 32].toUint32
+        let value = data[pos + 36].toUint64
+        let address_hash = Hash160(data[pos + 44..<pos + 64])
+        let address_type = data[pos + 64].AddressType
+        resolved[(spentTxid, n)] = (TxinPrevKind.Db, value, address_hash, address_type)
+      pos = pos + spentSize
+    if keep:
+      txNews.add((Hash(@txid), raw.toTx))
+      raws.add(raw)
+
+  try:
+    for i in countup(0, txNews.high, MEMPOOL_LOCK_TXS):
+      let last = min(i + MEMPOOL_LOCK_TXS, txNews.len) - 1
+      for j in i..last:
+        txStore.add(txNews[j].txid.toHashObj, raws[j])
+      addTxs(txNews[i..last], resolved)
+  except:
+    # txs in the store are skipped by update, drop the partial snapshot so
+    # they are fetched again
+    reset()
+    raise
+  result = txNews.len
+
+proc push*(poolId: int, txid: Hash, data: seq[byte]) =
+  ## Hands a tx accepted by the node to the mempool thread of the network, it
+  ## is added without waiting for the next update. Dropped while the network is
+  ## still syncing, the next update fetches it from the node mempool.
+  if not atomicLoadN(addr kvs[poolId].pushActive, ATOMIC_ACQUIRE):
+    return
+  pushChannels[poolId].send((txid.toHashObj, data))
+
+proc addPushed(): bool =
+  var txNews: seq[tuple[txid: Hash, tx: Tx]]
+  while true:
+    let ret = pushChannels[poolId].tryRecv()
+    if not ret.dataAvailable:
+      break
+    let (txid, data) = ret.msg
+    if txStore.contains(txid):
+      continue
+    var tx: Tx
+    try:
+      tx = data.toTx
+    except:
+      info "INFO: mempool[", poolId, "] invalid pushed tx ", txid, " ", getCurrentExceptionMsg()
+      continue
+    txStore.add(txid, data)
+    txNews.add((Hash(@txid), tx))
+  if txNews.len == 0:
+    return false
+  addTxs(txNews)
+  for txNew in txNews:
+    var addrs: seq[tuple[hash160: Hash160, addressType: AddressType]]
+    for txaddr in kvTxAddrs.items(txNew.txid.toBytes):
+      let a = (txaddr.val.address_hash.toBytes.Hash160, txaddr.val.address_type)
+      if a notin addrs:
+        addrs.add(a)
+    pushed.add((txNew.txid, addrs))
+  result = true
+
+proc wait*(ms: int): bool =
+  ## Sleeps up to ms, returns early with true once broadcast txs are added.
+  var remain = ms
+  while remain > 0:
+    if addPushed():
+      return true
+    let t = min(remain, MEMPOOL_PUSH_POLL_MS)
+    sleep(t)
+    remain = remain - t
+
+proc takePushed*(): seq[MempoolPushed] =
+  ## Broadcast txs added since the last call, for the stream notifications.
+  result = move(pushed)
+  pushed = @[]
+
+proc update*(blockNew: bool): bool {.discardable.} =
+  ## Returns true while the node mempool still has a backlog to fetch, the
+  ## caller should then call again without waiting.
+  var mpool = rpc.getRawMemPool.send()
+  var mResult = mpool["result"]
+  if mResult.kind != JArray:
+    # rpc error, an empty list would evict the whole mempool
+    info "INFO: mempool[", poolId, "] getRawMemPool failed ", mpool
+    return
+
+  var mpoolTxids = initTable[HashObj, bool]()
+  for tx in mResult:
+    mpoolTxids[tx.getStr.Hex.toHash.toHashObj] = true
+
+  block fetch:
+    var txids: seq[string]
+    for tx in mResult:
+      let txid = tx.getStr
+      if not txStore.contains(txid.Hex.toHash.toHashObj):
+        txids.add(txid)
+    if txids.len == 0: break fetch
+
+    var fetched: seq[FetchedTx]
+    if txids.len > MAX_TXS_GET_ONCE:
+      # catch-up, the rest of the backlog is fetched by the next call without the sleep
+      let backlog = txids.len
+      result = backlog > MEMPOOL_CATCHUP_TXS
+      if result:
+        txids.setLen(MEMPOOL_CATCHUP_TXS)
+      info "INFO: mempool[", poolId, "] catch-up txs=", txids.len, "/", backlog, " batch=", fetchBatchSize
+      fetched = fetchBacklog(txids)
+    else:
+      var rpcCmds: RpcCommands
+      for txid in txids:
+        rpcCmds.add(getRawTransaction.setParams(txid))
+      var rpcResults = rpcCmds.send()
+      if txids.len != rpcResults.len:
+        raise newException(MempoolError, "rpc failed")
+      for i, txid in txids:
+        let rpcResult = rpcResults[i]["result"]
+        if rpcResult.kind != JString:
+          info "INFO: mempool[", poolId, "] getRawTransaction null txid=", txid, " ", rpcResult
+          fetched.add((txid, newSeq[byte](), Tx(nil)))
+        else:
+          let data = rpcResult.getStr.Hex.toBytes
+          fetched.add((txid, data, data.toTx))
+
+    var txNews: seq[tuple[txid: Hash, tx: Tx]]
+    for f in fetched:
+      if f.tx.isNil:
+        continue
+      let txid = f.txid.Hex.toHash
+      txStore.add(txid.toHashObj, f.data)
+      txNews.add((txid, f.tx))
+      debug "mempool[", poolId, "] txid=", f.txid
+    if txNews.len == 0: break fetch
+
+    for i in countup(0, txNews.high, MEMPOOL_LOCK_TXS):
+      addTxs(txNews[i..min(i + MEMPOOL_LOCK_TXS, txNews.len) - 1])
 
     for txNew in txNews:
       let (txid, _) = txNew
       debug mempoolTx(poolId, txid, network)
 
+  # txs no longer in the node mempool, the rest is kept across blocks. The txs
+  # replaced by the new ones are already evicted as conflicted by addTxs.
+  var evicts: seq[HashObj]
+  for txid in txStore.index.keys:
+    if not mpoolTxids.hasKey(txid):
+      evicts.add(txid)
+  if evicts.len > 0:
+    evict(evicts)
+  for txid in evicts:
+    txStore.del(txid)
+  if evicts.len > 0 and pendingIns.len > 0:
+    dropPendingSpents()
+  if blockNew:
+    if evicts.len > 0:
+      info "INFO: mempool[", poolId, "] evict ", evicts.len, " txs=", txStore.len
+    info "INFO: mempool[", poolId, "] ", txStore.stats(), " outpoints=", outpoints.len
+    info "INFO: mempool[", poolId, "] ", lockStats(poolId)
+    info "INFO: mempool[", poolId, "] ", slabs.memStats()
+    info "INFO: rpc ", rpcLatencyStats()
+
 proc `%`*(obj: MempoolAddrSpentObj | MempoolAddrTxoutObj |
           MempoolTxAddrObj | MempoolTxTxoutObj | MempoolTxSpentObj): JsonNode =
   result = newJObject()
@@ -495,18 +1368,82 @@ proc `%`*(obj: MempoolAddrSpentObj | MempoolAddrTxoutObj |
 
 proc `%`*(o: HashObj): JsonNode = newJString($o)
 
+type
+  MempoolAddrTxoutItem* = tuple[txid: Hash, n: uint32, value: uint64]
+  MempoolAddrSpentItem* = tuple[txid: Hash, n: uint32, value: uint64, txid_out: Hash]
+
+  MempoolAddr* = object
+    value_out*: uint64  # pending spends from the address
+    value_in*: uint64   # pending receipts to the address
+    spents*: seq[MempoolAddrSpentItem]
+    txouts*: seq[MempoolAddrTxoutItem]
+
+proc getPending(kv: KVs, addrHash: Hash160, addrType: AddressType, outpoints: bool): MempoolAddr =
+  ## Lookups by the address key only, call with the read lock.
+  let addrHashFixed = addrHash.toFixedHash160
+  let uc = kv.kvUnconfs[(addrHashFixed, addrType).toBytes]
+  if uc.isNil:
+    return
+  result.value_out = uc.value_out
+  result.value_in = uc.value_in
+  if outpoints:
+    let addrkey = addrHashFixed.toBytes
+    for spent in kv.kvAddrSpents.items(addrkey):
+      if spent.val.address_type == addrType:
+        result.spents.add((Hash(@(spent.val.txid)), spent.val.n, spent.val.value, Hash(@(spent.val.txid_out))))
+    for txout in kv.kvAddrTxouts.items(addrkey):
+      if txout.val.address_type == addrType:
+        result.txouts.add((Hash(@(txout.val.txid)), txout.val.n, txout.val.value))
+
+proc pending*(poolId: int, addrHash: Hash160, addrType: AddressType, outpoints = false): MempoolAddr =
+  ## Pending values of an address, with its pending txouts and spents if outpoints.
+  let kv = kvs[poolId]
+  withKVReadLock(poolId):
+    result = kv.getPending(addrHash, addrType, outpoints)
+
+proc pending*(poolId: int, addrs: openArray[tuple[hash160: Hash160, addressType: AddressType]],
+              outpoints = false): seq[MempoolAddr] =
+  ## Batch of addresses under a single read lock.
+  let kv = kvs[poolId]
+  withKVReadLock(poolId):
+    for a in addrs:
+      result.add(kv.getPending(a.hash160, a.addressType, outpoints))
+
+proc feeEstimate*(poolId: int): JsonNode =
+  ## Fee rates from the histogram, for each target the lowest bucket that still
+  ## fits in the blocks when the mempool is mined from the highest fee rate.
+  var hist: FeeHistogram
+  withKVReadLock(poolId):
+    hist = kvs[poolId].feeHist[]
+  var jhist = newJArray()
+  for i, b in hist:
+    if b.count > 0:
+      jhist.add(%*{"min": FEE_BUCKETS[i], "count": b.count, "vsize": b.vsize})
+  var jtargets = newJArray()
+  for target in FEE_TARGETS:
+    let space = target * MEMPOOL_BLOCK_VSIZE
+    var total = 0
+    var rate = FEE_BUCKETS[1] # min relay fee
+    for i in countdown(hist.high, 0):
+      total = total + hist[i].vsize
+      if total > space:
+        rate = FEE_BUCKETS[min(i + 1, FEE_BUCKETS.high)]
+        break
+    jtargets.add(%*{"blocks": target, "feerate": rate})
+  result = %*{"targets": jtargets, "hist": jhist}
+
 proc unconfs*(poolId: int): JsonNode =
   let kvAddrSpents = kvs[poolId].kvAddrSpents
   let kvAddrTxouts = kvs[poolId].kvAddrTxouts
 
-  var spents: seq[tuple[key: seq[byte], val: MempoolAddrSpent]]
-  var txouts: seq[tuple[key: seq[byte], val: MempoolAddrTxout]]
+  var spents: seq[tuple[key: seq[byte], val: MempoolAddrSpentObj]]
+  var txouts: seq[tuple[key: seq[byte], val: MempoolAddrTxoutObj]]
 
-  withReadLock kvLock:
+  withKVReadLock(poolId):
     for addrSpent in kvAddrSpents.items:
-      spents.add(addrSpent)
+      spents.add((addrSpent.key, addrSpent.val[]))
     for addrTxout in kvAddrTxouts.items:
-      txouts.add(addrTxout)
+      txouts.add((addrTxout.key, addrTxout.val[]))
 
   var j = %*{"spents": {}, "txouts": {}}
   var jspents = j["spents"]
@@ -514,19 +1451,22 @@ proc unconfs*(poolId: int): JsonNode =
   for spent in spents:
     var addrHash = $spent.key
     if jspents.hasKey(addrHash):
-      jspents[addrHash].add(%spent.val[])
+      jspents[addrHash].add(%spent.val)
     else:
-      jspents[addrHash] = %[spent.val[]]
+      jspents[addrHash] = %[spent.val]
   for txout in txouts:
     var addrHash = $txout.key
     if jtxouts.hasKey(addrHash):
-      jtxouts[addrHash].add(%txout.val[])
+      jtxouts[addrHash].add(%txout.val)
     else:
-      jtxouts[addrHash] = %[txout.val[]]
+      jtxouts[addrHash] = %[txout.val]
   result = j
 
-proc unconfs*(poolId: int, addrHash: Hash160, addrType: AddressType): MempoolUnconf =
+proc unconfs*(poolId: int, addrHash: Hash160, addrType: AddressType): MempoolUnconfObj =
+  ## Returns a copy, the entry may be replaced by the updater after the unlock.
   let kvUnconfs = kvs[poolId].kvUnconfs
   let addrkey = (addrHash.toFixedHash160, addrType).toBytes
-  withReadLock kvLock:
-    result = kvUnconfs[addrkey]
+  withKVReadLock(poolId):
+    let uc = kvUnconfs[addrkey]
+    if not uc.isNil:
+      result = uc[]
@@ -85,6 +85,77 @@ proc `=sink`*[T](a: var Queue[T]; b: Queue[T]) =
   a.buf = b.buf
 
 
+type
+  MpmcCell[T] = object
+    sequence: int
+    data: T
+
+  MpmcQueue*[T] = object
+    ## Bounded lock-free queue for multiple producers and consumers.
+    ## T should be a ptr or a plain object, the cells are not traced.
+    buf: ptr UncheckedArray[MpmcCell[T]]
+    mask: int
+    pad0: array[64, byte]
+    enqueuePos: int
+    pad1: array[64, byte]
+    dequeuePos: int
+    pad2: array[64, byte]
+
+proc init*[T](queue: var MpmcQueue[T], size: int) =
+  if size < 2 or (size and (size - 1)) != 0:
+    raise newException(QueueError, "size must be a power of two")
+  queue.buf = cast[ptr UncheckedArray[MpmcCell[T]]](allocShared0(sizeof(MpmcCell[T]) * size))
+  for i in 0..<size:
+    queue.buf[i].sequence = i
+  queue.mask = size - 1
+  queue.enqueuePos = 0
+  queue.dequeuePos = 0
+
+proc deinit*[T](queue: var MpmcQueue[T]) =
+  if not queue.buf.isNil:
+    queue.buf.deallocShared()
+    queue.buf = nil
+
+proc add*[T](queue: var MpmcQueue[T], data: T): bool =
+  ## Returns false if the queue is full.
+  var pos = atomicLoadN(addr queue.enqueuePos, ATOMIC_RELAXED)
+  while true:
+    let cell = addr queue.buf[pos and queue.mask]
+    let diff = atomicLoadN(addr cell.sequence, ATOMIC_ACQUIRE) - pos
+    if diff == 0:
+      if atomicCompareExchangeN(addr queue.enqueuePos, addr pos, pos + 1, true,
+                                ATOMIC_RELAXED, ATOMIC_RELAXED):
+        cell.data = data
+        atomicStoreN(addr cell.sequence, pos + 1, ATOMIC_RELEASE)
+        return true
+    elif diff < 0:
+      return false
+    else:
+      pos = atomicLoadN(addr queue.enqueuePos, ATOMIC_RELAXED)
+
+proc pop*[T](queue: var MpmcQueue[T], data: var T): bool =
+  ## Returns false if the queue is empty.
+  var pos = atomicLoadN(addr queue.dequeuePos, ATOMIC_RELAXED)
+  while true:
+    let cell = addr queue.buf[pos and queue.mask]
+    let diff = atomicLoadN(addr cell.sequence, ATOMIC_ACQUIRE) - (pos + 1)
+    if diff == 0:
+      if atomicCompareExchangeN(addr queue.dequeuePos, addr pos, pos + 1, true,
+                                ATOMIC_RELAXED, ATOMIC_RELAXED):
+        data = cell.data
+        atomicStoreN(addr cell.sequence, pos + queue.mask + 1, ATOMIC_RELEASE)
+        return true
+    elif diff < 0:
+      return false
+    else:
+      pos = atomicLoadN(addr queue.dequeuePos, ATOMIC_RELAXED)
+
+proc len*[T](queue: var MpmcQueue[T]): int =
+  ## Approximate while producers or consumers are running.
+  max(atomicLoadN(addr queue.enqueuePos, ATOMIC_RELAXED) -
+      atomicLoadN(addr queue.dequeuePos, ATOMIC_RELAXED), 0)
+
+
 when isMainModule:
   var queue: Queue[int]
 
@@ -110,3 +181,15 @@ when isMainModule:
     assert p == k; inc(k)
 
   queue.clear(); k = j
+
+  var mpmc: MpmcQueue[int]
+  mpmc.init(8)
+  for i in 0..<8:
+    assert mpmc.add(i)
+  assert not mpmc.add(8)
+  assert mpmc.len == 8
+  var d: int
+  for i in 0..<8:
+    assert mpmc.pop(d) and d == i
+  assert not mpmc.pop(d)
+  mpmc.deinit()
@@ -5,6 +5,9 @@ const USE_CURL = defined(USE_CURL)
 import std/strutils
 import std/locks
 import std/json
+import std/monotimes
+import std/times
+import std/sequtils
 
 when USE_CURL:
   import libcurl
@@ -27,9 +30,9 @@ else:
   template toString(s: seq[byte]): string = cast[string](s)
 
   proc toString(buf: ptr UncheckedArray[byte], size: SomeInteger): string =
-    result = newStringOfCap(size)
-    for i in 0..<size:
-      result.add(cast[char](buf[i]))
+    result = newString(size)
+    if size > 0:
+      copyMem(addr result[0], buf, size)
 
 type
   CoreCommand* = enum
@@ -120,6 +123,7 @@ type
   RpcCommand* = object
     id*: string
     data*: string
+    cmd*: CoreCommand
   RpcCommands* = seq[RpcCommand]
 
   RpcError* = object of CatchableError
@@ -132,25 +136,48 @@ var defaultRpcConfig {.threadvar.}: RpcConfig
 defaultRpcConfig = RpcConfig(rpcUrl: "http://127.0.0.1:9252/",
                             rpcUserPass: "rpcuser:rpcpassword")
 when not USE_CURL:
+  type
+    RpcConn = object
+      sock: SocketHandle
+      buf: seq[byte]  # received data of the next responses
+      requests: int   # requests completed on the connection
+
   var rpcHostname {.threadvar.}: string
   var rpcPort {.threadvar.}: Port
   var rpcAuthorization {.threadvar.}: string
   var rpcRecvBuf {.threadvar.}: seq[byte]
   var epfd {.threadvar.}: cint
+  # one keep-alive connection per thread, the resolved address is kept until a connect fails
+  var rpcConn {.threadvar.}: RpcConn
+  var rpcSockAddr {.threadvar.}: Sockaddr_storage
+  var rpcSockAddrLen {.threadvar.}: SockLen
 
   var rcvbufSock = createNativeSocket()
   var tcp_rmem = rcvbufSock.getSockOptInt(SOL_SOCKET, SO_RCVBUF)
   rcvbufSock.close()
 
+  proc rpcClose() =
+    if rpcConn.sock != osInvalidSocket and rpcConn.sock != 0.SocketHandle:
+      discard epoll_ctl(epfd, EPOLL_CTL_DEL, cast[cint](rpcConn.sock), nil)
+      rpcConn.sock.close()
+    rpcConn.sock = osInvalidSocket
+    rpcConn.buf.setLen(0)
+    rpcConn.requests = 0
+
 proc setRpcConfig*(rpcConfig: RpcConfig) =
   defaultRpcConfig = rpcConfig
   when not USE_CURL:
+    if epfd > 0:
+      rpcClose()
+      discard epfd.close()
     var m = RegexMatch2()
     if match(rpcConfig.rpcUrl, re2"\w+://([\w\._-]+):(\d+)/?", m):
       rpcHostname = rpcConfig.rpcUrl[m.group(0)]
       rpcPort = rpcConfig.rpcUrl[m.group(1)].parseInt.Port
     rpcAuthorization = base64.encode(rpcConfig.rpcUserPass)
     rpcRecvBuf = newSeq[byte](tcp_rmem)
+    rpcConn.sock = osInvalidSocket
+    rpcSockAddrLen = 0
     epfd = epoll_create1(O_CLOEXEC)
     if epfd < 0:
       raise newException(RpcError, "error: epfd=" & $epfd & " errno=" & $errno)
@@ -166,9 +193,17 @@ when USE_CURL:
     var headers: PSlist
     headers = slist_append(headers, "Content-Type: application/json")
 
-  proc httpPost(rpcConfig: RpcConfig, postData: string): tuple[code: Code, data: string] =
+  # the easy handle is kept per thread, libcurl reuses its keep-alive connection
+  var curl {.threadvar.}: Pcurl
+
+  proc httpPost(rpcConfig: RpcConfig, postData: string, retryRecv = true): tuple[code: Code, data: string] =
+    ## retryRecv is unused, libcurl does not resend a request after a
+    ## receive error.
     var outbuf: ref string = new string
-    let curl: Pcurl = easy_init()
+    if curl.isNil:
+      curl = easy_init()
+    else:
+      curl.easy_reset()
     # discard curl.easy_setopt(OPT_VERBOSE, 1)
     discard curl.easy_setopt(OPT_URL, rpcConfig.rpcUrl.cstring)
     discard curl.easy_setopt(OPT_POST, 1)
@@ -179,7 +214,6 @@ when USE_CURL:
     when ADD_POST_HEADER:
       discard curl.easy_setopt(OPT_HTTPHEADER, headers)
     let ret = curl.easy_perform()
-    curl.easy_cleanup()
     (ret, outbuf[])
 
 else:
@@ -225,50 +259,78 @@ else:
       else:
         inc(i)
 
-  proc httpPost(rpcConfig: RpcConfig, postData: string): tuple[code: Code, data: string] =
-    var sock = createNativeSocket()
-    defer:
-      sock.close()
+  proc rpcConnect(): Code =
+    if rpcSockAddrLen == 0:
+      var aiList: ptr AddrInfo
+      try:
+        aiList = getAddrInfo(rpcHostname, rpcPort, Domain.AF_INET)
+      except:
+        return E_COULDNT_RESOLVE_HOST
+      copyMem(addr rpcSockAddr, aiList.ai_addr, aiList.ai_addrlen.int)
+      rpcSockAddrLen = aiList.ai_addrlen.SockLen
+      freeaddrinfo(aiList)
 
+    var sock = createNativeSocket()
     sock.setSockOptInt(Protocol.IPPROTO_TCP.int, TCP_NODELAY, 1)
+    if sock.connect(cast[ptr SockAddr](addr rpcSockAddr), rpcSockAddrLen) != 0:
+      sock.close()
+      rpcSockAddrLen = 0
+      return E_COULDNT_CONNECT
 
-    var aiList: ptr AddrInfo
-    try:
-      aiList = getAddrInfo(rpcHostname, rpcPort, Domain.AF_INET)
-    except:
-      return (E_COULDNT_RESOLVE_HOST, "")
-
-    let retConnect = sock.connect(aiList.ai_addr, aiList.ai_addrlen.SockLen)
-    freeaddrinfo(aiList)
-    if retConnect != 0:
-      return (E_COULDNT_CONNECT, "")
-
-    var data = "POST / HTTP/1.1\c\L" &
-      "Authorization: Basic " & rpcAuthorization & "\c\L" &
-      "Content-Length: " & $postData.len & "\c\L" &
-      "\c\L" & postData
+    var ev: EpollEvent
+    ev.events = EPOLLIN or EPOLLRDHUP
+    let retCtl = epoll_ctl(epfd, EPOLL_CTL_ADD, cast[cint](sock), addr ev)
+    if retCtl < 0:
+      sock.close()
+      raise newException(RpcError, "error: epoll_ctl ADD ret=" & $retCtl & " errno=" & $errno)
+    rpcConn.sock = sock
+    rpcConn.buf.setLen(0)
+    rpcConn.requests = 0
+    E_OK
+
+  proc sendAll(sock: SocketHandle, data: string): int =
+    ## Returns the number of bytes written, less than data.len on error.
+    while result < data.len:
+      let sendRet = sock.send(unsafeAddr data[result], (data.len - result).cint, MSG_NOSIGNAL)
+      if sendRet < 0:
+        if errno == EINTR:
+          continue
+        return
+      result = result + sendRet
 
-    while true:
-      var sendRet = sock.send(addr data[0], data.len.cint, 0'i32)
-      if sendRet < 0 and errno == EINTR:
-        continue
-      break
+  proc connClosed(): bool =
+    ## Checks if the node closed the idle keep-alive connection.
+    var b: byte
+    let ret = rpcConn.sock.recv(addr b, 1, MSG_PEEK or MSG_DONTWAIT)
+    ret == 0 or (ret < 0 and errno != EAGAIN and errno != EWOULDBLOCK and errno != EINTR)
 
-    sock.setBlocking(false)
+  type
+    RpcBody = tuple[code: Code, pos: int, size: int]
 
-    var buf: seq[byte]
+  proc recvBody(): RpcBody =
+    ## Receives the next response. The body is left in the connection buffer
+    ## until consumeBody, large bodies are received in place.
     var code = 0
     var contentLength = 0
     var headerSize = 0
     var totalSize = 0
     var events: array[1, EpollEvent]
-    var ev: EpollEvent
-    ev.events = EPOLLIN or EPOLLRDHUP or EPOLLET
-    let retCtl = epoll_ctl(epfd, EPOLL_CTL_ADD, cast[cint](sock), addr ev)
-    if retCtl < 0:
-      raise newException(RpcError, "error: epoll_ctl ADD ret=" & $retCtl & " errno=" & $errno)
 
     while true:
+      if headerSize == 0 and rpcConn.buf.len > 0:
+        (code, contentLength, headerSize) = parseHeader(rpcConn.buf)
+        if headerSize > 0:
+          totalSize = headerSize + contentLength
+          if rpcConn.buf.len < totalSize:
+            var buf = newSeqOfCap[byte](totalSize)
+            buf.add(rpcConn.buf)
+            rpcConn.buf = move(buf)
+      if headerSize > 0 and rpcConn.buf.len >= totalSize:
+        when declared(RPC_HTTP_STATUS_CODE_CHECK):
+          if code != 200 and code != 0:
+            return (E_HTTP_RETURNED_ERROR, headerSize, contentLength)
+        return (E_OK, headerSize, contentLength)
+
       var waitCount = 0
       while true:
         var nfd = epoll_wait(epfd, cast[ptr EpollEvent](addr events), 1.cint, 3000.cint)
@@ -277,37 +339,94 @@ else:
         elif nfd == 0:
           inc(waitCount)
           if waitCount >= 10:
-            return (E_OPERATION_TIMEOUTED, "")
+            return (E_OPERATION_TIMEOUTED, 0, 0)
           continue
-        else:
+        elif errno != EINTR:
           raise newException(RpcError, "error: epoll_wait ret=" & $nfd & " errno=" & $errno)
 
       while true:
-        var recvLen = sock.recv(addr rpcRecvBuf[0], rpcRecvBuf.len, 0'i32)
-        if recvLen > 0:
-          buf = buf & rpcRecvBuf[0..<recvLen]
-          if recvLen < rpcRecvBuf.len:
+        var recvLen: int
+        if headerSize > 0:
+          let cur = rpcConn.buf.len
+          let size = totalSize - cur
+          rpcConn.buf.setLen(totalSize)
+          recvLen = rpcConn.sock.recv(addr rpcConn.buf[cur], size, MSG_DONTWAIT)
+          rpcConn.buf.setLen(cur + max(recvLen, 0))
+          if recvLen == size:
             break
+        else:
+          recvLen = rpcConn.sock.recv(addr rpcRecvBuf[0], rpcRecvBuf.len, MSG_DONTWAIT)
+          if recvLen > 0:
+            rpcConn.buf.add(rpcRecvBuf.toOpenArray(0, recvLen - 1))
+            if recvLen < rpcRecvBuf.len:
+              break
+        if recvLen > 0:
+          continue
         elif recvLen < 0:
           if errno == EAGAIN or errno == EWOULDBLOCK:
             break
           elif errno != EINTR:
-            return (E_RECV_ERROR, "")
+            return (E_RECV_ERROR, 0, 0)
         else:
-          return (E_RECV_ERROR, "")
+          return (E_RECV_ERROR, 0, 0)
+
+  proc consumeBody(body: RpcBody) =
+    let totalSize = body.pos + body.size
+    if rpcConn.buf.len == totalSize:
+      rpcConn.buf.setLen(0)
+    else:
+      rpcConn.buf = rpcConn.buf[totalSize..^1]
 
-      if headerSize == 0:
-        (code, contentLength, headerSize) = parseHeader(buf)
-        if headerSize == 0:
+  proc postData(data: string): string =
+    "POST / HTTP/1.1\c\L" &
+      "Authorization: Basic " & rpcAuthorization & "\c\L" &
+      "Content-Length: " & $data.len & "\c\L" &
+      "\c\L" & data
+
+  proc request(reqData: string, retryRecv: bool): RpcBody =
+    ## Single request on the keep-alive connection. A reused connection is
+    ## retried once on a new connection if nothing was written, and after a
+    ## receive error only if retryRecv, the node may have run the request.
+    let data = postData(reqData)
+    for retry in 0..1:
+      if rpcConn.sock != osInvalidSocket and rpcConn.requests > 0 and connClosed():
+        rpcClose()
+      if rpcConn.sock == osInvalidSocket:
+        let retConnect = rpcConnect()
+        if retConnect != E_OK:
+          return (retConnect, 0, 0)
+      let reused = rpcConn.requests > 0
+
+      let sent = rpcConn.sock.sendAll(data)
+      if sent < data.len:
+        rpcClose()
+        if reused and retry == 0 and (sent == 0 or retryRecv):
           continue
-        when declared(RPC_HTTP_STATUS_CODE_CHECK):
-          if code != 200 and code != 0:
-            return (E_HTTP_RETURNED_ERROR, buf[headerSize..^1].toString())
-        totalSize = contentLength + headerSize
-      if totalSize == buf.len:
-        return (E_OK, buf[headerSize..^1].toString())
-      elif totalSize < buf.len:
-        return (E_RECV_ERROR, "")
+        return (E_COULDNT_CONNECT, 0, 0)
+
+      result = recvBody()
+      if result.code != E_OK and result.code != E_HTTP_RETURNED_ERROR:
+        rpcClose()
+        if reused and retry == 0 and retryRecv and result.code == E_RECV_ERROR:
+          continue
+        return
+      inc(rpcConn.requests)
+      return
+
+  proc httpPost(rpcConfig: RpcConfig, postData: string, retryRecv = true): tuple[code: Code, data: string] =
+    let body = request(postData, retryRecv)
+    if body.code != E_OK and body.code != E_HTTP_RETURNED_ERROR:
+      return (body.code, "")
+    if body.size > 0:
+      result = (body.code, (cast[ptr UncheckedArray[byte]](addr rpcConn.buf[body.pos])).toString(body.size))
+    else:
+      result = (body.code, "")
+    body.consumeBody()
+
+  proc httpPostBody(rpcConfig: RpcConfig, reqData: string, retryRecv = true): RpcBody =
+    ## The caller reads the body from the connection buffer and calls
+    ## consumeBody.
+    request(reqData, retryRecv)
 
 proc filterAlphaNumeric(s: string): string =
   var check = true
@@ -333,6 +452,52 @@ proc getId(): string =
     id = rpcId
   result = "bs" & $id
 
+type
+  RpcLatency* = object
+    count*: uint64
+    errors*: uint64
+    totalUs*: uint64
+    maxUs*: uint64
+
+var rpcLatencies: array[CoreCommand, RpcLatency]
+var rpcLatencyLock: Lock
+initLock(rpcLatencyLock)
+
+proc addLatency(cmds: openArray[CoreCommand], start: MonoTime, err: bool) =
+  ## Requests sent together share the elapsed time.
+  let us = (getMonoTime() - start).inMicroseconds.uint64 div cmds.len.uint64
+  withLock rpcLatencyLock:
+    for cmd in cmds:
+      let l = addr rpcLatencies[cmd]
+      inc(l.count)
+      if err:
+        inc(l.errors)
+      l.totalUs = l.totalUs + us
+      if us > l.maxUs:
+        l.maxUs = us
+
+proc rpcLatency*(cmd: CoreCommand): RpcLatency =
+  withLock rpcLatencyLock:
+    result = rpcLatencies[cmd]
+
+proc rpcLatencyStats*(): string =
+  for cmd in CoreCommand:
+    let l = rpcLatency(cmd)
+    if l.count > 0:
+      if result.len > 0:
+        result.add(" ")
+      result.add($cmd & " n=" & $l.count & " avg=" & $(l.totalUs div l.count) & "us max=" &
+                $l.maxUs & "us err=" & $l.errors)
+
+const RPC_UNSAFE_RETRY = {addMultiSigAddress, addNode, backupWallet, dumpWallet, encryptWallet,
+                          generate, getAccountAddress, getNewAddress, getRawChangeAddress,
+                          importAddress, importPrivKey, importWallet, keypoolRefill, lockUnspent,
+                          move, prioritiseTransaction, sendFrom, sendMany, sendRawTransaction,
+                          sendToAddress, setAccount, setGenerate, setTxFee, stop, submitBlock,
+                          walletLock, walletPassphrase, walletPassphraseChange}
+
+proc retryRecv(cmd: CoreCommand): bool {.inline.} = cmd notin RPC_UNSAFE_RETRY
+
 proc setParams*(cmd: CoreCommand, args: varargs[string, wrapStr]): RpcCommand =
   var params: string
   for v in args:
@@ -341,13 +506,15 @@ proc setParams*(cmd: CoreCommand, args: varargs[string, wrapStr]): RpcCommand =
     params.add(v)
   var id = getId()
   if params.len > 0:
-    result = RpcCommand(id: id, data: "{\"id\":\"" & $id & "\",\"method\":\"" & $cmd & "\",\"params\":[" & $params & "]}")
+    result = RpcCommand(id: id, data: "{\"id\":\"" & $id & "\",\"method\":\"" & $cmd & "\",\"params\":[" & $params & "]}", cmd: cmd)
   else:
-    result = RpcCommand(id: id, data: "{\"id\":\"" & $id & "\",\"method\":\"" & $cmd & "\"}")
+    result = RpcCommand(id: id, data: "{\"id\":\"" & $id & "\",\"method\":\"" & $cmd & "\"}", cmd: cmd)
 
 proc send*(cmd: CoreCommand, rpcConfig: RpcConfig, args: varargs[string, wrapStr]): JsonNode =
   let rpcCmd = setParams(cmd, args)
-  let ret = httpPost(rpcConfig, rpcCmd.data)
+  let start = getMonoTime()
+  let ret = httpPost(rpcConfig, rpcCmd.data, cmd.retryRecv)
+  addLatency([cmd], start, ret.code != E_OK)
   if ret.code == E_OK:
     if ret.data.len == 0:
       raise newException(RpcError, "no data")
@@ -361,7 +528,9 @@ template send*(cmd: CoreCommand, args: varargs[string, wrapStr]): JsonNode =
   send(cmd, defaultRpcConfig, args)
 
 proc send*(rpcCmd: RpcCommand, rpcConfig: RpcConfig = defaultRpcConfig): JsonNode =
-  let ret = httpPost(rpcConfig, rpcCmd.data)
+  let start = getMonoTime()
+  let ret = httpPost(rpcConfig, rpcCmd.data, rpcCmd.cmd.retryRecv)
+  addLatency([rpcCmd.cmd], start, ret.code != E_OK)
   if ret.code == E_OK:
     if ret.data.len == 0:
       raise newException(RpcError, "no data")
@@ -380,7 +549,10 @@ proc send*(rpcCmds: RpcCommands, rpcConfig: RpcConfig = defaultRpcConfig): JsonN
     cmds.add(x.data)
     ids.add(x.id)
   cmds = "[" & cmds & "]"
-  let ret = httpPost(rpcConfig, cmds)
+  let start = getMonoTime()
+  let ret = httpPost(rpcConfig, cmds, rpcCmds.allIt(it.cmd.retryRecv))
+  if rpcCmds.len > 0:
+    addLatency(rpcCmds.mapIt(it.cmd), start, ret.code != E_OK)
   if ret.code == E_OK:
     if ret.data.len == 0:
       raise newException(RpcError, "no data")
@@ -396,6 +568,96 @@ proc send*(rpcCmds: RpcCommands, rpcConfig: RpcConfig = defaultRpcConfig): JsonN
   else:
     raise newException(RpcError, $ret.code)
 
+const hexTable = block:
+  var t: array[256, uint8]
+  for i in 0..255:
+    t[i] = 0xff'u8
+  for i, c in "0123456789":
+    t[c.int] = i.uint8
+  for i, c in "abcdef":
+    t[c.int] = i.uint8 + 10
+  for i, c in "ABCDEF":
+    t[c.int] = i.uint8 + 10
+  t
+
+proc hexDecode(src: ptr UncheckedArray[byte], dst: ptr UncheckedArray[byte], dstLen: int): bool =
+  ## Branchless, invalid chars set the high bits of err.
+  var err = 0'u8
+  for i in 0..<dstLen:
+    let h = hexTable[src[i * 2]]
+    let l = hexTable[src[i * 2 + 1]]
+    err = err or h or l
+    dst[i] = (h shl 4) or l
+  (err and 0xf0'u8) == 0
+
+proc c_memchr(s: pointer, c: cint, n: csize_t): pointer {.importc: "memchr", header: "<string.h>".}
+
+proc rawResult(data: ptr UncheckedArray[byte], size: int, id: string, output: var seq[byte]): bool =
+  const resultKey = "\"result\":"
+  var pos = -1
+  for i in 0..size - resultKey.len:
+    if equalMem(addr data[i], resultKey.cstring, resultKey.len):
+      pos = i + resultKey.len
+      break
+  if pos < 0:
+    raise newException(RpcError, "no result")
+  while pos < size and data[pos] == ' '.byte:
+    inc(pos)
+  if pos >= size or data[pos] != '"'.byte:
+    return false
+  inc(pos)
+  let endp = c_memchr(addr data[pos], '"'.cint, (size - pos).csize_t)
+  if endp.isNil:
+    raise newException(RpcError, "invalid result")
+  let hexLen = cast[int](endp) - cast[int](addr data[pos])
+  if hexLen mod 2 != 0:
+    raise newException(RpcError, "invalid hex")
+
+  let idKey = "\"id\":\"" & id & "\""
+  var idFound = false
+  for i in pos + hexLen..size - idKey.len:
+    if equalMem(addr data[i], idKey.cstring, idKey.len):
+      idFound = true
+      break
+  if not idFound:
+    raise newException(RpcError, "id mismatch")
+
+  output.setLen(hexLen div 2)
+  if hexLen > 0 and not hexDecode(cast[ptr UncheckedArray[byte]](addr data[pos]),
+                                  cast[ptr UncheckedArray[byte]](addr output[0]), output.len):
+    raise newException(RpcError, "invalid hex")
+  true
+
+proc sendRaw*(cmd: CoreCommand, output: var seq[byte], rpcConfig: RpcConfig, args: varargs[string, wrapStr]): bool =
+  ## Fast path for raw hex results like getblock verbosity 0. The hex string is
+  ## decoded straight from the receive buffer into output, which can be reused
+  ## for every call. Returns false if the result is not a string.
+  let rpcCmd = setParams(cmd, args)
+  let start = getMonoTime()
+  when USE_CURL:
+    let ret = httpPost(rpcConfig, rpcCmd.data, cmd.retryRecv)
+    addLatency([cmd], start, ret.code != E_OK)
+    if ret.code != E_OK:
+      raise newException(RpcError, $ret.code)
+    if ret.data.len == 0:
+      raise newException(RpcError, "no data")
+    result = rawResult(cast[ptr UncheckedArray[byte]](unsafeAddr ret.data[0]), ret.data.len, rpcCmd.id, output)
+  else:
+    let body = httpPostBody(rpcConfig, rpcCmd.data, cmd.retryRecv)
+    addLatency([cmd], start, body.code != E_OK)
+    if body.code != E_OK:
+      if body.code == E_HTTP_RETURNED_ERROR:
+        body.consumeBody()
+      raise newException(RpcError, $body.code)
+    defer:
+      body.consumeBody()
+    if body.size == 0:
+      raise newException(RpcError, "no data")
+    result = rawResult(cast[ptr UncheckedArray[byte]](addr rpcConn.buf[body.pos]), body.size, rpcCmd.id, output)
+
+template sendRaw*(cmd: CoreCommand, output: var seq[byte], args: varargs[string, wrapStr]): bool =
+  sendRaw(cmd, output, defaultRpcConfig, args)
+
 
 when isMainModule:
   try:
@@ -410,6 +672,9 @@ when isMainModule:
     let d1 = getBlockHash.setParams(1).send()
     echo d1
     echo getBlock.setParams(d1["result"].getStr, 0).send()
+    var blkBuf: seq[byte]
+    if getBlock.sendRaw(blkBuf, d1["result"].getStr, 0):
+      echo blkBuf.len
     echo getBlockchainInfo.send()
     echo getBlockchainInfo.setParams().send()
 
@@ -420,6 +685,7 @@ when isMainModule:
     echo rpcCmds.send()
 
     echo getBlockTemplate.send(%*{"rules": ["segwit"]})
+    echo rpcLatencyStats()
 
   except:
     let e = getCurrentException()
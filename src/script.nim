@@ -26,12 +26,20 @@ type
 
   Script* = distinct seq[byte]
 
+  ScriptView* = object
+    data*: ptr UncheckedArray[byte]
+    len*: int
+
   ScriptError* = object of CatchableError
 
 proc `$`*(data: Chunks): string = $cast[seq[byte]](data)
 
 proc `$`*(data: Script): string = $cast[seq[byte]](data)
 
+proc toScript*(script: ScriptView): Script = Script(script.data.toBytes(script.len))
+
+proc `$`*(data: ScriptView): string = $data.toScript
+
 proc getScriptChunks*(script: Script): Chunks =
   var reader = newReader(script)
   try:
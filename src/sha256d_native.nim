@@ -0,0 +1,521 @@
+# Copyright (c) 2021 zenywallet
+
+{.emit: """
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256D_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+enum {
+  SHA256D_IMPL_UNKNOWN = -1,
+  SHA256D_IMPL_SCALAR = 0,
+  SHA256D_IMPL_SHANI = 1,
+  SHA256D_IMPL_AVX2 = 2
+};
+
+static int sha256d_impl = SHA256D_IMPL_UNKNOWN;
+static int sha256d_avx2 = 0;
+
+static const uint32_t sha256d_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256d_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static inline uint32_t sha256d_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void sha256d_put_be32(uint8_t *p, uint32_t v) {
+  p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v;
+}
+
+typedef void (*sha256d_transform_t)(uint32_t state[8], const uint8_t *data, size_t nblocks);
+
+#define SHA256D_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256d_transform_scalar(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+  uint32_t w[64];
+  while (nblocks--) {
+    for (int i = 0; i < 16; i++) {
+      w[i] = sha256d_be32(data + i * 4);
+    }
+    for (int i = 16; i < 64; i++) {
+      uint32_t s0 = SHA256D_ROR(w[i - 15], 7) ^ SHA256D_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = SHA256D_ROR(w[i - 2], 17) ^ SHA256D_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+      uint32_t t1 = h + (SHA256D_ROR(e, 6) ^ SHA256D_ROR(e, 11) ^ SHA256D_ROR(e, 25)) +
+                    ((e & f) ^ (~e & g)) + sha256d_k[i] + w[i];
+      uint32_t t2 = (SHA256D_ROR(a, 2) ^ SHA256D_ROR(a, 13) ^ SHA256D_ROR(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    data += 64;
+  }
+}
+
+#ifdef SHA256D_X86
+__attribute__((target("sha,sse4.1")))
+static void sha256d_transform_shani(uint32_t state[8], const uint8_t *data, size_t nblocks) {
+  const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+  __m128i state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);
+  state1 = _mm_shuffle_epi32(state1, 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while (nblocks--) {
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+    __m128i w[4];
+    for (int q = 0; q < 4; q++) {
+      w[q] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + q * 16)), mask);
+    }
+    for (int q = 0; q < 16; q++) {
+      if (q >= 4) {
+        __m128i t = _mm_sha256msg1_epu32(w[q & 3], w[(q + 1) & 3]);
+        t = _mm_add_epi32(t, _mm_alignr_epi8(w[(q + 3) & 3], w[(q + 2) & 3], 4));
+        w[q & 3] = _mm_sha256msg2_epu32(t, w[(q + 3) & 3]);
+      }
+      __m128i msg = _mm_add_epi32(w[q & 3], _mm_loadu_si128((const __m128i *)&sha256d_k[q * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += 64;
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i *)&state[0], state0);
+  _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#define SHA256D_V_ROR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+/* 8 independent blocks, lane i of s[j] is word j of the i-th state */
+__attribute__((target("avx2")))
+static void sha256d_transform_8way(__m256i s[8], const uint8_t *blocks[8]) {
+  __m256i w[16];
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+  for (int i = 0; i < 64; i++) {
+    __m256i wi;
+    if (i < 16) {
+      wi = _mm256_set_epi32(
+        (int)sha256d_be32(blocks[7] + i * 4), (int)sha256d_be32(blocks[6] + i * 4),
+        (int)sha256d_be32(blocks[5] + i * 4), (int)sha256d_be32(blocks[4] + i * 4),
+        (int)sha256d_be32(blocks[3] + i * 4), (int)sha256d_be32(blocks[2] + i * 4),
+        (int)sha256d_be32(blocks[1] + i * 4), (int)sha256d_be32(blocks[0] + i * 4));
+    } else {
+      __m256i w15 = w[(i - 15) & 15];
+      __m256i w2 = w[(i - 2) & 15];
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(SHA256D_V_ROR(w15, 7), SHA256D_V_ROR(w15, 18)),
+                                    _mm256_srli_epi32(w15, 3));
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(SHA256D_V_ROR(w2, 17), SHA256D_V_ROR(w2, 19)),
+                                    _mm256_srli_epi32(w2, 10));
+      wi = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0), _mm256_add_epi32(w[(i - 7) & 15], s1));
+    }
+    w[i & 15] = wi;
+    __m256i S1 = _mm256_xor_si256(_mm256_xor_si256(SHA256D_V_ROR(e, 6), SHA256D_V_ROR(e, 11)),
+                                  SHA256D_V_ROR(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1),
+                                  _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int)sha256d_k[i]), wi)));
+    __m256i S0 = _mm256_xor_si256(_mm256_xor_si256(SHA256D_V_ROR(a, 2), SHA256D_V_ROR(a, 13)),
+                                  SHA256D_V_ROR(a, 22));
+    __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+                                   _mm256_and_si256(b, c));
+    __m256i t2 = _mm256_add_epi32(S0, maj);
+    h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+    d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+  }
+  s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+  s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+  s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+  s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+}
+
+__attribute__((target("avx2")))
+static void sha256d_init_8way(__m256i s[8]) {
+  for (int j = 0; j < 8; j++) {
+    s[j] = _mm256_set1_epi32((int)sha256d_iv[j]);
+  }
+}
+
+/* lane i of the 8-way state as a big-endian digest */
+__attribute__((target("avx2")))
+static void sha256d_store_8way(__m256i s[8], uint8_t out[8][32]) {
+  uint32_t tmp[8][8];
+  for (int j = 0; j < 8; j++) {
+    _mm256_storeu_si256((__m256i *)tmp[j], s[j]);
+  }
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 8; j++) {
+      sha256d_put_be32(out[i] + j * 4, tmp[j][i]);
+    }
+  }
+}
+
+/* second sha256 of 8 digests, one padded block each */
+__attribute__((target("avx2")))
+static void sha256d_second_8way(uint8_t digests[8][32], uint8_t *outs[8]) {
+  uint8_t blocks[8][64];
+  const uint8_t *p[8];
+  for (int i = 0; i < 8; i++) {
+    memcpy(blocks[i], digests[i], 32);
+    memset(blocks[i] + 32, 0, 32);
+    blocks[i][32] = 0x80;
+    blocks[i][62] = 0x01; /* 256 bits */
+    p[i] = blocks[i];
+  }
+  __m256i s[8];
+  sha256d_init_8way(s);
+  sha256d_transform_8way(s, p);
+  uint8_t res[8][32];
+  sha256d_store_8way(s, res);
+  for (int i = 0; i < 8; i++) {
+    if (outs[i]) {
+      memcpy(outs[i], res[i], 32);
+    }
+  }
+}
+#endif
+
+static void sha256d_detect(void) {
+  int impl = SHA256D_IMPL_SCALAR;
+#ifdef SHA256D_X86
+  unsigned int a, b, c, d;
+  int avx_os = 0;
+  if (__get_cpuid(1, &a, &b, &c, &d)) {
+    if ((c & (1u << 27)) && (c & (1u << 28))) { /* osxsave, avx */
+      unsigned int xlo, xhi;
+      __asm__ volatile ("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+      avx_os = (xlo & 6) == 6;
+    }
+  }
+  if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+    if (avx_os && (b & (1u << 5))) {
+      sha256d_avx2 = 1;
+      impl = SHA256D_IMPL_AVX2;
+    }
+    if (b & (1u << 29)) {
+      impl = SHA256D_IMPL_SHANI;
+    }
+  }
+#endif
+  sha256d_impl = impl;
+}
+
+static inline int sha256d_get_impl(void) {
+  if (sha256d_impl == SHA256D_IMPL_UNKNOWN) {
+    sha256d_detect();
+  }
+  return sha256d_impl;
+}
+
+int sha256d_native_impl(void) {
+  return sha256d_get_impl();
+}
+
+/* for tests, returns 0 if the implementation is not supported */
+int sha256d_native_set_impl(int impl) {
+  sha256d_get_impl();
+#ifdef SHA256D_X86
+  if (impl == SHA256D_IMPL_SHANI) {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid_count(7, 0, &a, &b, &c, &d) || !(b & (1u << 29))) {
+      return 0;
+    }
+  } else if (impl == SHA256D_IMPL_AVX2 && !sha256d_avx2) {
+    return 0;
+  }
+#else
+  if (impl != SHA256D_IMPL_SCALAR) {
+    return 0;
+  }
+#endif
+  sha256d_impl = impl;
+  return 1;
+}
+
+static sha256d_transform_t sha256d_transform(void) {
+#ifdef SHA256D_X86
+  if (sha256d_get_impl() == SHA256D_IMPL_SHANI) {
+    return sha256d_transform_shani;
+  }
+#endif
+  return sha256d_transform_scalar;
+}
+
+static void sha256d_single(sha256d_transform_t tf, uint8_t out[32], const uint8_t *data, size_t len) {
+  uint32_t state[8];
+  memcpy(state, sha256d_iv, sizeof(state));
+  size_t full = len / 64;
+  tf(state, data, full);
+  uint8_t buf[128];
+  size_t rem = len - full * 64;
+  memcpy(buf, data + full * 64, rem);
+  buf[rem] = 0x80;
+  size_t nb = (rem + 9 > 64) ? 2 : 1;
+  memset(buf + rem + 1, 0, nb * 64 - rem - 1);
+  uint64_t bits = (uint64_t)len * 8;
+  for (int i = 0; i < 8; i++) {
+    buf[nb * 64 - 1 - i] = (uint8_t)(bits >> (i * 8));
+  }
+  tf(state, buf, nb);
+  for (int i = 0; i < 8; i++) {
+    sha256d_put_be32(out + i * 4, state[i]);
+  }
+}
+
+static void sha256d_one(uint8_t out[32], const uint8_t *data, size_t len) {
+  sha256d_transform_t tf = sha256d_transform();
+  uint8_t tmp[32];
+  sha256d_single(tf, tmp, data, len);
+  sha256d_single(tf, out, tmp, 32);
+}
+
+void sha256d_native(void *out, void *data, size_t len) {
+  sha256d_one((uint8_t *)out, (const uint8_t *)data, len);
+}
+
+#ifdef SHA256D_X86
+typedef struct {
+  size_t idx;
+  size_t nblocks;
+} sha256d_job_t;
+
+static int sha256d_job_cmp(const void *x, const void *y) {
+  const sha256d_job_t *a = (const sha256d_job_t *)x;
+  const sha256d_job_t *b = (const sha256d_job_t *)y;
+  return (a->nblocks > b->nblocks) - (a->nblocks < b->nblocks);
+}
+
+/* up to 8 messages, lanes without a message repeat lane 0 and are dropped */
+__attribute__((target("avx2")))
+static void sha256d_batch_8way(const uint8_t *const *datas, const size_t *lens, uint8_t (*outs)[32],
+                               const sha256d_job_t *jobs, int count) {
+  uint8_t tails[8][128];
+  size_t full[8], nblocks[8], lens8[8];
+  const uint8_t *msgs[8];
+  size_t maxblocks = 0;
+  for (int i = 0; i < 8; i++) {
+    const sha256d_job_t *job = &jobs[i < count ? i : 0];
+    msgs[i] = datas[job->idx];
+    lens8[i] = lens[job->idx];
+    full[i] = lens8[i] / 64;
+    size_t rem = lens8[i] - full[i] * 64;
+    nblocks[i] = full[i] + ((rem + 9 > 64) ? 2 : 1);
+    memcpy(tails[i], msgs[i] + full[i] * 64, rem);
+    tails[i][rem] = 0x80;
+    size_t tailLen = (nblocks[i] - full[i]) * 64;
+    memset(tails[i] + rem + 1, 0, tailLen - rem - 1);
+    uint64_t bits = (uint64_t)lens8[i] * 8;
+    for (int b = 0; b < 8; b++) {
+      tails[i][tailLen - 1 - b] = (uint8_t)(bits >> (b * 8));
+    }
+    if (nblocks[i] > maxblocks) {
+      maxblocks = nblocks[i];
+    }
+  }
+
+  __m256i s[8];
+  sha256d_init_8way(s);
+  uint8_t digests[8][32];
+  for (size_t k = 0; k < maxblocks; k++) {
+    const uint8_t *p[8];
+    int done = 0;
+    for (int i = 0; i < 8; i++) {
+      if (k < full[i]) {
+        p[i] = msgs[i] + k * 64;
+      } else if (k < nblocks[i]) {
+        p[i] = tails[i] + (k - full[i]) * 64;
+      } else {
+        p[i] = tails[i];
+      }
+      if (nblocks[i] == k + 1) {
+        done = 1;
+      }
+    }
+    sha256d_transform_8way(s, p);
+    if (done) {
+      uint8_t res[8][32];
+      sha256d_store_8way(s, res);
+      for (int i = 0; i < 8; i++) {
+        if (nblocks[i] == k + 1) {
+          memcpy(digests[i], res[i], 32);
+        }
+      }
+    }
+  }
+
+  uint8_t *o[8];
+  for (int i = 0; i < 8; i++) {
+    o[i] = i < count ? outs[jobs[i].idx] : NULL;
+  }
+  sha256d_second_8way(digests, o);
+}
+
+__attribute__((target("avx2")))
+static void sha256d_64_8way(uint8_t *out, const uint8_t *in) {
+  static const uint8_t pad[64] = {0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02, 0}; /* 512 bits */
+  const uint8_t *p[8];
+  for (int i = 0; i < 8; i++) {
+    p[i] = in + i * 64;
+  }
+  __m256i s[8];
+  sha256d_init_8way(s);
+  sha256d_transform_8way(s, p);
+  for (int i = 0; i < 8; i++) {
+    p[i] = pad;
+  }
+  sha256d_transform_8way(s, p);
+  uint8_t digests[8][32];
+  sha256d_store_8way(s, digests);
+  uint8_t *o[8];
+  for (int i = 0; i < 8; i++) {
+    o[i] = out + i * 32;
+  }
+  sha256d_second_8way(digests, o);
+}
+#endif
+
+/* count independent messages, outs[i] = sha256d(datas[i][0..<lens[i]]) */
+void sha256d_native_batch(void *datas_p, void *lens_p, void *outs_p, size_t count) {
+  const uint8_t *const *datas = (const uint8_t *const *)datas_p;
+  const size_t *lens = (const size_t *)lens_p;
+  uint8_t (*outs)[32] = (uint8_t (*)[32])outs_p;
+#ifdef SHA256D_X86
+  if (sha256d_get_impl() == SHA256D_IMPL_AVX2 && count >= 2) {
+    sha256d_job_t jobs_buf[64];
+    sha256d_job_t *jobs = count <= 64 ? jobs_buf : (sha256d_job_t *)malloc(sizeof(sha256d_job_t) * count);
+    if (jobs) {
+      for (size_t i = 0; i < count; i++) {
+        jobs[i].idx = i;
+        jobs[i].nblocks = (lens[i] + 9 + 63) / 64;
+      }
+      /* similar lengths in the same group waste fewer lanes */
+      qsort(jobs, count, sizeof(sha256d_job_t), sha256d_job_cmp);
+      for (size_t i = 0; i < count; i += 8) {
+        int n = count - i < 8 ? (int)(count - i) : 8;
+        sha256d_batch_8way(datas, lens, outs, &jobs[i], n);
+      }
+      if (jobs != jobs_buf) {
+        free(jobs);
+      }
+      return;
+    }
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    sha256d_one(outs[i], datas[i], lens[i]);
+  }
+}
+
+/* count 64-byte messages, for merkle tree levels */
+void sha256d_native_64(void *out_p, void *in_p, size_t count) {
+  uint8_t *out = (uint8_t *)out_p;
+  const uint8_t *in = (const uint8_t *)in_p;
+#ifdef SHA256D_X86
+  if (sha256d_get_impl() == SHA256D_IMPL_AVX2) {
+    while (count >= 8) {
+      sha256d_64_8way(out, in);
+      out += 32 * 8;
+      in += 64 * 8;
+      count -= 8;
+    }
+  }
+#endif
+  for (size_t i = 0; i < count; i++) {
+    sha256d_one(out + i * 32, in + i * 64, 64);
+  }
+}
+""".}
+
+type
+  Sha256dImpl* {.pure.} = enum
+    Scalar
+    ShaNi
+    Avx2
+
+proc sha256d_native(output: pointer, data: pointer, size: csize_t) {.importc.}
+proc sha256d_native_batch(datas: pointer, sizes: pointer, outputs: pointer, count: csize_t) {.importc.}
+proc sha256d_native_64(output: pointer, data: pointer, count: csize_t) {.importc.}
+proc sha256d_native_impl(): cint {.importc.}
+proc sha256d_native_set_impl(impl: cint): cint {.importc.}
+
+proc sha256dImpl*(): Sha256dImpl = Sha256dImpl(sha256d_native_impl())
+
+proc setSha256dImpl*(impl: Sha256dImpl): bool = sha256d_native_set_impl(impl.cint) == 1
+
+proc sha256d*(data: ptr UncheckedArray[byte], size: int): array[32, byte] {.inline.} =
+  sha256d_native(addr result[0], data, size.csize_t)
+
+proc sha256dBatch*(datas: openArray[ptr UncheckedArray[byte]], sizes: openArray[int],
+                  outputs: var openArray[array[32, byte]]) =
+  ## Hashes independent messages together, lanes of the same size are grouped.
+  if datas.len != sizes.len or datas.len > outputs.len:
+    raise newException(ValueError, "sha256dBatch length mismatch")
+  if datas.len > 0:
+    sha256d_native_batch(unsafeAddr datas[0], unsafeAddr sizes[0], addr outputs[0], datas.len.csize_t)
+
+proc sha256d64*(output: ptr UncheckedArray[byte], data: ptr UncheckedArray[byte], count: int) {.inline.} =
+  ## count 64-byte messages to count 32-byte hashes, for merkle tree levels.
+  sha256d_native_64(output, data, count.csize_t)
+
+
+when isMainModule:
+  import sequtils, utils
+
+  var data = newSeq[byte](3000)
+  for i in 0..<data.len:
+    data[i] = byte((i * 7 + 3) and 0xff)
+
+  var datas: seq[ptr UncheckedArray[byte]]
+  var sizes: seq[int]
+  for i in 0..<40:
+    datas.add(cast[ptr UncheckedArray[byte]](addr data[i]))
+    sizes.add((i * 137) mod 1000)
+
+  for impl in Sha256dImpl:
+    if not setSha256dImpl(impl):
+      echo impl, " not supported"
+      continue
+    var outputs = newSeq[array[32, byte]](datas.len)
+    sha256dBatch(datas, sizes, outputs)
+    for i in 0..<datas.len:
+      assert outputs[i] == sha256d(data[i..<i + sizes[i]])
+    var outputs64 = newSeq[byte](19 * 32)
+    sha256d64(cast[ptr UncheckedArray[byte]](addr outputs64[0]), cast[ptr UncheckedArray[byte]](addr data[0]), 19)
+    for i in 0..<19:
+      assert outputs64[i * 32..<(i + 1) * 32] == sha256d(data[i * 64..<(i + 1) * 64]).toSeq
+    echo impl, " OK"
@@ -2,6 +2,8 @@
 
 import std/sequtils # keepIf
 import std/strutils # endsWith
+import std/monotimes
+import std/locks
 import deoxy
 import zenyjs/ed25519
 import zenyjs/seed
@@ -19,6 +21,9 @@ import rpc
 import blocks, tx, script
 import mempool
 import opcodes
+import queue
+import streambin
+import jsonwriter
 
 when not declared(DECODE_BUF_SIZE):
   const DECODE_BUF_SIZE = 1048576
@@ -28,6 +33,10 @@ const RPC_NODE_COUNT = SERVER_LABELS.len
 when not declared(RPC_WORKER_NUM):
   const RPC_WORKER_NUM = 2
 const RPC_WORKER_TOTAL = RPC_WORKER_NUM * RPC_NODE_COUNT
+when not declared(STREAM_SENDER_NUM):
+  const STREAM_SENDER_NUM = 2
+when not declared(STREAM_QUEUE_SIZE):
+  const STREAM_QUEUE_SIZE = 16384
 
 type
   StreamStage {.pure.} = enum
@@ -43,6 +52,7 @@ type
     seed: DeoxySalt
     prv: Ed25519PrivateKey
     streamId: StreamId
+    binary: bool
 
   StreamError* = object of CatchableError
 
@@ -67,6 +77,7 @@ type
     Mining
     MiningFind
     SendMiningBlock
+    Broadcast
 
   MsgDataObj* = object
     msgType: MsgDataType
@@ -91,6 +102,7 @@ type
   StreamThreadArgType* {.pure.} = enum
     Void
     NodeId
+    Sender
 
   StreamThreadArg* = object
     case argType*: StreamThreadArgType
@@ -99,6 +111,8 @@ type
     of StreamThreadArgType.NodeId:
       threadId: int
       nodeId*: int
+    of StreamThreadArgType.Sender:
+      senderId: int
 
   WrapperStreamThreadArg = tuple[threadFunc: proc(arg: StreamThreadArg) {.thread.}, arg: StreamThreadArg]
 
@@ -172,6 +186,36 @@ var miningTemplateChannel: ptr Channel[MiningTemplateChannelParam]
 var streamActive* = false
 var curMsgId: int
 
+type
+  StreamEventObj = object
+    once: bool
+    enqueued: int64
+    tagLen: int
+    dataLen: int
+    binLen: int
+    buf: UncheckedArray[byte]
+
+  StreamEvent = ptr StreamEventObj
+
+  StreamQueueStats = object
+    events: int
+    dropped: int
+    blocked: int
+    sends: int
+    depthMax: int
+    latencyUs: int
+    latencyMaxUs: int
+
+# one queue per sender, events of a tag always go to the same sender to keep their order
+var streamQueues: array[STREAM_SENDER_NUM, MpmcQueue[StreamEvent]]
+var streamQueueLocks: array[STREAM_SENDER_NUM, Lock]
+var streamQueueConds: array[STREAM_SENDER_NUM, Cond] # queue not empty, waited by the sender
+var streamSpaceConds: array[STREAM_SENDER_NUM, Cond] # queue not full, waited by the producers
+var streamSpaceWaiters: array[STREAM_SENDER_NUM, int]
+var streamSenderThreads: array[STREAM_SENDER_NUM, Thread[WrapperStreamThreadArg]]
+var streamSenderActive = false
+var queueStats: StreamQueueStats
+
 proc initExClient*(client: Client) =
   client.pStream = nil
 
@@ -196,17 +240,33 @@ proc pendingFilter(client: Client): bool =
     result = false
     client.freeExClient()
 
-proc sendCmd(client: Client, data: seq[byte]): SendResult =
+var sendBuf {.threadvar.}: seq[byte]
+var jsonWriter {.threadvar.}: JsonWriter
+
+template setSendLen(len: int) =
+  # the seq keeps its capacity, setLen would zero fill it again on every grow
+  when declared(setLenUninit):
+    sendBuf.setLenUninit(len)
+  else:
+    sendBuf.setLen(len)
+
+proc encCmd(sobj: ptr StreamObj, data: ptr UncheckedArray[byte], size: int): int =
+  ## Encrypts into the reused send buffer of the thread, valid until the next call.
+  let outsize = LZ4_COMPRESSBOUND(size)
+  setSendLen(outsize)
+  result = sobj.deoxyObj.enc(data, cast[uint](size),
+                            cast[ptr UncheckedArray[byte]](addr sendBuf[0]), outsize.uint)
+  if result > 0:
+    setSendLen(result)
+
+proc sendCmd(client: Client, data: ptr UncheckedArray[byte], size: int): SendResult =
   let sobj = cast[ptr StreamObj](client.pStream)
-  var outdata = newSeq[byte](LZ4_COMPRESSBOUND(data.len))
-  let outsize: uint = outdata.len.uint
-  let encLen = sobj.deoxyObj.enc(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), cast[uint](data.len),
-                            cast[ptr UncheckedArray[byte]](addr outdata[0]), outsize)
+  let encLen = sobj.encCmd(data, size)
   if encLen > 0:
-    return client.wsServerSend(outdata[0..<encLen], WebSocketOpcode.Binary)
+    return client.wsServerSend(sendBuf, WebSocketOpcode.Binary)
   result = SendResult.None
 
-proc sendCmd(clientId: ClientId, data: seq[byte]): SendResult =
+proc sendCmd(clientId: ClientId, data: ptr UncheckedArray[byte], size: int): SendResult =
   var client = getClient(clientId)
   if not client.isNil:
     acquire(client.lock)
@@ -214,44 +274,168 @@ proc sendCmd(clientId: ClientId, data: seq[byte]): SendResult =
     if sobj.isNil:
       release(client.lock)
       return SendResult.None
-    var outdata = newSeq[byte](LZ4_COMPRESSBOUND(data.len))
-    let outsize: uint = outdata.len.uint
-    let encLen = sobj.deoxyObj.enc(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), cast[uint](data.len),
-                              cast[ptr UncheckedArray[byte]](addr outdata[0]), outsize)
+    let encLen = sobj.encCmd(data, size)
     release(client.lock)
     if encLen > 0:
-      return clientId.wsServerSend(outdata[0..<encLen], WebSocketOpcode.Binary)
+      return clientId.wsServerSend(sendBuf, WebSocketOpcode.Binary)
   result = SendResult.None
 
-proc sendCmd(client: Client, s: string): SendResult {.inline.} = client.sendCmd(s.toBytes)
+proc sendCmd(clientId: ClientId, data: ptr UncheckedArray[byte], size: int,
+            bin: ptr UncheckedArray[byte], binSize: int): SendResult =
+  ## Sends the binary record to clients that negotiated it, the JSON otherwise.
+  var client = getClient(clientId)
+  if not client.isNil:
+    acquire(client.lock)
+    let sobj = cast[ptr StreamObj](client.pStream)
+    if sobj.isNil:
+      release(client.lock)
+      return SendResult.None
+    let encLen = if sobj.binary and binSize > 0: sobj.encCmd(bin, binSize) else: sobj.encCmd(data, size)
+    release(client.lock)
+    if encLen > 0:
+      return clientId.wsServerSend(sendBuf, WebSocketOpcode.Binary)
+  result = SendResult.None
 
-proc sendCmd(client: Client, json: JsonNode): SendResult {.inline.} = client.sendCmd(($json).toBytes)
+proc sendCmd(client: Client, data: seq[byte]): SendResult {.inline.} =
+  client.sendCmd(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), data.len)
 
-proc streamSend*(tag: seq[byte], json: JsonNode) =
-  var tag = tag.toArray.Tag
-  var data = ($json).toBytes
-  for cid in tag.getClientIds():
-    discard cid.sendCmd(data)
+proc sendCmd(clientId: ClientId, data: seq[byte]): SendResult {.inline.} =
+  clientId.sendCmd(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), data.len)
 
-proc streamSend*(tag: string, json: JsonNode) =
-  var tag = tag.toBytes.toArray.Tag
-  var data = ($json).toBytes
-  for cid in tag.getClientIds():
-    discard cid.sendCmd(data)
+proc sendCmd(client: Client, s: string): SendResult {.inline.} =
+  client.sendCmd(cast[ptr UncheckedArray[byte]](unsafeAddr s[0]), s.len)
+
+proc sendCmd(client: Client, json: JsonNode): SendResult {.inline.} = client.sendCmd($json)
+
+proc sendCmd(client: Client, w: var JsonWriter): SendResult {.inline.} =
+  client.sendCmd(cast[ptr UncheckedArray[byte]](addr w.buf[0]), w.len)
+
+proc atomicMax(p: var int, val: int) {.inline.} =
+  var cur = atomicLoadN(addr p, ATOMIC_RELAXED)
+  while val > cur:
+    if atomicCompareExchangeN(addr p, addr cur, val, true, ATOMIC_RELAXED, ATOMIC_RELAXED):
+      break
+
+proc streamEnqueue(tag: seq[byte], data: openArray[byte], bin: seq[byte], once: bool) =
+  var h: uint = 0
+  for b in tag:
+    h = h * 31 + b.uint
+  let qid = (h mod STREAM_SENDER_NUM.uint).int
+  let queue = addr streamQueues[qid]
+  if not streamSenderActive:
+    atomicInc(queueStats.dropped)
+    return
+  let ev = cast[StreamEvent](allocShared(sizeof(StreamEventObj) + tag.len + data.len + bin.len))
+  ev.once = once
+  ev.tagLen = tag.len
+  ev.dataLen = data.len
+  ev.binLen = bin.len
+  if tag.len > 0:
+    copyMem(addr ev.buf[0], unsafeAddr tag[0], tag.len)
+  if data.len > 0:
+    copyMem(addr ev.buf[tag.len], unsafeAddr data[0], data.len)
+  if bin.len > 0:
+    copyMem(addr ev.buf[tag.len + data.len], unsafeAddr bin[0], bin.len)
+  ev.enqueued = getMonoTime().ticks
+  if not queue[].add(ev):
+    # the sender is behind, wait for space rather than lose the notification
+    atomicInc(queueStats.blocked)
+    acquire(streamQueueLocks[qid])
+    discard atomicAddFetch(addr streamSpaceWaiters[qid], 1, ATOMIC_SEQ_CST)
+    atomicThreadFence(ATOMIC_SEQ_CST) # pairs with the fence after the pop of the sender
+    while not queue[].add(ev):
+      if not streamSenderActive:
+        discard atomicSubFetch(addr streamSpaceWaiters[qid], 1, ATOMIC_SEQ_CST)
+        release(streamQueueLocks[qid])
+        ev.deallocShared()
+        atomicInc(queueStats.dropped)
+        return
+      wait(streamSpaceConds[qid], streamQueueLocks[qid])
+    discard atomicSubFetch(addr streamSpaceWaiters[qid], 1, ATOMIC_SEQ_CST)
+    release(streamQueueLocks[qid])
+  atomicInc(queueStats.events)
+  atomicMax(queueStats.depthMax, queue[].len)
+  acquire(streamQueueLocks[qid])
+  signal(streamQueueConds[qid])
+  release(streamQueueLocks[qid])
+
+proc streamSender(arg: StreamThreadArg) {.thread.} =
+  let qid = arg.senderId
+  let queue = addr streamQueues[qid]
+  var ev: StreamEvent
+  var tagBytes: seq[byte]
+  while true:
+    if not queue[].pop(ev):
+      if not streamSenderActive:
+        break
+      acquire(streamQueueLocks[qid])
+      if queue[].len == 0 and streamSenderActive:
+        wait(streamQueueConds[qid], streamQueueLocks[qid])
+      release(streamQueueLocks[qid])
+      continue
+    atomicThreadFence(ATOMIC_SEQ_CST)
+    if atomicLoadN(addr streamSpaceWaiters[qid], ATOMIC_SEQ_CST) > 0:
+      acquire(streamQueueLocks[qid])
+      broadcast(streamSpaceConds[qid])
+      release(streamQueueLocks[qid])
+    tagBytes.setLen(ev.tagLen)
+    if ev.tagLen > 0:
+      copyMem(addr tagBytes[0], addr ev.buf[0], ev.tagLen)
+    var tag = tagBytes.toArray.Tag
+    let data = cast[ptr UncheckedArray[byte]](addr ev.buf[ev.tagLen])
+    let bin = cast[ptr UncheckedArray[byte]](addr ev.buf[ev.tagLen + ev.dataLen])
+    var sends = 0
+    if ev.once:
+      var cids = tag.purgeClientIds()
+      for cid in cids:
+        discard cid.sendCmd(data, ev.dataLen, bin, ev.binLen)
+        inc(sends)
+    else:
+      for cid in tag.getClientIds():
+        discard cid.sendCmd(data, ev.dataLen, bin, ev.binLen)
+        inc(sends)
+    let us = ((getMonoTime().ticks - ev.enqueued) div 1000).int
+    ev.deallocShared()
+    atomicInc(queueStats.sends, sends)
+    atomicInc(queueStats.latencyUs, us)
+    atomicMax(queueStats.latencyMaxUs, us)
+
+proc streamQueueStats*(): string =
+  var depth = 0
+  for i in 0..<STREAM_SENDER_NUM:
+    depth = depth + streamQueues[i].len
+  let events = atomicLoadN(addr queueStats.events, ATOMIC_RELAXED)
+  let done = max(events - depth, 1)
+  "stream queue depth=" & $depth & " max=" & $queueStats.depthMax &
+    " events=" & $events & " blocked=" & $queueStats.blocked & " dropped=" & $queueStats.dropped & " sends=" & $queueStats.sends &
+    " latency avg=" & $(queueStats.latencyUs div done) & "us max=" & $queueStats.latencyMaxUs & "us"
+
+proc streamSend*(tag: seq[byte], json: JsonNode, bin: seq[byte] = @[]) =
+  let s = $json
+  streamEnqueue(tag, s.toOpenArrayByte(0, s.high), bin, false)
+
+proc streamSend*(tag: string, json: JsonNode, bin: seq[byte] = @[]) =
+  let s = $json
+  streamEnqueue(tag.toBytes, s.toOpenArrayByte(0, s.high), bin, false)
 
 proc streamSend*(streamId: StreamId, json: JsonNode, msgType: MsgDataType = MsgDataType.Direct) =
   var data = ($json).toBytes
   discard streamId.sendCmd(data)
 
+proc streamSend*(streamId: StreamId, json: JsonNode, bin: seq[byte], msgType: MsgDataType) =
+  if bin.len == 0:
+    streamId.streamSend(json, msgType)
+    return
+  let s = $json
+  discard streamId.sendCmd(cast[ptr UncheckedArray[byte]](unsafeAddr s[0]), s.len,
+                          cast[ptr UncheckedArray[byte]](unsafeAddr bin[0]), bin.len)
+
 proc streamSend*(streamId: StreamId, data: seq[byte], msgType: MsgDataType = MsgDataType.Direct) =
   discard streamId.sendCmd(data)
 
-proc streamSendOnce*(tag: seq[byte], json: JsonNode) =
-  var tag = tag.toArray.Tag
-  var data = ($json).toBytes
-  var cids = tag.purgeClientIds()
-  for cid in cids:
-    discard cid.sendCmd(data)
+proc streamSendOnce*(tag: seq[byte], json: JsonNode, bin: seq[byte] = @[]) =
+  let s = $json
+  streamEnqueue(tag, s.toOpenArrayByte(0, s.high), bin, true)
 
 proc streamTagExists*(tag: seq[byte]): bool =
   var tag = tag.toArray.Tag
@@ -397,28 +581,28 @@ proc rpcWorker(arg: StreamThreadArg) {.thread.} =
 
           var addrins = newJArray()
           var addrouts = newJArray()
-          if reward:
-            for t in txinvals.aggregate:
-              addrins.add(%*{"addr": network.getAddress(t.hash160, t.addressType.AddressType),
-                            "val": t.value.toJson, "count": t.count})
-            for t in txoutvals.aggregate:
-              addrouts.add(%*{"addr": network.getAddress(t.hash160, t.addressType.AddressType),
-                            "val": t.value.toJson, "count": t.count})
-          else:
-            for t in txinvals.aggregate:
-              addrins.add(%*{"addr": network.getAddress(t.hash160, t.addressType.AddressType),
-                            "val": t.value.toJson, "count": t.count})
+          var binIns, binOuts: seq[BinTxAddr]
+          for t in txinvals.aggregate:
+            let a = network.getAddress(t.hash160, t.addressType.AddressType)
+            addrins.add(%*{"addr": a, "val": t.value.toJson, "count": t.count})
+            binIns.add((a, t.value, t.count))
+            if not reward:
               fee = fee + t.value
-            for t in txoutvals.aggregate:
-              addrouts.add(%*{"addr": network.getAddress(t.hash160, t.addressType.AddressType),
-                            "val": t.value.toJson, "count": t.count})
+          for t in txoutvals.aggregate:
+            let a = network.getAddress(t.hash160, t.addressType.AddressType)
+            addrouts.add(%*{"addr": a, "val": t.value.toJson, "count": t.count})
+            binOuts.add((a, t.value, t.count))
+            if not reward:
               fee = fee - t.value
 
           retJson["data"]["res"] = %*{"txid": txidStr,
                                       "ins": addrins, "outs": addrouts,
                                       "fee": fee.toJson, "height": tx.res.height,
                                       "time": blk.res.time, "id": tx.res.id}
-          streamSend(channelData.streamId, retJson, MsgDataType.Rawtx)
+          let refJson = if retJson.hasKey("ref"): retJson["ref"] else: nil
+          let bin = binTx(arg.nodeId, txidHash, fee, binIns, binOuts, true,
+                          tx.res.height, blk.res.time.int64, tx.res.id, refJson)
+          streamSend(channelData.streamId, retJson, bin, MsgDataType.Rawtx)
 
         elif channelData.msgType == MsgDataType.BlockTmpl:
           var retTmpl = getBlockTemplate.send(blockTemplateParam)
@@ -431,6 +615,25 @@ proc rpcWorker(arg: StreamThreadArg) {.thread.} =
           retJson["data"]["res"] = retSubmitBlock
           streamSend(channelData.streamId, retJson, MsgDataType.SendMiningBlock)
 
+        elif channelData.msgType == MsgDataType.Broadcast:
+          var data = json["data"]
+          retJson["type"] = newJString("broadcast")
+          if not data.hasKey("rawtx"):
+            errSendBreak(1)
+          let rawtx = data["rawtx"].getStr
+          let raw = rawtx.Hex.toBytes
+          var retSend = sendRawTransaction.send(rawtx)
+          if retSend["result"].kind != JString:
+            retJson["data"]["err"] = newJInt(2)
+            retJson["data"]["res"] = retSend["error"]
+            streamSend(channelData.streamId, retJson, MsgDataType.Broadcast)
+            break workerMain
+          let txidStr = retSend["result"].getStr
+          # added by the mempool thread at once, the addresses get notified from there
+          mempool.push(arg.nodeId, txidStr.Hex.toHash, raw)
+          retJson["data"]["res"] = %*{"txid": txidStr}
+          streamSend(channelData.streamId, retJson, MsgDataType.Broadcast)
+
       except:
         let e = getCurrentException()
         echo "rpcWorker ", e.name, ": ", e.msg
@@ -625,6 +828,16 @@ proc initStream*() =
   createThread(miningTemplateWorkerThread, streamThreadWrapper, (miningTemplateWorker, StreamThreadArg(argType: StreamThreadArgType.Void)))
   createThread(miningWorkerThread, streamThreadWrapper, (miningWorker, StreamThreadArg(argType: StreamThreadArgType.Void)))
 
+  for i in 0..<STREAM_SENDER_NUM:
+    streamQueues[i].init(STREAM_QUEUE_SIZE)
+    initLock(streamQueueLocks[i])
+    initCond(streamQueueConds[i])
+    initCond(streamSpaceConds[i])
+  streamSenderActive = true
+  for i in 0..<STREAM_SENDER_NUM:
+    createThread(streamSenderThreads[i], streamThreadWrapper,
+                (streamSender, StreamThreadArg(argType: StreamThreadArgType.Sender, senderId: i)))
+
 proc freeStream*() =
   streamActive = false
   for i in 0..<RPC_NODE_COUNT:
@@ -638,6 +851,20 @@ proc freeStream*() =
     rpcWorkerChannels[i][].close()
     rpcWorkerChannels[i].deallocShared()
 
+  streamSenderActive = false
+  for i in 0..<STREAM_SENDER_NUM:
+    acquire(streamQueueLocks[i])
+    broadcast(streamQueueConds[i])
+    broadcast(streamSpaceConds[i])
+    release(streamQueueLocks[i])
+  joinThreads(streamSenderThreads)
+  echo streamQueueStats()
+  for i in 0..<STREAM_SENDER_NUM:
+    streamQueues[i].deinit()
+    deinitCond(streamQueueConds[i])
+    deinitCond(streamSpaceConds[i])
+    deinitLock(streamQueueLocks[i])
+
   withWriteLock miningAddrTableLock:
     miningAddrTable.clear()
   rwlockDestroy(miningAddrTableLock)
@@ -665,8 +892,14 @@ proc streamConnect*(client: Client): tuple[sendFlag: bool, sendResult: SendResul
 
   result = (true, sendRet)
 
+proc toUnconfJson(pend: MempoolAddr): JsonNode =
+  %*{"out": pend.value_out.toJson, "in": pend.value_in.toJson}
+
 proc parseCmd(client: Client, json: JsonNode): SendResult =
   result = SendResult.None
+  let binary = cast[ptr StreamObj](client.pStream).binary
+  template w(): var JsonWriter = jsonWriter
+  template refJson(): JsonNode = (if json.hasKey("ref"): json["ref"] else: nil)
   if json.hasKey("cmd"):
     var cmd = json["cmd"].getStr
     var cmdSwitch: ParseCmdSwitch = ParseCmdSwitch.None
@@ -690,16 +923,22 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
       elif cmdSwitch == ParseCmdSwitch.Off:
         client.delTag((hash160, addressType, nid.uint16).toBytes)
         return
+      var aval = streamDbInsts[nid].getAddrval(networks[nid].getHash160(astr))
+      let pend = mempool.pending(nid, hash160, addressType)
+      if binary:
+        return client.sendCmd(binAddr(nid, astr, aval.err == DbStatus.Success, aval.res.value,
+                                      aval.res.utxo_count, pend.value_out, pend.value_in, refJson = refJson))
       var resJson: JsonNode
       if json.hasKey("ref"):
         resJson = %*{"type": "addr", "data": {}, "ref": json["ref"]}
       else:
         resJson = %*{"type": "addr", "data": {}}
-      var aval = streamDbInsts[nid].getAddrval(networks[nid].getHash160(astr))
       if aval.err == DbStatus.Success:
         resJson["data"] = %*{"nid": nid, "addr": astr, "val": aval.res.value.toJson, "utxo_count": aval.res.utxo_count}
       else:
         resJson["data"] = %*{"nid": nid, "addr": astr}
+      if pend.value_out > 0 or pend.value_in > 0:
+        resJson["data"]["unconf"] = pend.toUnconfJson
       result = client.sendCmd(resJson)  # Send by tag is always after this sending.
     elif cmd == "addrs":
       let reqData = json["data"]
@@ -717,24 +956,26 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
       else:
         resJson = %*{"type": "addrs", "data": []}
       var resData = resJson["data"]
-      if cmdSwitch == ParseCmdSwitch.On:
-        for a in reqData["addrs"]:
-          var astr = a.getStr
-          let (hash160, addressType) = networks[nid].getHash160AddressType(astr)
+      var astrs: seq[string]
+      var pendAddrs: seq[tuple[hash160: Hash160, addressType: AddressType]]
+      for a in reqData["addrs"]:
+        var astr = a.getStr
+        let (hash160, addressType) = networks[nid].getHash160AddressType(astr)
+        if cmdSwitch == ParseCmdSwitch.On:
           client.setTag((hash160, addressType, nid.uint16).toBytes)
-          var aval = streamDbInsts[nid].getAddrval(networks[nid].getHash160(astr))
-          if aval.err == DbStatus.Success:
-            resData.add(%*{"nid": nid, "addr": astr, "val": aval.res.value.toJson, "utxo_count": aval.res.utxo_count})
-          else:
-            resData.add(%*{"nid": nid, "addr": astr})
-      else:
-        for a in reqData["addrs"]:
-          var astr = a.getStr
-          var aval = streamDbInsts[nid].getAddrval(networks[nid].getHash160(astr))
-          if aval.err == DbStatus.Success:
-            resData.add(%*{"nid": nid, "addr": astr, "val": aval.res.value.toJson, "utxo_count": aval.res.utxo_count})
-          else:
-            resData.add(%*{"nid": nid, "addr": astr})
+        astrs.add(astr)
+        pendAddrs.add((hash160, addressType))
+      let pends = mempool.pending(nid, pendAddrs)
+      for i, astr in astrs:
+        var aval = streamDbInsts[nid].getAddrval(networks[nid].getHash160(astr))
+        var aJson: JsonNode
+        if aval.err == DbStatus.Success:
+          aJson = %*{"nid": nid, "addr": astr, "val": aval.res.value.toJson, "utxo_count": aval.res.utxo_count}
+        else:
+          aJson = %*{"nid": nid, "addr": astr}
+        if pends[i].value_out > 0 or pends[i].value_in > 0:
+          aJson["unconf"] = pends[i].toUnconfJson
+        resData.add(aJson)
       result = client.sendCmd(resJson)
     elif cmd == "utxo":
       let reqData = json["data"]
@@ -742,7 +983,7 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
       let astr = reqData["addr"].getStr
       if nid > streamDbInsts.high or nid < streamDbInsts.low:
         raise newException(StreamError, "invalid nid")
-      var utxos = newJArray()
+      var binUtxos: seq[BinUtxo]
       var count = 0
       var limit = 101
       if reqData.hasKey("limit"):
@@ -770,6 +1011,16 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
         if lt.uint64 == uint64.low:
           raise newException(StreamError, "invalid lt")
         lte = lt - 1
+      if not binary:
+        w.reset()
+        w.beginObject()
+        w.field("type", "utxo")
+        w.key("data")
+        w.beginObject()
+        w.field("nid", nid)
+        w.field("addr", astr)
+        w.key("utxos")
+        w.beginArray()
       for u in streamDbInsts[nid].getUnspents(networks[nid].getHash160(astr), (gte: gte, lte: lte, rev: rev)):
         inc(count)
         let sid = u.id
@@ -780,12 +1031,68 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
         let retId = streamDbInsts[nid].getId(sid)
         if retId.err == DbStatus.NotFound:
           raise newException(StreamError, "id not found")
-        utxos.add(%*{"id": sid.toJson, "tx": $retId.res, "n": u.n, "val": u.value.toJson})
-      var jsonData: JsonNode
+        if binary:
+          binUtxos.add((sid, retId.res, u.n, u.value))
+        else:
+          w.beginObject()
+          w.field("id", sid)
+          w.field("tx", retId.res)
+          w.field("n", u.n)
+          w.field("val", u.value)
+          w.endObject()
+      if binary:
+        var txouts: seq[BinUnconfTxout]
+        var spents: seq[BinUnconfSpent]
+        if not (reqData.hasKey("gt") or reqData.hasKey("lt")):
+          let (hash160, addressType) = networks[nid].getHash160AddressType(astr)
+          let pend = mempool.pending(nid, hash160, addressType, outpoints = true)
+          for t in pend.txouts:
+            txouts.add((t.txid, t.n, t.value))
+          for s in pend.spents:
+            spents.add((s.txid, s.n, s.value, s.txid_out))
+        return client.sendCmd(binUtxo(nid, astr, binUtxos, cont, next, txouts, spents, refJson))
+      w.endArray()
       if cont:
-        jsonData = %*{"type": "utxo", "data": {"nid": nid, "addr": astr, "utxos": utxos, "next": next.toJson}}
-      else:
-        jsonData = %*{"type": "utxo", "data": {"nid": nid, "addr": astr, "utxos": utxos}}
+        w.field("next", next)
+      if not (reqData.hasKey("gt") or reqData.hasKey("lt")):
+        # pending txouts and spents of the address only on the first page
+        let (hash160, addressType) = networks[nid].getHash160AddressType(astr)
+        let pend = mempool.pending(nid, hash160, addressType, outpoints = true)
+        if pend.txouts.len > 0 or pend.spents.len > 0:
+          w.key("unconf")
+          w.beginObject()
+          w.key("txouts")
+          w.beginArray()
+          for t in pend.txouts:
+            w.beginObject()
+            w.field("tx", t.txid)
+            w.field("n", t.n)
+            w.field("val", t.value)
+            w.endObject()
+          w.endArray()
+          w.key("spents")
+          w.beginArray()
+          for s in pend.spents:
+            w.beginObject()
+            w.field("tx", s.txid)
+            w.field("n", s.n)
+            w.field("val", s.value)
+            w.field("by", s.txid_out)
+            w.endObject()
+          w.endArray()
+          w.endObject()
+      w.endObject()
+      if json.hasKey("ref"):
+        w.field("ref", json["ref"])
+      w.endObject()
+      result = client.sendCmd(w)
+    elif cmd == "fee":
+      let reqData = json["data"]
+      let nid = reqData["nid"].getInt
+      if nid > streamDbInsts.high or nid < streamDbInsts.low:
+        raise newException(StreamError, "invalid nid")
+      var jsonData = %*{"type": "fee", "data": mempool.feeEstimate(nid)}
+      jsonData["data"]["nid"] = newJInt(nid)
       if json.hasKey("ref"):
         jsonData["ref"] = json["ref"]
       result = client.sendCmd(jsonData)
@@ -795,7 +1102,7 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
       let astr = reqData["addr"].getStr
       if nid > streamDbInsts.high or nid < streamDbInsts.low:
         raise newException(StreamError, "invalid nid")
-      var addrlogs = newJArray()
+      var binAddrlogs: seq[BinAddrlog]
       var count = 0
       var limit = 101
       if reqData.hasKey("limit"):
@@ -823,40 +1130,56 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
         if lt.uint64 == uint64.low:
           raise newException(StreamError, "invalid lt")
         lte = lt - 1
-      var addrlist = newSeq[string](AddressType.high.int + 1)
-      for u in streamDbInsts[nid].getAddrlogs(networks[nid].getHash160(astr), (gte: gte, lte: lte, rev: rev)):
+      if not binary:
+        w.reset()
+        w.beginObject()
+        w.field("type", "addrlog")
+        w.key("data")
+        w.beginObject()
+        w.field("nid", nid)
+        w.field("addr", astr)
+        w.key("addrlogs")
+        w.beginArray()
+      var extCache = initAddrlogExtCache()
+      for u in streamDbInsts[nid].getAddrlogsEx(networks[nid].getHash160(astr), (gte: gte, lte: lte, rev: rev)):
         inc(count)
         let sid = u.id
         if count >= limit and (sid < lte or sid > gte):
           cont = true
           next = sid
           break
-        let retId = streamDbInsts[nid].getId(sid)
-        if retId.err == DbStatus.NotFound:
-          raise newException(StreamError, "id not found")
-        let txid = retId.res
-        let retTxid = streamDbInsts[nid].getTx(txid)
-        if retTxid.err == DbStatus.NotFound:
-          raise newException(StreamError, "txid not found")
-        let height = retTxid.res.height
-        let retBlock = streamDbInsts[nid].getBlockHash(height)
-        if retBlock.err == DbStatus.NotFound:
-          raise newException(StreamError, "block not found")
-        let time = retBlock.res.time
-        let retMined = streamDbInsts[nid].getMinedId(sid)
-        var mined = 0
-        if retMined.err == DbStatus.Success:
-          mined = 1
-        addrlogs.add(%*{"id": sid.toJson, "tx": $txid, "trans": u.trans, "val": u.value.toJson, "height": height, "blktime": time, "mined": mined})
-      var jsonData: JsonNode
+        var ext: AddrlogExt
+        if u.ext:
+          ext = (u.height, u.time, u.mined, u.txid)
+        else:
+          # rows written before the extended format
+          let retExt = streamDbInsts[nid].getAddrlogExt(sid, extCache)
+          if retExt.err == DbStatus.NotFound:
+            raise newException(StreamError, "addrlog not found")
+          ext = retExt.res
+        let (height, time, mined, txid) = ext
+        if binary:
+          binAddrlogs.add((sid, txid, u.trans, u.value, height.uint32, time.int64, mined.uint8))
+        else:
+          w.beginObject()
+          w.field("id", sid)
+          w.field("tx", txid)
+          w.field("trans", u.trans)
+          w.field("val", u.value)
+          w.field("height", height)
+          w.field("blktime", time)
+          w.field("mined", mined)
+          w.endObject()
+      if binary:
+        return client.sendCmd(binAddrlog(nid, astr, binAddrlogs, cont, next, refJson))
+      w.endArray()
       if cont:
-        jsonData = %*{"type": "addrlog", "data": {"nid": nid, "addr": astr, "addrlogs": addrlogs, "next": next.toJson}}
-      else:
-        jsonData = %*{"type": "addrlog", "data": {"nid": nid, "addr": astr, "addrlogs": addrlogs}}
+        w.field("next", next)
+      w.endObject()
       if json.hasKey("ref"):
-        jsonData["ref"] = json["ref"]
-      echo "jsonData", jsonData
-      result = client.sendCmd(jsonData)
+        w.field("ref", json["ref"])
+      w.endObject()
+      result = client.sendCmd(w)
     elif cmd == "height":
       if json.hasKey("data") and json["data"].hasKey("nid"):
         let reqData = json["data"]
@@ -892,6 +1215,9 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
         return
       for i in 0..<monitorInfosCount:
         var m = monitorInfos[][i]
+        if binary:
+          result = client.sendCmd(binStatus(i, SERVER_LABELS[i], m.height, m.hash, m.blkTime, m.lastHeight))
+          continue
         let jsonData = %*{"type": "status", "data":
                           {"nid": i,
                           "network": SERVER_LABELS[i],
@@ -910,6 +1236,14 @@ proc parseCmd(client: Client, json: JsonNode): SendResult =
       let sobj = cast[ptr StreamObj](client.pStream)
       let streamId = sobj.streamId
       rpcWorkerChannels[nid][].send((streamId, json, MsgDataType.Rawtx))
+    elif cmd == "broadcast":
+      let reqData = json["data"]
+      let nid = reqData["nid"].getInt
+      if nid > streamDbInsts.high or nid < streamDbInsts.low:
+        raise newException(StreamError, "invalid nid")
+      let sobj = cast[ptr StreamObj](client.pStream)
+      let streamId = sobj.streamId
+      rpcWorkerChannels[nid][].send((streamId, json, MsgDataType.Broadcast))
     elif cmd == "block":
       let reqData = json["data"]
       let nid = reqData["nid"].getInt
@@ -973,7 +1307,7 @@ proc streamMain(client: Client, opcode: WebSocketOpCode,
           echo e.name, ": ", e.msg
 
     elif sobj.stage == StreamStage.Negotiate:
-      if size == 64:
+      if size == 64 or size == 65:
         let pub_cli: Ed25519PublicKey = cast[ptr array[32, byte]](addr data[0])[]
         let seed_cli: DeoxySalt = cast[ptr array[32, byte]](addr data[32])[]
         var shared: Ed25519SharedSecret
@@ -982,6 +1316,9 @@ proc streamMain(client: Client, opcode: WebSocketOpCode,
         zeroMem(addr sobj.seed[0], sizeof(DeoxySalt))
         zeroMem(addr sobj.prv[0], sizeof(Ed25519PrivateKey))
         sobj.stage = StreamStage.Ready
+        if size == 65 and (data[64] and STREAM_FLAG_BINARY) != 0:
+          sobj.binary = true
+          return client.sendCmd(%*{"type": "ready", "bin": 1})
         return client.sendCmd(%*{"type": "ready"})
 
     result = SendResult.None
@@ -0,0 +1,209 @@
+# Copyright (c) 2022 zenywallet
+
+# Binary stream records, negotiated with STREAM_FLAG_BINARY after the client key
+# in the handshake. All integers are little-endian, hashes are in the internal
+# byte order (reversed to display), strings are prefixed with a uint8 length.
+# A record starts with the type byte and the ref, so it never starts with '{'
+# and JSON messages can still be sent to the same client.
+#
+#   header:  type u8, refLen u16, ref (JSON text)
+#   height:  nid u16, height u32, sid u64
+#   status:  nid u16, network str8, height u32, hash 32, blkTime i64, lastHeight u32
+#   addr:    nid u16, addr str8, flags u8,
+#            [val u64, utxo_count u32], [unconf out u64, in u64], [height u32, sid u64]
+#   utxo:    nid u16, addr str8, flags u8, count u32, {id u64, tx 32, n u32, val u64},
+#            [next u64], [txouts u32, {tx 32, n u32, val u64}, spents u32, {tx 32, n u32, val u64, by 32}]
+#   addrlog: nid u16, addr str8, flags u8, count u32,
+#            {id u64, tx 32, trans u8, val u64, height u32, blktime i64, mined u8}, [next u64]
+#   tx:      nid u16, flags u8, tx 32, fee u64, ins u16, {addr str8, val u64, count u32},
+#            outs u16, {...}, [height u32, time i64, id u64]
+
+import std/endians
+import json
+import bytes
+
+const STREAM_FLAG_BINARY* = 1'u8
+
+type
+  StreamBinType* {.pure.} = enum
+    None
+    Addr
+    Utxo
+    Addrlog
+    Height
+    Status
+    Tx
+
+  StreamBinFlag* {.pure.} = enum
+    Val = 0x01
+    Unconf = 0x02
+    Next = 0x04
+    Height = 0x08
+    Confirmed = 0x10
+
+  BinUtxo* = tuple[id: uint64, txid: Hash, n: uint32, value: uint64]
+  BinUnconfTxout* = tuple[txid: Hash, n: uint32, value: uint64]
+  BinUnconfSpent* = tuple[txid: Hash, n: uint32, value: uint64, txid_out: Hash]
+  BinAddrlog* = tuple[id: uint64, txid: Hash, trans: uint8, value: uint64,
+                      height: uint32, time: int64, mined: uint8]
+  BinTxAddr* = tuple[address: string, value: uint64, count: uint32]
+
+  StreamBinError* = object of CatchableError
+
+proc put*[T: SomeInteger](b: var seq[byte], x: T) {.inline.} =
+  let pos = b.len
+  b.setLen(pos + sizeof(T))
+  var x = x
+  when sizeof(T) == 1:
+    b[pos] = cast[byte](x)
+  elif sizeof(T) == 2:
+    littleEndian16(addr b[pos], addr x)
+  elif sizeof(T) == 4:
+    littleEndian32(addr b[pos], addr x)
+  else:
+    littleEndian64(addr b[pos], addr x)
+
+proc putStr8*(b: var seq[byte], s: string) =
+  if s.len > 255:
+    raise newException(StreamBinError, "string too long")
+  b.put(s.len.uint8)
+  if s.len > 0:
+    let pos = b.len
+    b.setLen(pos + s.len)
+    copyMem(addr b[pos], unsafeAddr s[0], s.len)
+
+proc putHash*(b: var seq[byte], hash: openArray[byte]) =
+  if hash.len != 32:
+    raise newException(StreamBinError, "invalid hash")
+  let pos = b.len
+  b.setLen(pos + 32)
+  copyMem(addr b[pos], unsafeAddr hash[0], 32)
+
+proc putHash*(b: var seq[byte], hash: Hash) {.inline.} = b.putHash(cast[seq[byte]](hash))
+
+proc binHeader*(binType: StreamBinType, refJson: JsonNode = nil): seq[byte] =
+  result.put(binType.uint8)
+  if refJson.isNil:
+    result.put(0'u16)
+  else:
+    let s = $refJson
+    if s.len > uint16.high.int:
+      raise newException(StreamBinError, "ref too long")
+    result.put(s.len.uint16)
+    result.add(s.toBytes)
+
+proc binHeight*(nid: int, height: int, sid: uint64): seq[byte] =
+  result = binHeader(StreamBinType.Height)
+  result.put(nid.uint16)
+  result.put(height.uint32)
+  result.put(sid)
+
+proc binStatus*(nid: int, network: string, height: int, hash: openArray[byte],
+                blkTime: int64, lastHeight: int): seq[byte] =
+  result = binHeader(StreamBinType.Status)
+  result.put(nid.uint16)
+  result.putStr8(network)
+  result.put(height.uint32)
+  result.putHash(hash)
+  result.put(blkTime)
+  result.put(lastHeight.uint32)
+
+proc binAddr*(nid: int, address: string, found: bool, value: uint64, utxoCount: uint32,
+              unconfOut: uint64 = 0, unconfIn: uint64 = 0, height: int = -1, sid: uint64 = 0,
+              refJson: JsonNode = nil): seq[byte] =
+  result = binHeader(StreamBinType.Addr, refJson)
+  result.put(nid.uint16)
+  result.putStr8(address)
+  var flags = 0'u8
+  if found: flags = flags or StreamBinFlag.Val.uint8
+  if unconfOut > 0 or unconfIn > 0: flags = flags or StreamBinFlag.Unconf.uint8
+  if height >= 0: flags = flags or StreamBinFlag.Height.uint8
+  result.put(flags)
+  if found:
+    result.put(value)
+    result.put(utxoCount)
+  if unconfOut > 0 or unconfIn > 0:
+    result.put(unconfOut)
+    result.put(unconfIn)
+  if height >= 0:
+    result.put(height.uint32)
+    result.put(sid)
+
+proc binUtxo*(nid: int, address: string, utxos: seq[BinUtxo], cont: bool, next: uint64,
+              txouts: seq[BinUnconfTxout], spents: seq[BinUnconfSpent],
+              refJson: JsonNode = nil): seq[byte] =
+  result = binHeader(StreamBinType.Utxo, refJson)
+  result.put(nid.uint16)
+  result.putStr8(address)
+  var flags = 0'u8
+  if cont: flags = flags or StreamBinFlag.Next.uint8
+  if txouts.len > 0 or spents.len > 0: flags = flags or StreamBinFlag.Unconf.uint8
+  result.put(flags)
+  result.put(utxos.len.uint32)
+  for u in utxos:
+    result.put(u.id)
+    result.putHash(u.txid)
+    result.put(u.n)
+    result.put(u.value)
+  if cont:
+    result.put(next)
+  if txouts.len > 0 or spents.len > 0:
+    result.put(txouts.len.uint32)
+    for t in txouts:
+      result.putHash(t.txid)
+      result.put(t.n)
+      result.put(t.value)
+    result.put(spents.len.uint32)
+    for s in spents:
+      result.putHash(s.txid)
+      result.put(s.n)
+      result.put(s.value)
+      result.putHash(s.txid_out)
+
+proc binAddrlog*(nid: int, address: string, addrlogs: seq[BinAddrlog], cont: bool, next: uint64,
+                refJson: JsonNode = nil): seq[byte] =
+  result = binHeader(StreamBinType.Addrlog, refJson)
+  result.put(nid.uint16)
+  result.putStr8(address)
+  result.put(if cont: StreamBinFlag.Next.uint8 else: 0'u8)
+  result.put(addrlogs.len.uint32)
+  for a in addrlogs:
+    result.put(a.id)
+    result.putHash(a.txid)
+    result.put(a.trans)
+    result.put(a.value)
+    result.put(a.height)
+    result.put(a.time)
+    result.put(a.mined)
+  if cont:
+    result.put(next)
+
+proc binTx*(nid: int, txid: Hash, fee: uint64, ins: seq[BinTxAddr], outs: seq[BinTxAddr],
+            confirmed: bool, height: int = 0, time: int64 = 0, id: uint64 = 0,
+            refJson: JsonNode = nil): seq[byte] =
+  result = binHeader(StreamBinType.Tx, refJson)
+  result.put(nid.uint16)
+  result.put(if confirmed: StreamBinFlag.Confirmed.uint8 else: 0'u8)
+  result.putHash(txid)
+  result.put(fee)
+  for addrs in [ins, outs]:
+    result.put(addrs.len.uint16)
+    for a in addrs:
+      result.putStr8(a.address)
+      result.put(a.value)
+      result.put(a.count)
+  if confirmed:
+    result.put(height.uint32)
+    result.put(time)
+    result.put(id)
+
+
+when isMainModule:
+  var b = binHeight(1, 100, 12345)
+  assert b.len == 3 + 2 + 4 + 8
+  assert b[0] == StreamBinType.Height.uint8
+  assert b[5] == 100 and b[6] == 0 and b[7] == 0 and b[8] == 0
+  assert b[9] == 0x39 and b[10] == 0x30
+
+  b = binAddr(0, "ZyExampleAddr", true, 5000, 2, refJson = %"r1")
+  assert b[1].int + (b[2].int shl 8) == 4 # "r1"
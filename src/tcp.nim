@@ -2,14 +2,17 @@
 
 import std/[net, nativesockets, posix]
 import std/[strutils, sequtils]
-import std/[times, os, re, json, terminal]
+import std/[times, os, re, json, terminal, tables]
 import bytes, reader, utils, blocks
+import sha256d_native
 import address
 
 when not compileOption("threads"):
   {.error: "requires --threads:on option.".}
 
 const SEND_PING* = defined(SEND_PING)
+const BLOCK_PARSE_WORKERS* {.intdefine.} = 2
+const BLOCK_PARSE_QUEUE* {.intdefine.} = 64
 
 type
   Version = distinct uint32
@@ -22,9 +25,12 @@ type
 
   MessageBody = seq[byte]
 
+  # block payloads are passed as shared memory in data, others in body
   Message = ref object
     header: MessageHeader
     body: MessageBody
+    data: ptr UncheckedArray[byte]
+    size: int
 
   InventryType = enum
     ERROR
@@ -46,7 +52,8 @@ type
     sin*: Sockaddr_in
     sock*: SocketHandle
     messageChannel*: ptr Channel[Message]
-    recvThread*: Thread[tuple[sock: SocketHandle, recvBufLen: int, messageChannel: ptr Channel[Message]]]
+    recvThread*: Thread[RecvThreadParams]
+    stats*: ptr IngestStats
 
   NodeParams* = tuple[ip: string, port: uint16, protocolVersion: uint32,
                       messageStart: uint32, networkId: NetworkId,
@@ -55,6 +62,33 @@ type
 
   BlockParserError* = object of CatchableError
 
+  IngestStageStats* = object
+    count*: uint64
+    bytes*: uint64
+    time*: float
+
+  # each stage is updated by its own thread only
+  IngestStats* = object
+    recv*: IngestStageStats
+    parse*: array[BLOCK_PARSE_WORKERS, IngestStageStats]
+    write*: IngestStageStats
+
+  RecvThreadParams = tuple[sock: SocketHandle, recvBufLen: int, messageChannel: ptr Channel[Message],
+                          stats: ptr IngestStageStats]
+
+  BlockJob = object
+    seqNo: int
+    height: int
+    hash: array[32, byte]
+    data: ptr UncheckedArray[byte]
+    size: int
+    txids: ptr UncheckedArray[array[32, byte]]
+    addrHashes: ptr UncheckedArray[AddrHashObj]
+    err: bool
+
+  ParseWorkerParams = tuple[jobs: ptr Channel[ptr BlockJob], results: ptr Channel[ptr BlockJob],
+                            stats: ptr IngestStageStats]
+
 
 proc msgVersion(node: Node): seq[byte] =
   let now = getTime()
@@ -64,7 +98,10 @@ proc msgVersion(node: Node): seq[byte] =
 proc command(s: string): FixedStr {.inline.} = newFixedStr(s, 12)
 
 proc message(node: Node, cmd: string, payload: seq[byte] = @[]): seq[byte] =
-  var checksum = sha256d(payload)
+  var checksum = if payload.len > 0:
+    sha256d(cast[ptr UncheckedArray[byte]](unsafeAddr payload[0]), payload.len)
+  else:
+    sha256d(nil, 0)
   (node.messageStart.uint32.toBE, command(cmd), payload.len.uint32,
     checksum[0..<4], payload).toBytes
 
@@ -84,7 +121,20 @@ proc newNode*(params: NodeParams): Node =
   node.sin.sin_port = nativesockets.ntohs(node.port)
   node
 
-proc nodeRecvThread(params: tuple[sock: SocketHandle, recvBufLen: int, messageChannel: ptr Channel[Message]]) {.thread.} =
+proc `$`(stage: IngestStageStats): string =
+  let rate = if stage.time > 0: stage.count.float / stage.time else: 0.0
+  $stage.count & " blk " & $(stage.bytes div (1024 * 1024)) & " MB " & formatFloat(rate, ffDecimal, 1) & " blk/s"
+
+proc ingestStats*(node: Node): string =
+  var parse: IngestStageStats
+  for p in node.stats.parse:
+    parse.count.inc(p.count)
+    parse.bytes.inc(p.bytes)
+    parse.time = max(parse.time, p.time)
+  "ingest recv=" & $node.stats.recv.count & " blk " & $(node.stats.recv.bytes div (1024 * 1024)) & " MB" &
+    " parse=" & $parse & " write=" & $node.stats.write
+
+proc nodeRecvThread(params: RecvThreadParams) {.thread.} =
   var recvBuf = newSeq[byte](params.recvBufLen)
   var parseData: seq[byte]
 
@@ -104,21 +154,29 @@ proc nodeRecvThread(params: tuple[sock: SocketHandle, recvBufLen: int, messageCh
                                 command: parseData[4..<16].toString.replace(re"\0+$", ""),
                                 length: bodyLen,
                                 checksum: parseData[20].toUint32)
-      var body = MessageBody(parseData[24..<msgLen])
-      params.messageChannel[].send(Message(header: header, body: body))
+      if header.command == "block" and bodyLen > 0:
+        let data = cast[ptr UncheckedArray[byte]](allocShared(bodyLen))
+        copyMem(data, addr parseData[24], bodyLen)
+        params.messageChannel[].send(Message(header: header, data: data, size: bodyLen))
+        inc(params.stats.count)
+        params.stats.bytes.inc(bodyLen.uint64)
+      else:
+        var body = MessageBody(parseData[24..<msgLen])
+        params.messageChannel[].send(Message(header: header, body: body))
       parseData = parseData[msgLen..^1]
 
 proc startRecvThread(node: Node) =
   const SO_RCVBUF: cint = 8
   var tcp_rmem = node.sock.getSockOptInt(SOL_SOCKET, SO_RCVBUF)
   echo "RECVBUF=", tcp_rmem
-  createThread(node.recvThread, nodeRecvThread, (node.sock, tcp_rmem, node.messageChannel))
+  createThread(node.recvThread, nodeRecvThread, (node.sock, tcp_rmem, node.messageChannel, addr node.stats.recv))
 
 proc connect*(node: Node): bool =
   node.sock = createNativeSocket()
   result = node.sock.connect(cast[ptr SockAddr](addr node.sin), sizeof(node.sin).SockLen) == 0
   node.messageChannel = cast[ptr Channel[Message]](allocShared0(sizeof(Channel[Message])))
   node.messageChannel[].open()
+  node.stats = cast[ptr IngestStats](allocShared0(sizeof(IngestStats)))
   node.startRecvThread()
 
 proc close*(node: Node) =
@@ -129,8 +187,17 @@ proc close*(node: Node) =
     let e = getCurrentException()
     echo e.name, ": ", e.msg
   node.recvThread.joinThread()
+  while true:
+    let (ok, message) = node.messageChannel[].tryRecv()
+    if not ok:
+      break
+    if not message.data.isNil:
+      deallocShared(message.data)
   node.messageChannel[].close()
   deallocShared(node.messageChannel)
+  # the parse workers are joined when start returns
+  deallocShared(node.stats)
+  node.stats = nil
 
 proc send*(sock: SocketHandle, data: seq[byte]): bool =
   var ret = sock.send(unsafeAddr data[0], data.len.cint, 0.cint)
@@ -145,8 +212,40 @@ proc send*(sock: SocketHandle, data: seq[byte]): bool =
 
 var abort = false
 
+proc freeJob(job: ptr BlockJob) =
+  if not job.txids.isNil:
+    deallocShared(job.txids)
+  if not job.addrHashes.isNil:
+    deallocShared(job.addrHashes)
+  deallocShared(job.data)
+  deallocShared(job)
+
+proc blockParseWorker(params: ParseWorkerParams) {.thread.} =
+  while true:
+    let job = params.jobs[].recv()
+    if job.isNil:
+      break
+    let startTime = epochTime()
+    try:
+      let blk = toBlockView(job.data, job.size)
+      if blk.txs.len > 0:
+        let txids = blk.txidBins()
+        job.txids = cast[ptr UncheckedArray[array[32, byte]]](allocShared(sizeof(array[32, byte]) * txids.len))
+        copyMem(job.txids, unsafeAddr txids[0], sizeof(array[32, byte]) * txids.len)
+      if blk.outsLen > 0:
+        job.addrHashes = cast[ptr UncheckedArray[AddrHashObj]](allocShared(sizeof(AddrHashObj) * blk.outsLen))
+        blk.addrHashes(job.addrHashes)
+    except:
+      job.err = true
+    inc(params.stats.count)
+    params.stats.bytes.inc(job.size.uint64)
+    params.stats.time = params.stats.time + (epochTime() - startTime)
+    params.results[].send(job)
+
 proc start*(node: Node, params: NodeParams, startHeight: int, startBlkHash: BlockHash,
-            cb: proc(height: int, hash: BlockHash, blk: Block): bool {.gcsafe.}) =
+            cb: proc(height: int, hash: BlockHash, blk: BlockView): bool {.gcsafe.}) =
+  ## Blocks are parsed by BLOCK_PARSE_WORKERS threads, cb is called from
+  ## this thread in block order.
   var height = startHeight
   var blockHashes: seq[BlockHash]
   var reqHashes: seq[BlockHash]
@@ -161,122 +260,210 @@ proc start*(node: Node, params: NodeParams, startHeight: int, startBlkHash: Bloc
     if not flag:
       raise newException(BlockParserError, "send error")
 
-  checkSendErr node.sock.send(node.message("version", node.msgVersion()))
-
-  var check_count = 0
-  var start_flag = false
-  while not abort:
-    var queue = node.messageChannel[].peek()
-    if queue < 500 and reqHashes.len < 500 and blockHashes.len > 0:
-      var data = node.message("getblocks", (node.protocolVersion.uint32, VarInt(1),
-                        blockHashes[^1], Pad(32)).toBytes)
-      # The last hash may not be the next one, but the latest one.
-      # In that case, it will be resolved after processing the blocks.
-      checkSendErr node.sock.send(data)
-
-      var invs: seq[byte]
-      var n = 0
-      for h in blockHashes:
-        reqHashes.add(h)
-        invs &= (MSG_BLOCK.ord.uint32, h).toBytes
-        inc(n)
-      blockHashes = @[]
-      var getdataMsg = node.message("getdata", (VarInt(n), invs).toBytes)
-      checkSendErr node.sock.send(getdataMsg)
-      when SEND_PING:
-        prevSendTime = epochTime()
-    else:
-      when SEND_PING:
-        let curEpochTime = epochTime()
-        if curEpochTime - prevSendTime > 180.0:
-          checkSendErr node.sock.send(node.message("ping", curEpochTime.uint64.toBytes))
-          prevSendTime = curEpochTime
-      else:
-        discard
+  var jobs = cast[ptr Channel[ptr BlockJob]](allocShared0(sizeof(Channel[ptr BlockJob])))
+  var results = cast[ptr Channel[ptr BlockJob]](allocShared0(sizeof(Channel[ptr BlockJob])))
+  jobs[].open(BLOCK_PARSE_QUEUE + BLOCK_PARSE_WORKERS)
+  results[].open()
+  var parseThreads: array[BLOCK_PARSE_WORKERS, Thread[ParseWorkerParams]]
+  for i in 0..<BLOCK_PARSE_WORKERS:
+    createThread(parseThreads[i], blockParseWorker, (jobs, results, addr node.stats.parse[i]))
+
+  var submitSeq = 0
+  var writeSeq = 0
+  var pending = initTable[int, ptr BlockJob]()
+
+  proc processResult(job: ptr BlockJob) =
+    pending[job.seqNo] = job
+    while pending.hasKey(writeSeq):
+      let j = pending[writeSeq]
+      pending.del(writeSeq)
+      inc(writeSeq)
+      try:
+        if abort:
+          continue
+        if j.err:
+          raise newException(BlockParserError, "block parse failed height=" & $j.height)
+        let blk = toBlockView(j.data, j.size)
+        blk.txidsPre = j.txids
+        blk.addrHashesPre = j.addrHashes
+        let startTime = epochTime()
+        if not cb(j.height, BlockHash(@(j.hash)), blk):
+          abort = true
+        inc(node.stats.write.count)
+        node.stats.write.bytes.inc(j.size.uint64)
+        node.stats.write.time = node.stats.write.time + (epochTime() - startTime)
+        if node.stats.write.count mod 10000 == 0:
+          echo node.ingestStats()
+      finally:
+        freeJob(j)
+
+  proc submit(height: int, hash: BlockHash, data: ptr UncheckedArray[byte], size: int) =
+    while submitSeq - writeSeq >= BLOCK_PARSE_QUEUE:
+      processResult(results[].recv())
+    let job = cast[ptr BlockJob](allocShared0(sizeof(BlockJob)))
+    job.seqNo = submitSeq
+    job.height = height
+    let hashBytes = hash.toBytes
+    copyMem(addr job.hash[0], unsafeAddr hashBytes[0], 32)
+    job.data = data
+    job.size = size
+    inc(submitSeq)
+    jobs[].send(job)
 
-    if queue > 0:
-      var message = node.messageChannel[].recv()
-      case message.header.command
-      of "version":
-        checkSendErr node.sock.send(node.message("verack"))
+  try:
+    checkSendErr node.sock.send(node.message("version", node.msgVersion()))
+
+    var check_count = 0
+    var start_flag = false
+    while not abort:
+      while true:
+        let (ok, job) = results[].tryRecv()
+        if not ok:
+          break
+        processResult(job)
+      if abort:
+        break
 
-      of "verack":
+      var queue = node.messageChannel[].peek()
+      if queue < 500 and reqHashes.len < 500 and blockHashes.len > 0:
         var data = node.message("getblocks", (node.protocolVersion.uint32, VarInt(1),
-                               startBlkHash, Pad(32)).toBytes)
+                          blockHashes[^1], Pad(32)).toBytes)
+        # The last hash may not be the next one, but the latest one.
+        # In that case, it will be resolved after processing the blocks.
         checkSendErr node.sock.send(data)
 
-      of "ping":
-        checkSendErr node.sock.send(node.message("pong", message.body))
-
-      of "pong":
-        discard
-
-      of "inv":
-        var reader = newReader(message.body)
-        var n = reader.getVarInt
-        for i in 0..<n:
-          var invType = reader.getUint32
-
-          if InventryType(invType) == InventryType.MSG_BLOCK:
-            var hash = BlockHash(reader.getBytes(32))
-            blockHashes.add(hash)
-          else:
-            reader.skip(32)
-
-      of "block":
-        var blk = message.body.toBlock
-        if reqHashes.len > 0:
-          var hash = reqHashes[0]
-          reqHashes = reqHashes[1..^1]
-          if prevBlkHash == blk.header.prev or prevBlkHash.toBytes.len == 0:
-            prevBlkHash = hash
-            prevBlkTime = blk.header.time.int64
-            inc(height)
-            if not cb(height, hash, blk):
-              abort = true
-          elif reqHashes.len == 0 and blockHashes.len == 0 and hash != prevBlkHash:
-            start_flag = false
-            check_count = 0
-            var data = node.message("getblocks", (node.protocolVersion.uint32, VarInt(1),
-                        prevBlkHash, Pad(32)).toBytes)
-            checkSendErr node.sock.send(data)
-
-      of "reject":
-        var reader = newReader(message.body)
-        var reject_message = reader.getVarStr
-        var reject_code = reader.getUint8
-        var reject_reason = reader.getVarStr
-        stdout.eraseLine
-        echo message.header.command &
-              " message=" & reject_message &
-              " code=" & reject_code.toHex &
-              " reason=" & reject_reason
-
+        var invs: seq[byte]
+        var n = 0
+        for h in blockHashes:
+          reqHashes.add(h)
+          invs &= (MSG_BLOCK.ord.uint32, h).toBytes
+          inc(n)
+        blockHashes = @[]
+        var getdataMsg = node.message("getdata", (VarInt(n), invs).toBytes)
+        checkSendErr node.sock.send(getdataMsg)
+        when SEND_PING:
+          prevSendTime = epochTime()
       else:
-        stdout.eraseLine
-        echo "ignore ", message.header.command
-
-      if not start_flag and (reqHashes.len > 0 or blockHashes.len > 0):
-        start_flag = true
-
-    else:
-      sleep(100)
-      if start_flag:
-        if reqHashes.len == 0 and blockHashes.len == 0:
-          break
-        if reqHashesWaitCount > 0:
-            dec(reqHashesWaitCount)
-        elif reqHashes.len > 0:
-          if prevReqHash0 == reqHashes[0]:
-            let curEpochTime = epochTime()
+        when SEND_PING:
+          let curEpochTime = epochTime()
+          if curEpochTime - prevSendTime > 180.0:
             checkSendErr node.sock.send(node.message("ping", curEpochTime.uint64.toBytes))
-            reqHashesWaitCount = 200
-          else:
-            prevReqHash0 = reqHashes[0]
+            prevSendTime = curEpochTime
+        else:
+          discard
+
+      if queue > 0:
+        var message = node.messageChannel[].recv()
+        case message.header.command
+        of "version":
+          checkSendErr node.sock.send(node.message("verack"))
+
+        of "verack":
+          var data = node.message("getblocks", (node.protocolVersion.uint32, VarInt(1),
+                                 startBlkHash, Pad(32)).toBytes)
+          checkSendErr node.sock.send(data)
+
+        of "ping":
+          checkSendErr node.sock.send(node.message("pong", message.body))
+
+        of "pong":
+          discard
+
+        of "inv":
+          var reader = newReader(message.body)
+          var n = reader.getVarInt
+          for i in 0..<n:
+            var invType = reader.getUint32
+
+            if InventryType(invType) == InventryType.MSG_BLOCK:
+              var hash = BlockHash(reader.getBytes(32))
+              blockHashes.add(hash)
+            else:
+              reader.skip(32)
+
+        of "block":
+          if message.data.isNil or message.size < sizeof(BlockHeaderObj):
+            if not message.data.isNil:
+              deallocShared(message.data)
+            raise newException(BlockParserError, "block message too short")
+          let header = cast[ptr BlockHeaderObj](message.data)
+          if reqHashes.len > 0:
+            var hash = reqHashes[0]
+            reqHashes = reqHashes[1..^1]
+            if prevBlkHash == header.prev or prevBlkHash.toBytes.len == 0:
+              prevBlkHash = hash
+              prevBlkTime = header.time.int64
+              inc(height)
+              submit(height, hash, message.data, message.size)
+              message.data = nil
+            elif reqHashes.len == 0 and blockHashes.len == 0 and hash != prevBlkHash:
+              start_flag = false
+              check_count = 0
+              var data = node.message("getblocks", (node.protocolVersion.uint32, VarInt(1),
+                          prevBlkHash, Pad(32)).toBytes)
+              checkSendErr node.sock.send(data)
+          if not message.data.isNil:
+            deallocShared(message.data)
+
+        of "reject":
+          var reader = newReader(message.body)
+          var reject_message = reader.getVarStr
+          var reject_code = reader.getUint8
+          var reject_reason = reader.getVarStr
+          stdout.eraseLine
+          echo message.header.command &
+                " message=" & reject_message &
+                " code=" & reject_code.toHex &
+                " reason=" & reject_reason
+
+        else:
+          stdout.eraseLine
+          echo "ignore ", message.header.command
+
+        if not start_flag and (reqHashes.len > 0 or blockHashes.len > 0):
+          start_flag = true
+
+      elif submitSeq > writeSeq:
+        processResult(results[].recv())
+
       else:
-        inc(check_count)
-        if check_count >= 200:
-          break
+        sleep(100)
+        if start_flag:
+          if reqHashes.len == 0 and blockHashes.len == 0:
+            break
+          if reqHashesWaitCount > 0:
+              dec(reqHashesWaitCount)
+          elif reqHashes.len > 0:
+            if prevReqHash0 == reqHashes[0]:
+              let curEpochTime = epochTime()
+              checkSendErr node.sock.send(node.message("ping", curEpochTime.uint64.toBytes))
+              reqHashesWaitCount = 200
+            else:
+              prevReqHash0 = reqHashes[0]
+        else:
+          inc(check_count)
+          if check_count >= 200:
+            break
+
+    while writeSeq < submitSeq:
+      processResult(results[].recv())
+
+  finally:
+    for i in 0..<BLOCK_PARSE_WORKERS:
+      jobs[].send(nil)
+    joinThreads(parseThreads)
+    while true:
+      let (ok, job) = results[].tryRecv()
+      if not ok:
+        break
+      freeJob(job)
+    for job in pending.values:
+      freeJob(job)
+    jobs[].close()
+    results[].close()
+    deallocShared(jobs)
+    deallocShared(results)
+    echo node.ingestStats()
 
 
 proc stop*() =
@@ -2,6 +2,7 @@
 
 import sequtils, json
 import bytes, utils, reader, address, script
+import sha256d_native
 
 type
   Flags* = distinct uint8
@@ -22,6 +23,35 @@ type
     witnesses*: seq[seq[Witness]]
     locktime*: uint32
 
+  ViewArray*[T] = object
+    data*: ptr UncheckedArray[T]
+    len*: int
+
+  TxInView* = object
+    txid*: ptr array[32, byte]
+    n*: uint32
+    sig*: ptr UncheckedArray[byte]
+    sigLen*: int
+    sequence*: uint32
+
+  TxOutView* = object
+    value*: uint64
+    script*: ScriptView
+
+  # offsets into a raw tx buffer, valid while the buffer is alive
+  TxView* = object
+    data*: ptr UncheckedArray[byte]
+    pos*: int
+    size*: int
+    ver*: int32
+    flags*: Flags
+    insPos*: int
+    outsEnd*: int
+    locktime*: uint32
+    ins*: ViewArray[TxInView]
+    outs*: ViewArray[TxOutView]
+    outsIdx*: int
+
 const
   SIGHASH_ALL* = 1
   SIGHASH_NONE* = 2
@@ -132,18 +162,122 @@ proc stripWitness(tx: Tx): Tx =
     outs: tx.outs,
     locktime: tx.locktime)
 
-proc hash(data: seq[byte]): Hash = Hash(sha256d(data).toSeq)
+proc hash(data: seq[byte]): Hash = Hash(@(sha256d(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), data.len)))
 
 proc txid*(tx: Tx): Hash = tx.stripWitness.toBytes.hash
 
 proc hash*(tx: Tx): Hash = tx.toBytes.hash
 
-proc hashBin(data: seq[byte]): seq[byte] = sha256d(data).toSeq
+proc hashBin(data: seq[byte]): seq[byte] = @(sha256d(cast[ptr UncheckedArray[byte]](unsafeAddr data[0]), data.len))
 
 proc txidBin*(tx: Tx): seq[byte] = tx.stripWitness.toBytes.hashBin
 
 proc hashBin*(tx: Tx): seq[byte] = tx.toBytes.hashBin
 
+proc witnessSize(tx: Tx): int =
+  if tx.flags.uint8 == 0'u8:
+    return 0
+  result = 2 # marker, flags
+  for witness in tx.witnesses:
+    result = result + varInt(witness.len).len
+    for w in witness:
+      let size = cast[seq[byte]](w).len
+      result = result + varInt(size).len + size
+
+proc vsize*(tx: Tx, size: int): int =
+  ## Virtual size from the serialized size, weight is base size * 3 + size.
+  let base = size - tx.witnessSize
+  (base * 3 + size + 3) div 4
+
+proc `[]`*[T](a: ViewArray[T], i: int): var T {.inline.} = a.data[i]
+
+iterator items*[T](a: ViewArray[T]): T =
+  for i in 0..<a.len:
+    yield a.data[i]
+
+iterator pairs*[T](a: ViewArray[T]): tuple[key: int, val: T] =
+  for i in 0..<a.len:
+    yield (i, a.data[i])
+
+proc prevHash*(i: TxIn): Hash {.inline.} = i.tx
+
+proc prevHash*(i: TxInView): Hash {.inline.} = Hash(@(i.txid[]))
+
+proc toTxView*(reader: PtrReader, ins: var seq[TxInView], outs: var seq[TxOutView]): TxView =
+  ## Records the tx offsets without copying, inputs and outputs are appended
+  ## to ins and outs. ViewArray pointers are set by setViews once the seqs
+  ## stop growing, until then ins.len and outs.len hold the start index.
+  result.data = reader.data
+  result.pos = reader.pos
+  result.ver = reader.getInt32
+  var insLen = reader.getVarInt
+  if insLen == 0:
+    result.flags = Flags(reader.getUint8)
+    insLen = reader.getVarInt
+    result.insPos = result.pos + 6
+  else:
+    result.insPos = result.pos + 4
+  result.ins.len = ins.len
+  for i in 0..<insLen:
+    var txin: TxInView
+    txin.txid = cast[ptr array[32, byte]](addr reader.data[reader.pos])
+    reader.skip(32)
+    txin.n = reader.getUint32
+    txin.sigLen = reader.getVarInt
+    txin.sig = cast[ptr UncheckedArray[byte]](addr reader.data[reader.pos])
+    reader.skip(txin.sigLen)
+    txin.sequence = reader.getUint32
+    ins.add(txin)
+  let outsLen = reader.getVarInt
+  result.outs.len = outs.len
+  for i in 0..<outsLen:
+    var txout: TxOutView
+    txout.value = reader.getUint64
+    txout.script.len = reader.getVarInt
+    txout.script.data = cast[ptr UncheckedArray[byte]](addr reader.data[reader.pos])
+    reader.skip(txout.script.len)
+    outs.add(txout)
+  result.outsEnd = reader.pos
+  if result.flags.uint8 == 1'u8:
+    for i in 0..<insLen:
+      let witnessLen = reader.getVarInt
+      for j in 0..<witnessLen:
+        reader.skip(reader.getVarInt)
+  result.locktime = reader.getUint32
+  result.size = reader.pos - result.pos
+
+proc setViews*(tx: var TxView, ins: var seq[TxInView], outs: var seq[TxOutView], insEnd, outsEnd: int) =
+  let insStart = tx.ins.len
+  let outsStart = tx.outs.len
+  tx.outsIdx = outsStart
+  tx.ins.len = insEnd - insStart
+  if tx.ins.len > 0:
+    tx.ins.data = cast[ptr UncheckedArray[TxInView]](addr ins[insStart])
+  tx.outs.len = outsEnd - outsStart
+  if tx.outs.len > 0:
+    tx.outs.data = cast[ptr UncheckedArray[TxOutView]](addr outs[outsStart])
+
+var txidBuf {.threadvar.}: seq[byte]
+
+proc txidBin*(tx: TxView): seq[byte] =
+  ## Hashes the non-witness byte ranges in place, segwit txs are joined in
+  ## a reused buffer first.
+  if tx.flags.uint8 == 0'u8:
+    result = @(sha256d(cast[ptr UncheckedArray[byte]](addr tx.data[tx.pos]), tx.size))
+  else:
+    let insSize = tx.outsEnd - tx.insPos
+    let size = 4 + insSize + 4
+    if txidBuf.len < size:
+      txidBuf.setLen(size)
+    copyMem(addr txidBuf[0], addr tx.data[tx.pos], 4)
+    copyMem(addr txidBuf[4], addr tx.data[tx.insPos], insSize)
+    copyMem(addr txidBuf[4 + insSize], addr tx.data[tx.pos + tx.size - 4], 4)
+    result = @(sha256d(cast[ptr UncheckedArray[byte]](addr txidBuf[0]), size))
+
+proc txid*(tx: TxView): Hash {.inline.} = Hash(tx.txidBin)
+
+proc toTx*(tx: TxView): Tx {.inline.} = toTx(cast[ptr UncheckedArray[byte]](addr tx.data[tx.pos]), tx.size)
+
 proc `%`*(o: Flags): JsonNode = newJInt(o.int)
 
 proc `%`*(o: Hash): JsonNode = newJString($o)
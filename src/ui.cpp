@@ -13,6 +13,8 @@
 #include <string>
 #include <ctime>
 #include <iomanip>
+#include <cstring>
+#include <stdexcept>
 #include "../deps/zbar/include/zbar.h"
 #include "ui.h"
 
@@ -81,9 +83,214 @@ extern "C" void uiError(const char* msg);
 
 extern "C" bool streamSend(const char* data, int size);
 
+// binary stream records, see streambin.nim for the layouts
+enum BinType {
+    BinNone,
+    BinAddr,
+    BinUtxo,
+    BinAddrlog,
+    BinHeight,
+    BinStatus,
+    BinTx
+};
+
+enum BinFlag {
+    BinFlagVal = 0x01,
+    BinFlagUnconf = 0x02,
+    BinFlagNext = 0x04,
+    BinFlagHeight = 0x08,
+    BinFlagConfirmed = 0x10
+};
+
+struct BinReader {
+    const uint8_t* p;
+    const uint8_t* end;
+
+    BinReader(const char* data, int size) : p((const uint8_t*)data), end((const uint8_t*)data + size) {}
+
+    void need(size_t len) {
+        if ((size_t)(end - p) < len) {
+            throw std::out_of_range("bin record");
+        }
+    }
+
+    template <typename T> T get() {
+        T v;
+        need(sizeof(T));
+        memcpy(&v, p, sizeof(T));
+        p += sizeof(T);
+        return v;
+    }
+
+    std::string str(size_t len) {
+        need(len);
+        std::string s((const char*)p, len);
+        p += len;
+        return s;
+    }
+
+    std::string str8() {
+        return str(get<uint8_t>());
+    }
+
+    std::string hash() {
+        static const char hex[] = "0123456789abcdef";
+        need(32);
+        std::string s(64, '0');
+        for (int i = 0; i < 32; i++) {
+            uint8_t b = p[31 - i];
+            s[i * 2] = hex[b >> 4];
+            s[i * 2 + 1] = hex[b & 0x0f];
+        }
+        p += 32;
+        return s;
+    }
+};
+
+static json decodeBin(const char* data, int size) {
+    BinReader r(data, size);
+    json j;
+    json d;
+    int type = r.get<uint8_t>();
+    uint16_t refLen = r.get<uint16_t>();
+    if (refLen > 0) {
+        j["ref"] = json::parse(r.str(refLen));
+    }
+    if (type == BinHeight) {
+        j["type"] = "height";
+        d["nid"] = r.get<uint16_t>();
+        d["height"] = r.get<uint32_t>();
+        d["sid"] = r.get<uint64_t>();
+    } else if (type == BinStatus) {
+        j["type"] = "status";
+        d["nid"] = r.get<uint16_t>();
+        d["network"] = r.str8();
+        d["height"] = r.get<uint32_t>();
+        d["hash"] = r.hash();
+        d["blkTime"] = r.get<int64_t>();
+        d["lastHeight"] = r.get<uint32_t>();
+    } else if (type == BinAddr) {
+        j["type"] = "addr";
+        d["nid"] = r.get<uint16_t>();
+        d["addr"] = r.str8();
+        uint8_t flags = r.get<uint8_t>();
+        if (flags & BinFlagVal) {
+            d["val"] = r.get<uint64_t>();
+            d["utxo_count"] = r.get<uint32_t>();
+        }
+        if (flags & BinFlagUnconf) {
+            d["unconf"]["out"] = r.get<uint64_t>();
+            d["unconf"]["in"] = r.get<uint64_t>();
+        }
+        if (flags & BinFlagHeight) {
+            d["height"] = r.get<uint32_t>();
+            d["sid"] = r.get<uint64_t>();
+        }
+    } else if (type == BinUtxo) {
+        j["type"] = "utxo";
+        d["nid"] = r.get<uint16_t>();
+        d["addr"] = r.str8();
+        uint8_t flags = r.get<uint8_t>();
+        json utxos = json::array();
+        uint32_t count = r.get<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            json u;
+            u["id"] = r.get<uint64_t>();
+            u["tx"] = r.hash();
+            u["n"] = r.get<uint32_t>();
+            u["val"] = r.get<uint64_t>();
+            utxos.push_back(u);
+        }
+        d["utxos"] = utxos;
+        if (flags & BinFlagNext) {
+            d["next"] = r.get<uint64_t>();
+        }
+        if (flags & BinFlagUnconf) {
+            json txouts = json::array();
+            json spents = json::array();
+            count = r.get<uint32_t>();
+            for (uint32_t i = 0; i < count; i++) {
+                json t;
+                t["tx"] = r.hash();
+                t["n"] = r.get<uint32_t>();
+                t["val"] = r.get<uint64_t>();
+                txouts.push_back(t);
+            }
+            count = r.get<uint32_t>();
+            for (uint32_t i = 0; i < count; i++) {
+                json t;
+                t["tx"] = r.hash();
+                t["n"] = r.get<uint32_t>();
+                t["val"] = r.get<uint64_t>();
+                t["by"] = r.hash();
+                spents.push_back(t);
+            }
+            d["unconf"]["txouts"] = txouts;
+            d["unconf"]["spents"] = spents;
+        }
+    } else if (type == BinAddrlog) {
+        j["type"] = "addrlog";
+        d["nid"] = r.get<uint16_t>();
+        d["addr"] = r.str8();
+        uint8_t flags = r.get<uint8_t>();
+        json addrlogs = json::array();
+        uint32_t count = r.get<uint32_t>();
+        for (uint32_t i = 0; i < count; i++) {
+            json a;
+            a["id"] = r.get<uint64_t>();
+            a["tx"] = r.hash();
+            a["trans"] = r.get<uint8_t>();
+            a["val"] = r.get<uint64_t>();
+            a["height"] = r.get<uint32_t>();
+            a["blktime"] = r.get<int64_t>();
+            a["mined"] = r.get<uint8_t>();
+            addrlogs.push_back(a);
+        }
+        d["addrlogs"] = addrlogs;
+        if (flags & BinFlagNext) {
+            d["next"] = r.get<uint64_t>();
+        }
+    } else if (type == BinTx) {
+        j["type"] = "tx";
+        d["nid"] = r.get<uint16_t>();
+        d["err"] = 0;
+        uint8_t flags = r.get<uint8_t>();
+        json res;
+        res["txid"] = r.hash();
+        res["fee"] = r.get<uint64_t>();
+        for (const char* key : {"ins", "outs"}) {
+            json addrs = json::array();
+            uint16_t count = r.get<uint16_t>();
+            for (uint16_t i = 0; i < count; i++) {
+                json a;
+                a["addr"] = r.str8();
+                a["val"] = r.get<uint64_t>();
+                a["count"] = r.get<uint32_t>();
+                addrs.push_back(a);
+            }
+            res[key] = addrs;
+        }
+        if (flags & BinFlagConfirmed) {
+            res["height"] = r.get<uint32_t>();
+            res["time"] = r.get<int64_t>();
+            res["id"] = r.get<uint64_t>();
+        }
+        d["res"] = res;
+    } else {
+        throw std::out_of_range("bin type");
+    }
+    j["data"] = d;
+    return j;
+}
+
 extern "C" void streamRecv(char* data, int size) {
-    std::string s(data, size);
-    auto j = json::parse(s);
+    json j;
+    if (size > 0 && (uint8_t)data[0] < 0x20) {
+        j = decodeBin(data, size);
+    } else {
+        std::string s(data, size);
+        j = json::parse(s);
+    }
     if (j["type"] == "noralist") {
         noraList = j["data"];
     } else if(j["type"] == "status") {
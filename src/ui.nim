@@ -47,6 +47,9 @@ else:
   include config_default
 
 const DECODE_BUF_SIZE = 1048576
+when not declared(STREAM_BINARY):
+  const STREAM_BINARY = true
+const STREAM_FLAG_BINARY = 1'u8 # same as streambin
 
 type
   StreamStage {.pure.} = enum
@@ -138,6 +141,8 @@ proc onMessage*(stream: Stream, data: ptr UncheckedArray[byte], size: cint) {.ex
         stream.ctr.setKey(shared, salt, salt_srv)
 
         var pubsalt = (pub, salt).toBytes
+        when STREAM_BINARY:
+          pubsalt.add(STREAM_FLAG_BINARY)
         let retSend = stream.unsecureSend(cast[ptr UncheckedArray[byte]](addr pubsalt[0]), pubsalt.len.cint)
         debug "retSend=", retSend
 
@@ -45,7 +45,10 @@ converter KVHandleToVar*[T](p: ptr KVHandle[T]): var KVHandle[T] {.inline.} = p[
 
 template loadUthashModules*() {.dirty.} =
   proc newKVPair*[T](key: openArray[byte], val: T): KVPair[T] =
-    let kvpair = cast[KVPair[T]](allocShared0(sizeof(KVPairObj[T]) + key.len))
+    when declared(allocPair):
+      let kvpair = cast[KVPair[T]](allocPair(sizeof(KVPairObj[T]) + key.len))
+    else:
+      let kvpair = cast[KVPair[T]](allocShared0(sizeof(KVPairObj[T]) + key.len))
     kvpair.key.size = key.len.cint
     copyMem(addr kvpair.key.data, unsafeAddr key[0], key.len)
     kvpair.val = val
@@ -55,9 +58,12 @@ template loadUthashModules*() {.dirty.} =
     {.warning: "missing custom proc freeVal*[T](val: T)".}
     proc freeVal[T](val: T) = discard
 
-  proc free*(pair: KVPair) =
+  proc free*[T](pair: KVPair[T]) =
     pair.val.freeVal()
-    pair.deallocShared()
+    when declared(freePair):
+      freePair(pair, sizeof(KVPairObj[T]) + pair.key.size.int)
+    else:
+      pair.deallocShared()
 
   proc add*[T](kv: var KVHandle[T], key: openArray[byte], val: T) =
     var keyval = newKVPair[T](key, val)
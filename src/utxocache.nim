@@ -0,0 +1,159 @@
+# Copyright (c) 2021 zenywallet
+
+import os, tables
+import bytes, db, address
+import hashtable
+
+const UTXO_CACHE_FULL_PERCENT = 75
+
+type
+  UtxoKey* {.packed.} = object
+    txid*: array[32, byte]
+    n*: uint32
+
+  UtxoState* {.pure.} = enum
+    Empty
+    Clean   # unspent is also in the db
+    Dirty   # unspent is only in the cache
+
+  UtxoVal* {.packed.} = object
+    id*: uint64
+    value*: uint64
+    hash160*: array[20, byte]
+    addressType*: uint8
+    state*: UtxoState
+
+  UtxoCache* = object
+    table: HashTableMmap[UtxoKey, UtxoVal]
+    dirtyKeys: seq[UtxoKey]
+    hit*: uint64
+    miss*: uint64
+
+  UtxoResult* = tuple[id: uint64, value: uint64, address_hash: Hash160, address_type: uint8]
+
+  AddrValDelta = ref object
+    add: uint64
+    sub: uint64
+    add_count: uint32
+    sub_count: uint32
+    height: int # first block that added to the address in the window
+
+  AddrValDeltas* = Table[seq[byte], AddrValDelta]
+
+  UtxoCacheError* = object of CatchableError
+
+proc toUint64(key: UtxoKey): uint64 {.inline.} =
+  var key = key
+  cast[ptr uint64](addr key.txid[0])[] xor key.n.uint64
+
+proc empty*(pair: HashTableData): bool = pair.val.state == UtxoState.Empty
+proc setEmpty*(pair: HashTableData) = pair.val.state = UtxoState.Empty
+loadHashTableModules()
+
+proc toUtxoKey*(txid: Hash, n: uint32): UtxoKey =
+  let b = cast[seq[byte]](txid)
+  if b.len == 32:
+    copyMem(addr result.txid[0], unsafeAddr b[0], 32)
+  result.n = n
+
+proc toHash160(val: UtxoVal): Hash160 =
+  if val.addressType == AddressType.Unknown.uint8:
+    Hash160(@[])
+  else:
+    Hash160(@(val.hash160))
+
+proc clear*(cache: var UtxoCache) =
+  cache.table.clear()
+  cache.table.dataCount = 0
+  cache.dirtyKeys.setLen(0)
+
+proc openUtxoCache*(mmapFile: string, cacheSize: int): UtxoCache =
+  let dataLen = cacheSize div sizeof(HashTableDataObj[UtxoKey, UtxoVal])
+  # the cache is never reused, entries are lost with the uncommitted batch
+  if fileExists(mmapFile):
+    removeFile(mmapFile)
+  result.table = openHashTable[UtxoKey, UtxoVal](dataLen, mmapFile)
+  result.clear()
+
+proc close*(cache: var UtxoCache) =
+  cache.clear()
+  cache.table.close()
+
+proc len*(cache: var UtxoCache): int = cache.table.dataCount
+
+proc full*(cache: var UtxoCache): bool =
+  ## Spent entries stay in the bitmap and are probed by every lookup that
+  ## collides with them, so the limit counts them with the live entries.
+  cache.table.usedCount >= cache.table.dataLen * UTXO_CACHE_FULL_PERCENT div 100
+
+proc add*(cache: var UtxoCache, txid: Hash, n: uint32, id: uint64, value: uint64,
+          address_hash: Hash160, address_type: uint8) =
+  let key = toUtxoKey(txid, n)
+  var val = UtxoVal(id: id, value: value, addressType: address_type, state: UtxoState.Dirty)
+  let h = cast[seq[byte]](address_hash)
+  if h.len == 20:
+    copyMem(addr val.hash160[0], unsafeAddr h[0], 20)
+  cache.table.set(key, val)
+  cache.dirtyKeys.add(key)
+
+proc spend*(cache: var UtxoCache, dbBatch: DbBatch, txid: Hash, n: uint32): DbResult[UtxoResult] =
+  ## Removes the outpoint from the cache and the unspents. The unspent is only
+  ## deleted from the db if it was already written by flush.
+  let key = toUtxoKey(txid, n)
+  let pair = cache.table.get(key)
+  if pair.isNil:
+    inc(cache.miss)
+    return DbResult[UtxoResult](err: DbStatus.NotFound)
+  inc(cache.hit)
+  let hash160 = pair.val.toHash160
+  if pair.val.state == UtxoState.Clean:
+    dbBatch.delUnspent(hash160, pair.val.id, n)
+  result = DbResult[UtxoResult](err: DbStatus.Success,
+                                res: (pair.val.id, pair.val.value, hash160, pair.val.addressType))
+  pair.setEmpty()
+  dec(cache.table.dataCount)
+
+proc flush*(cache: var UtxoCache, dbBatch: DbBatch) =
+  ## Writes the unspents still alive in the cache, call before the batch commit.
+  for key in cache.dirtyKeys:
+    let pair = cache.table.get(key)
+    if not pair.isNil and pair.val.state == UtxoState.Dirty:
+      dbBatch.setUnspent(pair.val.toHash160, pair.val.id, key.n, pair.val.value)
+      pair.val.state = UtxoState.Clean
+  cache.dirtyKeys.setLen(0)
+
+proc stats*(cache: var UtxoCache): string =
+  let total = cache.hit + cache.miss
+  let rate = if total > 0: (cache.hit.float * 100.0 / total.float) else: 0.0
+  "utxo cache len=" & $cache.len & " used=" & $cache.table.usedCount & "/" & $cache.table.dataLen &
+    " hit=" & $cache.hit & " miss=" & $cache.miss & " rate=" & $rate.int & "%"
+
+proc newAddrValDeltas*(): AddrValDeltas = initTable[seq[byte], AddrValDelta]()
+
+proc add*(deltas: var AddrValDeltas, hash160: Hash160, value: uint64, utxo_count: uint32, height: int = 0) =
+  var delta = deltas.mgetOrPut(hash160.toBytes, AddrValDelta())
+  if delta.add_count == 0:
+    delta.height = height
+  delta.add = delta.add + value
+  delta.add_count = delta.add_count + utxo_count
+
+proc sub*(deltas: var AddrValDeltas, hash160: Hash160, value: uint64, utxo_count: uint32) =
+  var delta = deltas.mgetOrPut(hash160.toBytes, AddrValDelta())
+  delta.sub = delta.sub + value
+  delta.sub_count = delta.sub_count + utxo_count
+
+proc flush*(deltas: var AddrValDeltas, dbBatch: DbBatch): seq[tuple[height: int, hash160: Hash160]] {.discardable.} =
+  ## Merges the addrval deltas of the batch window, call before the batch commit.
+  ## Returns the new addresses with the height of the block that created them.
+  for key, delta in deltas:
+    var hash160 = Hash160(key)
+    var ret_addrval = dbBatch.getAddrval(hash160)
+    if ret_addrval.err == DbStatus.NotFound:
+      if delta.add_count == 0:
+        raise newException(UtxoCacheError, "address not found " & $hash160)
+      result.add((delta.height, hash160))
+      dbBatch.setAddrval(hash160, delta.add - delta.sub, delta.add_count - delta.sub_count)
+    else:
+      dbBatch.setAddrval(hash160, ret_addrval.res.value + delta.add - delta.sub,
+                        ret_addrval.res.utxo_count + delta.add_count - delta.sub_count)
+  deltas.clear()